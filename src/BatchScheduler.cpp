@@ -0,0 +1,281 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2018 Junhee Yoo and contributors
+    Copyright (C) 2019 SAI Team
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iterator>
+
+#include "BatchScheduler.h"
+#include "Network.h"
+
+BatchScheduler::~BatchScheduler() {
+    stop_workers();
+}
+
+void BatchScheduler::stop_workers() {
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_running = false;
+    }
+    m_cv.notify_all();
+    for (auto& x : m_worker_threads) {
+        x.join();
+    }
+    m_worker_threads.clear();
+}
+
+void BatchScheduler::forward(const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val,
+                             std::vector<float>& output_vbe) {
+    auto entry = std::make_shared<ForwardQueueEntry>(input, output_pol, output_val, output_vbe);
+    std::unique_lock<std::mutex> lk(entry->mutex);
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_forward_queue.push_back(entry);
+
+        if (m_single_eval_in_progress.load()) {
+            m_waittime = std::min(m_waittime + 2, MAX_WAITTIME);
+        }
+    }
+    m_cv.notify_one();
+    entry->cv.wait(lk, [&entry] () { return entry->done; });
+
+    if (m_draining) {
+        throw NetworkHaltException();
+    }
+}
+
+void BatchScheduler::forward_batch(const size_t batch_size,
+                                   const std::vector<float>& input,
+                                   std::vector<float>& output_pol,
+                                   std::vector<float>& output_val,
+                                   std::vector<float>& output_vbe) {
+    const auto in_size = input.size() / batch_size;
+    const auto pol_size = output_pol.size() / batch_size;
+    const auto val_size = output_val.size() / batch_size;
+    const auto vbe_size = output_vbe.size() / batch_size;
+
+    auto inputs = std::vector<std::vector<float>>(batch_size);
+    auto pols = std::vector<std::vector<float>>(batch_size);
+    auto vals = std::vector<std::vector<float>>(batch_size);
+    auto vbes = std::vector<std::vector<float>>(batch_size);
+    auto entries = std::vector<std::shared_ptr<ForwardQueueEntry>>{};
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        inputs[b].assign(begin(input) + b * in_size,
+                         begin(input) + (b + 1) * in_size);
+        pols[b].resize(pol_size);
+        vals[b].resize(val_size);
+        vbes[b].resize(vbe_size);
+        entries.emplace_back(std::make_shared<ForwardQueueEntry>(
+            inputs[b], pols[b], vals[b], vbes[b]));
+    }
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        for (auto& entry : entries) {
+            m_forward_queue.push_back(entry);
+        }
+    }
+    m_cv.notify_all();
+
+    // Wait for all of them even when draining: the ones a worker
+    // picked up still write to the outputs.
+    for (auto& entry : entries) {
+        std::unique_lock<std::mutex> lk(entry->mutex);
+        entry->cv.wait(lk, [&entry] () { return entry->done; });
+    }
+
+    if (m_draining) {
+        throw NetworkHaltException();
+    }
+
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        std::copy(begin(pols[b]), end(pols[b]), begin(output_pol) + b * pol_size);
+        std::copy(begin(vals[b]), end(vals[b]), begin(output_val) + b * val_size);
+        std::copy(begin(vbes[b]), end(vbes[b]), begin(output_vbe) + b * vbe_size);
+    }
+}
+
+// batch scheduling heuristic.
+// Returns the batch picked up from the queue (m_forward_queue)
+// 1) Wait for m_waittime milliseconds for full batch
+// 2) if we don't have a full batch then just do a single eval
+//
+// The purpose of m_waittime is to prevent the system from deadlocking
+// because we were waiting for a job too long, while the job is never
+// going to come due to a control dependency (e.g., evals stuck on a
+// critical path).  To do so:
+//
+// 1) if we couldn't form a batch after waiting m_waittime ms, it means
+// that we hit the critical path and should do scalar evals.
+// Wait 1ms shorter next time.
+//
+// 2) if we picked up a single eval, but were getting additional evals
+// while that single eval was being processed, it means that we made
+// the wrong decision.  Wait 2ms longer next time, up to MAX_WAITTIME.
+BatchScheduler::ForwardQueue BatchScheduler::pickup_task(const size_t batch_size) {
+    ForwardQueue inputs;
+    size_t count = 0;
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (true) {
+        if (!m_running) return inputs;
+
+        count = m_forward_queue.size();
+        if (count >= batch_size) {
+            count = batch_size;
+            break;
+        }
+
+        bool timeout = !m_cv.wait_for(
+            lk,
+            std::chrono::milliseconds(m_waittime),
+            [this, batch_size] () {
+                return !m_running || m_forward_queue.size() >= batch_size;
+            }
+        );
+
+        if (!m_forward_queue.empty()) {
+            if (timeout && m_single_eval_in_progress.exchange(true) == false) {
+                // Waited long enough but couldn't form a batch.
+                // Check if there is any other single eval in progress, and if not,
+                // do one from this thread.
+                if (m_waittime > 1) {
+                    m_waittime--;
+                }
+                count = 1;
+                break;
+            }
+        }
+    }
+    // Move 'count' evals from shared queue to local list.
+    auto end = begin(m_forward_queue);
+    std::advance(end, count);
+    std::move(begin(m_forward_queue), end, std::back_inserter(inputs));
+    m_forward_queue.erase(begin(m_forward_queue), end);
+
+    return inputs;
+}
+
+void BatchScheduler::run_batches(const size_t batch_size,
+                                 const BatchForward& forward) {
+    auto batch_input = std::vector<float>();
+    auto batch_output_pol = std::vector<float>();
+    auto batch_output_val = std::vector<float>();
+    auto batch_output_vbe = std::vector<float>();
+
+    while (true) {
+        auto inputs = pickup_task(batch_size);
+        auto count = inputs.size();
+
+        if (!m_running) {
+            return;
+        }
+
+        const auto& first = *inputs.front();
+        const auto in_size = first.in.size();
+        const auto out_pol_size = first.out_p.size();
+        const auto out_val_size = first.out_va.size();
+        const auto out_vbe_size = first.out_vb.size();
+
+        // prepare input for forward() call
+        batch_input.resize(in_size * count);
+        batch_output_pol.resize(out_pol_size * count);
+        batch_output_val.resize(out_val_size * count);
+        batch_output_vbe.resize(out_vbe_size * count);
+
+        auto index = size_t{0};
+        for (auto& x : inputs) {
+            std::copy(begin(x->in), end(x->in), begin(batch_input) + in_size * index);
+            index++;
+        }
+
+        forward(count, batch_input,
+                batch_output_pol, batch_output_val, batch_output_vbe);
+
+        // Get output and copy back
+        index = 0;
+        for (auto& x : inputs) {
+            std::copy(begin(batch_output_pol) + out_pol_size * index,
+                      begin(batch_output_pol) + out_pol_size * (index + 1),
+                      begin(x->out_p));
+            std::copy(begin(batch_output_val) + out_val_size * index,
+                      begin(batch_output_val) + out_val_size * (index + 1),
+                      begin(x->out_va));
+            std::copy(begin(batch_output_vbe) + out_vbe_size * index,
+                      begin(batch_output_vbe) + out_vbe_size * (index + 1),
+                      begin(x->out_vb));
+            {
+                std::unique_lock<std::mutex> lk(x->mutex);
+                x->done = true;
+            }
+            x->cv.notify_all();
+            index++;
+        }
+
+        if (count == 1) {
+            m_single_eval_in_progress = false;
+        }
+    }
+}
+
+void BatchScheduler::drain() {
+    // When signaled to drain requests, this method picks up all pending requests and
+    // wakes them up.  Throws exception once the woken up request sees m_draining.
+    m_draining = true;
+
+    ForwardQueue fq;
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        std::move(m_forward_queue.begin(),
+                  m_forward_queue.end(),
+                  std::back_inserter(fq));
+        m_forward_queue.clear();
+    }
+
+    for (auto& x : fq) {
+        {
+            // dummy lock/unlock to make sure thread in forward() is sleeping
+            std::unique_lock<std::mutex> lk(x->mutex);
+            x->done = true;
+        }
+        x->cv.notify_all();
+    }
+}
+
+void BatchScheduler::resume() {
+    // UCTNode::think() should wait for all child threads to complete before resuming.
+    assert(m_forward_queue.empty());
+
+    m_draining = false;
+}
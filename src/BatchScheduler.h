@@ -0,0 +1,127 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2018 Junhee Yoo and contributors
+    Copyright (C) 2019 SAI Team
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef BATCHSCHEDULER_H_INCLUDED
+#define BATCHSCHEDULER_H_INCLUDED
+#include "config.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ForwardPipe.h"
+
+// Queue of the positions that the search threads evaluate at the same
+// time, which the worker threads of the subclasses evaluate in batches.
+// The search threads wait in forward() until their outputs are ready.
+class BatchScheduler : public ForwardPipe {
+    class ForwardQueueEntry {
+    public:
+        std::mutex mutex;
+        std::condition_variable cv;
+        const std::vector<float>& in;
+        std::vector<float>& out_p;
+        std::vector<float>& out_va;
+        std::vector<float>& out_vb;
+        // Set under mutex when the outputs are ready, or when the
+        // entry is dropped by drain().
+        bool done{false};
+        ForwardQueueEntry(const std::vector<float>& input,
+                          std::vector<float>& output_pol,
+                          std::vector<float>& output_val,
+                          std::vector<float>& output_vbe)
+        : in(input), out_p(output_pol), out_va(output_val), out_vb(output_vbe)
+          {}
+    };
+public:
+    virtual ~BatchScheduler();
+
+    virtual void forward(const std::vector<float>& input,
+                         std::vector<float>& output_pol,
+                         std::vector<float>& output_val,
+                         std::vector<float>& output_vbe);
+    // Queues all the inputs at once, so that the workers can pick them
+    // up together.
+    virtual void forward_batch(const size_t batch_size,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe);
+
+    virtual void drain();
+    virtual void resume();
+
+protected:
+    // Evaluates count positions stored one after the other in input,
+    // storing the outputs in the same way.
+    using BatchForward = std::function<void(size_t count,
+                                            const std::vector<float>& input,
+                                            std::vector<float>& output_pol,
+                                            std::vector<float>& output_val,
+                                            std::vector<float>& output_vbe)>;
+
+    // Loop of a worker thread: evaluates the queued positions with
+    // forward, at most batch_size at a time, until stop_workers().
+    void run_batches(size_t batch_size, const BatchForward& forward);
+    // Stops and joins the workers. Subclasses call it in their
+    // destructor, before the members the workers use are destroyed.
+    void stop_workers();
+
+    std::list<std::thread> m_worker_threads;
+
+private:
+    using ForwardQueue = std::list<std::shared_ptr<ForwardQueueEntry>>;
+
+    // Longest wait for a full batch, in milliseconds.
+    static constexpr int MAX_WAITTIME = 100;
+
+    ForwardQueue pickup_task(size_t batch_size);
+
+    bool m_running = true;
+    std::atomic<bool> m_draining{false};
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    // start with 10 milliseconds : lock protected
+    int m_waittime{10};
+
+    // set to true when single (non-batch) eval is in progress
+    std::atomic<bool> m_single_eval_in_progress{false};
+
+    ForwardQueue m_forward_queue;
+};
+
+#endif
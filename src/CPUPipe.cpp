@@ -43,9 +43,18 @@
 #include <Eigen/Dense>
 #endif
 
+#include <algorithm>
+#include <array>
+#include <thread>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #include "CPUPipe.h"
+#include "GTP.h"
 #include "Network.h"
-#include "Im2Col.h"
+#include "SMP.h"
 
 #ifndef USE_BLAS
 // Eigen helpers
@@ -57,253 +66,480 @@ using ConstEigenMatrixMap =
     Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>>;
 #endif
 
+namespace {
+
+// Buffers of a thread for the forward passes, kept from one call to the
+// next. They grow to the largest batch the thread has evaluated, after
+// which a forward pass allocates nothing.
+struct Workspace {
+    std::vector<float> conv_out;
+    std::vector<float> conv_in;
+    std::vector<float> res;
+    std::vector<float> V;
+    std::vector<float> M;
+
+    void fit(const size_t batch_size,
+             const size_t input_channels,
+             const size_t output_channels) {
+        const auto grow = [](std::vector<float>& v, const size_t size) {
+            if (v.size() < size) {
+                v.resize(size);
+            }
+        };
+        const auto output_size = batch_size * output_channels * NUM_INTERSECTIONS;
+        grow(conv_out, output_size);
+        grow(conv_in, output_size);
+        grow(res, output_size);
+        grow(V, WINOGRAD_TILE * input_channels * WINOGRAD_P * batch_size);
+        grow(M, WINOGRAD_TILE * output_channels * WINOGRAD_P * batch_size);
+    }
+};
+
+thread_local Workspace t_workspace;
+
+}
+
 void CPUPipe::initialize(int channels)
 {
     m_input_channels = channels;
 }
 
-void CPUPipe::winograd_transform_in(const std::vector<float> &in,
-                                    std::vector<float> &V,
-                                    const int C)
-{
+namespace {
+
+// multiple vector [i0..i5] by Bt and produce [o0..o5]
+// const auto Bt = std::array<float, WINOGRAD_TILE>
+//           {1.0f,  0.0f,     -5.0f/2.0f,  0.0f,      1.0f, 0.0f,
+//            0.0f, -SQ2,      -2.0f,       SQ2/2.0f,  1.0f, 0.0f,
+//            0.0f,  SQ2,      -2.0f,      -SQ2/2.0f,  1.0f, 0.0f,
+//            0.0f, -SQ2/2.0f, -1.0f/2.0f,  SQ2,       1.0f, 0.0f,
+//            0.0f,  SQ2/2.0f, -1.0f/2.0f, -SQ2,       1.0f, 0.0f,
+//            0.0f,  1.0f,      0.0f,      -5.0f/2.0f, 0.0f, 1.0f};
+// T is float, or a vector of floats of several channels.
+template <typename T>
+void multiply_bt(
+    T & o0, T & o1, T & o2, T & o3, T & o4, T & o5,
+    const T i0, const T i1, const T i2, const T i3, const T i4, const T i5
+) {
+    auto i3m1 = i1 * -SQ2 + i3 * (SQ2 / 2.0f);
+    auto i4m2 = i2 * -2.0f + i4 * 1.0f;
+
+    o0 = i0 + i2 * (-5.0f/2.0f) + i4;
+    o1 = i3m1 + i4m2;
+    o2 = -i3m1 + i4m2;
+
+    auto i3m1_2 = i3 * (SQ2) + i1 * (-SQ2/2.0f);
+    auto i4m2_2 = i2 * (-1.0f/2.0f) + i4;
+
+    o3 = i3m1_2 + i4m2_2;
+    o4 = -i3m1_2 + i4m2_2;
+
+    o5 = i1 + i3 * (-5.0f/2.0f) + i5;
+}
+
+// multiple vector [i0..i5] by At and produce [o0..o3]
+// const auto At = std::array<float, WINOGRAD_ALPHA * WINOGRAD_M>
+//       {1.0f, 1.0f,      1.0f,       1.0f,      1.0f,     0.0f,
+//        0.0f, SQ2/2.0f, -SQ2/2.0f,   SQ2,      -SQ2,      0.0f,
+//        0.0f, 1.0f/2.0f, 1.0f/2.0f,  2.0f,      2.0f,     0.0f,
+//        0.0f, SQ2/4.0f, -SQ2/4.0f,   2.0f*SQ2, -2.0f*SQ2, 1.0f};
+template <typename T>
+void multiply_at(
+    T & o0, T & o1, T & o2, T & o3,
+    const T i0, const T i1, const T i2, const T i3, const T i4, const T i5
+) {
+    auto t1p2 = (i1 + i2) * (1.0f / 2.0f);
+    auto t1m2 = (i1 - i2) * (SQ2/4.0f);
+    auto t3p4 = i3 + i4;
+    auto t3m4 = (i3 - i4) * (SQ2);
+
+    o0 = i0 + t1p2 + t1p2 + t3p4;
+    o1 = t1m2 + t1m2 + t3m4;
+    o2 = t1p2 + t3p4 + t3p4;
+    o3 = t1m2 + t3m4 + t3m4 + i5;
+}
+
+using WinogradTile =
+    std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
+
+// Calculates transpose(B).d.B
+template <typename T>
+void transform_tile_in(std::array<std::array<T, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>& o,
+                       const std::array<std::array<T, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>& d) {
+    std::array<std::array<T, WINOGRAD_ALPHA>, WINOGRAD_ALPHA> T1;
+    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+        multiply_bt(
+            T1[0][j], T1[1][j], T1[2][j], T1[3][j], T1[4][j], T1[5][j],
+            d[0][j], d[1][j], d[2][j], d[3][j], d[4][j], d[5][j]
+        );
+    }
+    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+        multiply_bt(
+            o[i][0], o[i][1], o[i][2], o[i][3], o[i][4], o[i][5],
+            T1[i][0], T1[i][1], T1[i][2], T1[i][3], T1[i][4], T1[i][5]
+        );
+    }
+}
+
+// Calculates transpose(A).m.A
+template <typename T>
+void transform_tile_out(std::array<std::array<T, WINOGRAD_M>, WINOGRAD_M>& o,
+                        const std::array<std::array<T, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>& m) {
+    std::array<std::array<T, WINOGRAD_ALPHA>, WINOGRAD_M> temp;
+    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+        multiply_at(
+            temp[0][j], temp[1][j], temp[2][j], temp[3][j],
+            m[0][j], m[1][j], m[2][j], m[3][j], m[4][j], m[5][j]
+        );
+    }
+    for (auto i = 0; i < WINOGRAD_M; i++) {
+        multiply_at(
+            o[i][0], o[i][1], o[i][2], o[i][3],
+            temp[i][0], temp[i][1], temp[i][2], temp[i][3], temp[i][4], temp[i][5]
+        );
+    }
+}
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#define USE_WINOGRAD_SIMD
+
+// The floats of a SIMD register, one channel in each.
+struct FloatVec {
+#ifdef __AVX512F__
+    static constexpr auto WIDTH = 16;
+    __m512 v;
+
+    static FloatVec load(const float* const p) { return {_mm512_loadu_ps(p)}; }
+    void store(float* const p) const { _mm512_storeu_ps(p, v); }
+    FloatVec operator+(const FloatVec b) const { return {_mm512_add_ps(v, b.v)}; }
+    FloatVec operator-(const FloatVec b) const { return {_mm512_sub_ps(v, b.v)}; }
+    FloatVec operator-() const { return {_mm512_sub_ps(_mm512_setzero_ps(), v)}; }
+    FloatVec operator*(const float b) const { return {_mm512_mul_ps(v, _mm512_set1_ps(b))}; }
+#else
+    static constexpr auto WIDTH = 8;
+    __m256 v;
+
+    static FloatVec load(const float* const p) { return {_mm256_loadu_ps(p)}; }
+    void store(float* const p) const { _mm256_storeu_ps(p, v); }
+    FloatVec operator+(const FloatVec b) const { return {_mm256_add_ps(v, b.v)}; }
+    FloatVec operator-(const FloatVec b) const { return {_mm256_sub_ps(v, b.v)}; }
+    FloatVec operator-() const { return {_mm256_sub_ps(_mm256_setzero_ps(), v)}; }
+    FloatVec operator*(const float b) const { return {_mm256_mul_ps(v, _mm256_set1_ps(b))}; }
+#endif
+};
+
+// Transforms the channels of the input in groups of FloatVec::WIDTH,
+// returns how many channels it did.
+int transform_in_simd(const std::vector<float>& in,
+                      std::vector<float>& V,
+                      const int C,
+                      const int batch_size) {
     constexpr auto W = BOARD_SIZE;
     constexpr auto H = BOARD_SIZE;
     constexpr auto WTILES = WINOGRAD_WTILES;
     constexpr auto P = WINOGRAD_P;
-
     constexpr auto Wpad = 2 + WINOGRAD_M * WTILES;
+    constexpr auto LANES = FloatVec::WIDTH;
+    const auto N = P * batch_size;
+    const auto groups = C / LANES;
+
+    // The channels of a group side by side, with a border of zeroes.
+    std::array<float, Wpad * Wpad * LANES> in_pad{0.0f};
+
+    using VecTile =
+        std::array<std::array<FloatVec, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
+    VecTile d;
+    VecTile o;
+
+    for (auto batch = 0; batch < batch_size; batch++) {
+        for (auto group = 0; group < groups; group++) {
+            const auto c0 = group * LANES;
+            for (auto lane = 0; lane < LANES; lane++) {
+                const auto plane = &in[(batch * C + c0 + lane) * (W * H)];
+                for (auto yin = 0; yin < H; yin++) {
+                    for (auto xin = 0; xin < W; xin++) {
+                        in_pad[((yin + 1) * Wpad + xin + 1) * LANES + lane] =
+                            plane[yin * W + xin];
+                    }
+                }
+            }
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                // Tiles overlap by 2
+                const auto yin = WINOGRAD_M * block_y;
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+                    const auto xin = WINOGRAD_M * block_x;
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            d[i][j] = FloatVec::load(
+                                &in_pad[((yin + i) * Wpad + xin + j) * LANES]);
+                        }
+                    }
+                    transform_tile_in(o, d);
 
-    constexpr auto buffersize = 32;
+                    const auto n = batch * P + block_y * WTILES + block_x;
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            o[i][j].store(
+                                &V[((i * WINOGRAD_ALPHA + j) * N + n) * C + c0]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return groups * LANES;
+}
 
-    std::array<std::array<float, Wpad>, Wpad> in_pad{0.0f};
+// Transforms the output channels in groups of FloatVec::WIDTH, returns
+// how many channels it did.
+int transform_out_simd(const std::vector<float>& M,
+                       std::vector<float>& Y,
+                       const int K,
+                       const int batch_size,
+                       const float* const bias,
+                       const float* const residual) {
+    constexpr auto W = BOARD_SIZE;
+    constexpr auto H = BOARD_SIZE;
+    constexpr auto WTILES = WINOGRAD_WTILES;
+    constexpr auto P = WINOGRAD_P;
+    constexpr auto LANES = FloatVec::WIDTH;
+    const auto N = P * batch_size;
+    const auto groups = K / LANES;
+
+    // The outputs of a group, channels side by side.
+    std::array<float, NUM_INTERSECTIONS * LANES> out;
+
+    std::array<std::array<FloatVec, WINOGRAD_ALPHA>, WINOGRAD_ALPHA> m;
+    std::array<std::array<FloatVec, WINOGRAD_M>, WINOGRAD_M> o;
 
-    std::array<float, buffersize * WINOGRAD_ALPHA * WINOGRAD_ALPHA> buffer;
-    auto buffer_offset = 0;
-    auto buffer_entries = 0;
-
-
-    // multiple vector [i0..i5] by Bt and produce [o0..o5]
-    // const auto Bt = std::array<float, WINOGRAD_TILE>
-    //           {1.0f,  0.0f,     -5.0f/2.0f,  0.0f,      1.0f, 0.0f,
-    //            0.0f, -SQ2,      -2.0f,       SQ2/2.0f,  1.0f, 0.0f,
-    //            0.0f,  SQ2,      -2.0f,      -SQ2/2.0f,  1.0f, 0.0f,
-    //            0.0f, -SQ2/2.0f, -1.0f/2.0f,  SQ2,       1.0f, 0.0f,
-    //            0.0f,  SQ2/2.0f, -1.0f/2.0f, -SQ2,       1.0f, 0.0f,
-    //            0.0f,  1.0f,      0.0f,      -5.0f/2.0f, 0.0f, 1.0f};
-    auto multiply_bt = [](
-        float & o0, float & o1, float & o2, float & o3, float & o4, float & o5,
-        float i0, float i1, float i2, float i3, float i4, float i5
-    ) {
-        auto i3m1 = i1 * -SQ2 + i3 * (SQ2 / 2.0f);
-        auto i4m2 = i2 * -2.0f + i4 * 1.0f;
-
-        o0 = i0 + i2 * (-5.0f/2.0f) + i4;
-        o1 = i3m1 + i4m2;
-        o2 = -i3m1 + i4m2;
-
-        auto i3m1_2 = i3 * (SQ2) + i1 * (-SQ2/2.0f);
-        auto i4m2_2 = i2 * (-1.0f/2.0f) + i4;
-
-        o3 = i3m1_2 + i4m2_2;
-        o4 = -i3m1_2 + i4m2_2;
-
-        o5 = i1 + i3 * (-5.0f/2.0f) + i5;
-    };
-
-    for (auto ch = 0; ch < C; ch++) {
-        for (auto yin = 0; yin < H; yin++) {
-            for (auto xin = 0; xin < W; xin++) {
-                in_pad[yin + 1][xin + 1] = in[ch*(W*H) + yin*W + xin];
+    for (auto batch = 0; batch < batch_size; batch++) {
+        for (auto group = 0; group < groups; group++) {
+            const auto k0 = group * LANES;
+            const auto bias_vec = FloatVec::load(&bias[k0]);
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                const auto y = WINOGRAD_M * block_y;
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+                    const auto x = WINOGRAD_M * block_x;
+                    const auto n = batch * P + block_y * WTILES + block_x;
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            m[i][j] = FloatVec::load(
+                                &M[((i * WINOGRAD_ALPHA + j) * N + n) * K + k0]);
+                        }
+                    }
+                    transform_tile_out(o, m);
+
+                    for (auto i = 0; i < WINOGRAD_M; i++) {
+                        for (auto j = 0; j < WINOGRAD_M; j++) {
+                            if (y + i < H && x + j < W) {
+                                (o[i][j] + bias_vec).store(
+                                    &out[((y + i) * W + x + j) * LANES]);
+                            }
+                        }
+                    }
+                }
+            }
+            for (auto lane = 0; lane < LANES; lane++) {
+                const auto offset = (batch * K + k0 + lane) * (W * H);
+                const auto plane = &Y[offset];
+                if (residual) {
+                    const auto res = &residual[offset];
+                    for (auto b = 0; b < W * H; b++) {
+                        plane[b] = std::max(out[b * LANES + lane] + res[b], 0.0f);
+                    }
+                } else {
+                    for (auto b = 0; b < W * H; b++) {
+                        plane[b] = std::max(out[b * LANES + lane], 0.0f);
+                    }
+                }
             }
         }
-        for (auto block_y = 0; block_y < WTILES; block_y++)
-        {
-            // Tiles overlap by 2
-            const auto yin = WINOGRAD_M * block_y;
-            for (auto block_x = 0; block_x < WTILES; block_x++)
-            {
-                const auto xin = WINOGRAD_M * block_x;
-#define DECL_T1(XX) \
-                float T1_##XX##_0, T1_##XX##_1, T1_##XX##_2, T1_##XX##_3, T1_##XX##_4, T1_##XX##_5;
-                DECL_T1(0)
-                DECL_T1(1)
-                DECL_T1(2)
-                DECL_T1(3)
-                DECL_T1(4)
-                DECL_T1(5)
-
-                // Calculates transpose(B).x.B
-#define MULTIPLY_BT(XX) \
-                multiply_bt( \
-                    T1_0_##XX, T1_1_##XX, T1_2_##XX, T1_3_##XX, T1_4_##XX, T1_5_##XX, \
-                    in_pad[yin + 0][xin + XX], \
-                    in_pad[yin + 1][xin + XX], \
-                    in_pad[yin + 2][xin + XX], \
-                    in_pad[yin + 3][xin + XX], \
-                    in_pad[yin + 4][xin + XX], \
-                    in_pad[yin + 5][xin + XX] \
-                );
-                MULTIPLY_BT(0)
-                MULTIPLY_BT(1)
-                MULTIPLY_BT(2)
-                MULTIPLY_BT(3)
-                MULTIPLY_BT(4)
-                MULTIPLY_BT(5)
-
-#define MULTIPLY_B(XX) \
-                multiply_bt( \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 0) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 1) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 2) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 3) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 4) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 5) + buffer_entries], \
-                    T1_##XX##_0, T1_##XX##_1, T1_##XX##_2, T1_##XX##_3, T1_##XX##_4, T1_##XX##_5 \
-                );
-                MULTIPLY_B(0)
-                MULTIPLY_B(1)
-                MULTIPLY_B(2)
-                MULTIPLY_B(3)
-                MULTIPLY_B(4)
-                MULTIPLY_B(5)
-
-                if (buffer_entries == 0) {
-                    buffer_offset = ch * P + block_y * WTILES + block_x;
+    }
+    return groups * LANES;
+}
+#endif
+
+// Scalar transform of the channels from first_channel on.
+void transform_in_scalar(const std::vector<float>& in,
+                         std::vector<float>& V,
+                         const int C,
+                         const int batch_size,
+                         const int first_channel) {
+    constexpr auto W = BOARD_SIZE;
+    constexpr auto H = BOARD_SIZE;
+    constexpr auto WTILES = WINOGRAD_WTILES;
+    constexpr auto P = WINOGRAD_P;
+    constexpr auto Wpad = 2 + WINOGRAD_M * WTILES;
+    const auto N = P * batch_size;
+
+    std::array<std::array<float, Wpad>, Wpad> in_pad{0.0f};
+    WinogradTile d;
+    WinogradTile o;
+
+    for (auto batch = 0; batch < batch_size; batch++) {
+        for (auto ch = first_channel; ch < C; ch++) {
+            for (auto yin = 0; yin < H; yin++) {
+                for (auto xin = 0; xin < W; xin++) {
+                    in_pad[yin + 1][xin + 1] =
+                        in[(batch * C + ch) * (W * H) + yin * W + xin];
+                }
+            }
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                // Tiles overlap by 2
+                const auto yin = WINOGRAD_M * block_y;
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+                    const auto xin = WINOGRAD_M * block_x;
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            d[i][j] = in_pad[yin + i][xin + j];
+                        }
+                    }
+                    transform_tile_in(o, d);
+
+                    const auto n = batch * P + block_y * WTILES + block_x;
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            V[((i * WINOGRAD_ALPHA + j) * N + n) * C + ch] =
+                                o[i][j];
+                        }
+                    }
                 }
-                buffer_entries++;
+            }
+        }
+    }
+}
+
+// Scalar transform of the output channels from first_channel on.
+void transform_out_scalar(const std::vector<float>& M,
+                          std::vector<float>& Y,
+                          const int K,
+                          const int batch_size,
+                          const float* const bias,
+                          const float* const residual,
+                          const int first_channel) {
+    constexpr auto W = BOARD_SIZE;
+    constexpr auto H = BOARD_SIZE;
+    constexpr auto WTILES = WINOGRAD_WTILES;
+    constexpr auto P = WINOGRAD_P;
+    const auto N = P * batch_size;
 
-                if (buffer_entries >= buffersize ||
-                    (ch == C - 1 && block_x == WTILES - 1 && block_y == WTILES - 1))
-                {
+    WinogradTile m;
+    std::array<std::array<float, WINOGRAD_M>, WINOGRAD_M> o;
 
-                    for (auto i = 0; i < WINOGRAD_ALPHA * WINOGRAD_ALPHA; i++)
-                    {
-                        for (auto entry = 0; entry < buffer_entries; entry++)
-                        {
-                            V[i * C * P + buffer_offset + entry] = buffer[i * buffersize + entry];
+    for (auto batch = 0; batch < batch_size; batch++) {
+        for (auto k = first_channel; k < K; k++) {
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                const auto y = WINOGRAD_M * block_y;
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+                    const auto x = WINOGRAD_M * block_x;
+                    const auto n = batch * P + block_y * WTILES + block_x;
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            m[i][j] = M[((i * WINOGRAD_ALPHA + j) * N + n) * K + k];
+                        }
+                    }
+                    transform_tile_out(o, m);
+
+                    const auto y_ind = (batch * K + k) * H * W + y * W + x;
+                    for (auto i = 0; i < WINOGRAD_M; i++) {
+                        for (auto j = 0; j < WINOGRAD_M; j++) {
+                            if (y + i < H && x + j < W) {
+                                const auto idx = y_ind + i * W + j;
+                                auto val = o[i][j] + bias[k];
+                                if (residual) {
+                                    val += residual[idx];
+                                }
+                                Y[idx] = std::max(val, 0.0f);
+                            }
                         }
                     }
-                    buffer_entries = 0;
                 }
             }
         }
     }
 }
 
+}
+
+void CPUPipe::winograd_transform_in(const std::vector<float> &in,
+                                    std::vector<float> &V,
+                                    const int C,
+                                    const int batch_size)
+{
+#ifdef USE_WINOGRAD_SIMD
+    const auto done = transform_in_simd(in, V, C, batch_size);
+#else
+    const auto done = 0;
+#endif
+    transform_in_scalar(in, V, C, batch_size, done);
+}
+
+void CPUPipe::winograd_transform_in_ref(const std::vector<float> &in,
+                                        std::vector<float> &V,
+                                        const int C,
+                                        const int batch_size)
+{
+    transform_in_scalar(in, V, C, batch_size, 0);
+}
+
 void CPUPipe::winograd_sgemm(const std::vector<float> &U,
                              const std::vector<float> &V,
                              std::vector<float> &M,
-                             const int C, const int K)
+                             const int C, const int K,
+                             const int N)
 {
-    constexpr auto P = WINOGRAD_P;
-
+    // For each element of the tiles, M[N][K] = V[N][C] x U[C][K]
     for (auto b = 0; b < WINOGRAD_TILE; b++)
     {
         const auto offset_u = b * K * C;
-        const auto offset_v = b * C * P;
-        const auto offset_m = b * K * P;
+        const auto offset_v = b * C * N;
+        const auto offset_m = b * K * N;
 #ifdef USE_BLAS
-        cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
-                    K, P, C,
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    N, K, C,
                     1.0f,
+                    &V[offset_v], C,
                     &U[offset_u], K,
-                    &V[offset_v], P,
                     0.0f,
-                    &M[offset_m], P);
+                    &M[offset_m], K);
 #else
-        auto C_mat = EigenMatrixMap<float>(M.data() + offset_m, P, K);
+        auto C_mat = EigenMatrixMap<float>(M.data() + offset_m, K, N);
         C_mat.noalias() =
-            ConstEigenMatrixMap<float>(V.data() + offset_v, P, C) * ConstEigenMatrixMap<float>(U.data() + offset_u, K, C).transpose();
+            ConstEigenMatrixMap<float>(U.data() + offset_u, K, C) * ConstEigenMatrixMap<float>(V.data() + offset_v, C, N);
 #endif
     }
 }
 
 void CPUPipe::winograd_transform_out(const std::vector<float> &M,
                                      std::vector<float> &Y,
-                                     const int K)
+                                     const int K,
+                                     const int batch_size,
+                                     const float *const bias,
+                                     const float *const residual)
 {
-    constexpr auto W = BOARD_SIZE;
-    constexpr auto H = BOARD_SIZE;
-    constexpr auto WTILES = WINOGRAD_WTILES;
-    constexpr auto P = WINOGRAD_P;
-
-    // multiple vector [i0..i5] by At and produce [o0..o3]
-    // const auto At = std::array<float, WINOGRAD_ALPHA * WINOGRAD_M>
-    //       {1.0f, 1.0f,      1.0f,       1.0f,      1.0f,     0.0f,
-    //        0.0f, SQ2/2.0f, -SQ2/2.0f,   SQ2,      -SQ2,      0.0f,
-    //        0.0f, 1.0f/2.0f, 1.0f/2.0f,  2.0f,      2.0f,     0.0f,
-    //        0.0f, SQ2/4.0f, -SQ2/4.0f,   2.0f*SQ2, -2.0f*SQ2, 1.0f};
-    auto multiply_at = [](
-        float & o0, float & o1, float & o2, float & o3,
-        float i0, float i1, float i2, float i3, float i4, float i5
-    ) {
-        auto t1p2 = (i1 + i2) * (1.0f / 2.0f);
-        auto t1m2 = (i1 - i2) * (SQ2/4.0f);
-        auto t3p4 = i3 + i4;
-        auto t3m4 = (i3 - i4) * (SQ2);
-
-        o0 = i0 + t1p2 + t1p2 + t3p4;
-        o1 = t1m2 + t1m2 + t3m4;
-        o2 = t1p2 + t3p4 + t3p4;
-        o3 = t1m2 + t3m4 + t3m4 + i5;
-    };
-
-    for (auto k = 0; k < K; k++) {
-        for (auto block_x = 0; block_x < WTILES; block_x++) {
-            const auto x = WINOGRAD_M * block_x;
-            for (auto block_y = 0; block_y < WTILES; block_y++)
-            {
-                const auto y = WINOGRAD_M * block_y;
-
-                const auto b = block_y * WTILES + block_x;
-                using WinogradTile =
-                    std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
-                WinogradTile temp_m;
-                for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++)
-                {
-                    for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++)
-                    {
-                        temp_m[xi][nu] =
-                            M[(xi * WINOGRAD_ALPHA + nu) * K * P + k * P + b];
-                    }
-                }
-                std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_M> temp;
-                std::array<std::array<float, WINOGRAD_M>, WINOGRAD_M> o;
-
-                // Calculates transpose(A).temp_m.A
-                for (auto j = 0; j < WINOGRAD_ALPHA; j++){
-                    multiply_at(
-                        temp[0][j], temp[1][j], temp[2][j], temp[3][j],
-                        temp_m[0][j], temp_m[1][j], temp_m[2][j], temp_m[3][j], temp_m[4][j], temp_m[5][j]
-                    );
-                }
-
-                for (auto i = 0; i < WINOGRAD_M; i++){
-                    multiply_at(
-                        o[i][0], o[i][1], o[i][2], o[i][3],
-                        temp[i][0], temp[i][1], temp[i][2], temp[i][3], temp[i][4], temp[i][5]
-                    );
-                }
+#ifdef USE_WINOGRAD_SIMD
+    const auto done = transform_out_simd(M, Y, K, batch_size, bias, residual);
+#else
+    const auto done = 0;
+#endif
+    transform_out_scalar(M, Y, K, batch_size, bias, residual, done);
+}
 
-                const auto y_ind = k * H * W + y * W + x;
-                for (auto i = 0; i < WINOGRAD_M; i++)
-                {
-                    for (auto j = 0; j < WINOGRAD_M; j++)
-                    {
-                        if (y + i < H && x + j < W)
-                        {
-                            Y[y_ind + i * W + j] = o[i][j];
-                        }
-                    }
-                }
-            }
-        }
-    }
+void CPUPipe::winograd_transform_out_ref(const std::vector<float> &M,
+                                         std::vector<float> &Y,
+                                         const int K,
+                                         const int batch_size,
+                                         const float *const bias,
+                                         const float *const residual)
+{
+    transform_out_scalar(M, Y, K, batch_size, bias, residual, 0);
 }
 
-void CPUPipe::winograd_convolve3(const int outputs,
+void CPUPipe::winograd_convolve3(const int batch_size,
+                                 const int outputs,
                                  const std::vector<float> &input,
                                  const std::vector<float> &U,
+                                 const std::vector<float> &bias,
+                                 const float *const residual,
                                  std::vector<float> &V,
                                  std::vector<float> &M,
                                  std::vector<float> &output)
@@ -312,53 +548,54 @@ void CPUPipe::winograd_convolve3(const int outputs,
     constexpr unsigned int filter_len = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
     const auto input_channels = U.size() / (outputs * filter_len);
 
-    winograd_transform_in(input, V, input_channels);
-    winograd_sgemm(U, V, M, input_channels, outputs);
-    winograd_transform_out(M, output, outputs);
+    winograd_transform_in(input, V, input_channels, batch_size);
+    winograd_sgemm(U, V, M, input_channels, outputs,
+                   WINOGRAD_P * batch_size);
+    winograd_transform_out(M, output, outputs, batch_size,
+                           bias.data(), residual);
+}
+
+void CPUPipe::convolve3(const ForwardPipeWeights& weights,
+                        const size_t layer,
+                        const int batch_size,
+                        const std::vector<float>& input,
+                        const float* const residual,
+                        std::vector<float>& output)
+{
+    // forward_batch() has fitted the workspace to the batch.
+    auto& ws = t_workspace;
+    winograd_convolve3(batch_size, m_input_channels, input,
+                       weights.m_conv_weights[layer],
+                       weights.m_conv_biases[layer],
+                       residual, ws.V, ws.M, output);
 }
 
-template <unsigned int filter_size>
-void convolve(const size_t outputs,
-              const std::vector<float> &input,
-              const std::vector<float> &weights,
-              const std::vector<float> &biases,
-              std::vector<float> &output)
+// 1x1 convolution of one position. The input is used as is, a 1x1
+// filter needs no im2col.
+void convolve_1x1(const size_t outputs,
+                  const float *const input,
+                  const std::vector<float> &weights,
+                  const std::vector<float> &biases,
+                  float *const output)
 {
     // The size of the board is defined at compile time
-    constexpr unsigned int width = BOARD_SIZE;
-    constexpr unsigned int height = BOARD_SIZE;
-    constexpr auto num_intersections = width * height;
-    constexpr auto filter_len = filter_size * filter_size;
-    const auto input_channels = weights.size() / (biases.size() * filter_len);
-    const auto filter_dim = filter_len * input_channels;
-    assert(outputs * num_intersections == output.size());
-
-    std::vector<float> col(filter_dim * width * height);
-    im2col<filter_size>(input_channels, input, col);
-
-    // Weight shape (output, input, filter_size, filter_size)
-    // 96 18 3 3
-    // C←αAB + βC
-    // outputs[96,19x19] = weights[96,18x3x3] x col[18x3x3,19x19]
-    // M Number of rows in matrices A and C.
-    // N Number of columns in matrices B and C.
-    // K Number of columns in matrix A; number of rows in matrix B.
-    // lda The size of the first dimention of matrix A; if you are
-    // passing a matrix A[m][n], the value should be m.
-    //    cblas_sgemm(CblasRowMajor, TransA, TransB, M, N, K, alpha, A, lda, B,
-    //                ldb, beta, C, N);
+    constexpr unsigned int num_intersections = NUM_INTERSECTIONS;
+    const auto input_channels = weights.size() / biases.size();
+
+    // Weight shape (output, input)
+    // outputs[2,19x19] = weights[2,256] x input[256,19x19]
 #ifdef USE_BLAS
     cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
                 // M        N            K
-                outputs, num_intersections, filter_dim,
-                1.0f, &weights[0], filter_dim,
-                &col[0], num_intersections,
-                0.0f, &output[0], num_intersections);
+                outputs, num_intersections, input_channels,
+                1.0f, &weights[0], input_channels,
+                input, num_intersections,
+                0.0f, output, num_intersections);
 #else
-    auto C_mat = EigenMatrixMap<float>(output.data(),
+    auto C_mat = EigenMatrixMap<float>(output,
                                        num_intersections, outputs);
     C_mat.noalias() =
-        ConstEigenMatrixMap<float>(col.data(), num_intersections, filter_dim) * ConstEigenMatrixMap<float>(weights.data(), filter_dim, outputs);
+        ConstEigenMatrixMap<float>(input, num_intersections, input_channels) * ConstEigenMatrixMap<float>(weights.data(), input_channels, outputs);
 #endif
 
     for (unsigned int o = 0; o < outputs; o++)
@@ -370,38 +607,43 @@ void convolve(const size_t outputs,
     }
 }
 
-template <size_t spatial_size>
-void batchnorm(const size_t channels,
-               std::vector<float> &data,
-               const float *const means,
-               const float *const stddevs,
-               const float *const eltwise = nullptr)
-{
-    const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ? val : 0.0f; };
-    for (auto c = size_t{0}; c < channels; ++c)
-    {
-        const auto mean = means[c];
-        const auto scale_stddev = stddevs[c];
-        const auto arr = &data[c * spatial_size];
-
-        if (eltwise == nullptr)
-        {
-            // Classical BN
-            for (auto b = size_t{0}; b < spatial_size; b++)
-            {
-                arr[b] = lambda_ReLU(scale_stddev * (arr[b] - mean));
-            }
+// Folds each batch normalization into the convolution before it:
+// stddev * (conv(x, U) - mean) = conv(x, stddev * U) - stddev * mean.
+// The stddevs hold the scales, 1/sqrt(variance + epsilon). The scaled
+// means become the biases the output transform adds.
+std::shared_ptr<const ForwardPipe::ForwardPipeWeights>
+CPUPipe::fold_batchnorm(const ForwardPipeWeights& weights) {
+    auto folded = std::make_shared<ForwardPipeWeights>(weights);
+    const auto layers = folded->m_conv_weights.size();
+    folded->m_conv_biases.resize(layers);
+    for (auto i = size_t{0}; i < layers; i++) {
+        const auto& means = folded->m_batchnorm_means[i];
+        const auto& stddevs = folded->m_batchnorm_stddevs[i];
+        const auto outputs = means.size();
+        auto& U = folded->m_conv_weights[i];
+        for (auto j = size_t{0}; j < U.size(); j++) {
+            U[j] *= stddevs[j % outputs];
         }
-        else
-        {
-            // BN + residual add
-            const auto res = &eltwise[c * spatial_size];
-            for (auto b = size_t{0}; b < spatial_size; b++)
-            {
-                arr[b] = lambda_ReLU((scale_stddev * (arr[b] - mean)) + res[b]);
-            }
+        auto& bias = folded->m_conv_biases[i];
+        bias.resize(outputs);
+        for (auto k = size_t{0}; k < outputs; k++) {
+            bias[k] = -means[k] * stddevs[k];
+        }
+    }
+    // Not needed anymore.
+    folded->m_batchnorm_means.clear();
+    folded->m_batchnorm_stddevs.clear();
+    return folded;
+}
+
+const ForwardPipe::ForwardPipeWeights& CPUPipe::get_weights() const {
+    if (!m_node_weights.empty()) {
+        const auto node = SMP::get_current_node();
+        if (node < m_node_weights.size()) {
+            return *m_node_weights[node];
         }
     }
+    return *m_weights;
 }
 
 void CPUPipe::forward(const std::vector<float> &input,
@@ -409,52 +651,66 @@ void CPUPipe::forward(const std::vector<float> &input,
                       std::vector<float> &output_val,
                       std::vector<float> &output_vbe)
 {
+    forward_batch(1, input, output_pol, output_val, output_vbe);
+}
+
+void CPUPipe::forward_batch(const size_t batch_size,
+                            const std::vector<float> &input,
+                            std::vector<float> &output_pol,
+                            std::vector<float> &output_val,
+                            std::vector<float> &output_vbe)
+{
+    const auto& weights = get_weights();
+    const auto batch = static_cast<int>(batch_size);
+
     // Input convolution
-    constexpr auto P = WINOGRAD_P;
     // Calculate output channels
     const auto output_channels = m_input_channels;
     // input_channels is the maximum number of input channels of any
     // convolution. Residual blocks are identical, but the first convolution
     // might be bigger when the network has very few filters
     const auto input_channels = std::max(static_cast<size_t>(output_channels),
-                                         static_cast<size_t>(input.size() / NUM_INTERSECTIONS));
-    auto conv_out = std::vector<float>(output_channels * NUM_INTERSECTIONS);
+                                         static_cast<size_t>(input.size() / (batch_size * NUM_INTERSECTIONS)));
+    const auto output_size = output_channels * NUM_INTERSECTIONS;
 
-    auto V = std::vector<float>(WINOGRAD_TILE * input_channels * P);
-    auto M = std::vector<float>(WINOGRAD_TILE * output_channels * P);
+    // All the positions go through each GEMM together. The buffers may
+    // be larger than this batch needs.
+    auto& ws = t_workspace;
+    ws.fit(batch_size, input_channels, output_channels);
+    auto& conv_out = ws.conv_out;
 
-    winograd_convolve3(output_channels, input, m_weights->m_conv_weights[0], V, M, conv_out);
-    batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                 m_weights->m_batchnorm_means[0].data(),
-                                 m_weights->m_batchnorm_stddevs[0].data());
+    // The batch normalizations are folded into the convolutions, see
+    // push_weights(). They end with the ReLU and the residual add.
+    convolve3(weights, 0, batch, input, nullptr, conv_out);
 
     // Residual tower
-    auto conv_in = std::vector<float>(output_channels * NUM_INTERSECTIONS);
-    auto res = std::vector<float>(output_channels * NUM_INTERSECTIONS);
-    for (auto i = size_t{1}; i < m_weights->m_conv_weights.size(); i += 2)
+    auto& conv_in = ws.conv_in;
+    auto& res = ws.res;
+    for (auto i = size_t{1}; i < weights.m_conv_weights.size(); i += 2)
     {
-        auto output_channels = m_input_channels;
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           m_weights->m_conv_weights[i], V, M, conv_out);
-        batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                     m_weights->m_batchnorm_means[i].data(),
-                                     m_weights->m_batchnorm_stddevs[i].data());
+        convolve3(weights, i, batch, conv_in, nullptr, conv_out);
 
         std::swap(conv_in, res);
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           m_weights->m_conv_weights[i + 1], V, M, conv_out);
-        batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                     m_weights->m_batchnorm_means[i + 1].data(),
-                                     m_weights->m_batchnorm_stddevs[i + 1].data(),
-                                     res.data());
+        convolve3(weights, i + 1, batch, conv_in, res.data(), conv_out);
     }
-    convolve<1>(m_conv_pol_b.size(), conv_out, m_conv_pol_w, m_conv_pol_b, output_pol);
-    convolve<1>(m_conv_val_b.size(), conv_out, m_conv_val_w, m_conv_val_b, output_val);
-    if (m_conv_vbe_b.size() > 0)
+
+    const auto pol_size = output_pol.size() / batch_size;
+    const auto val_size = output_val.size() / batch_size;
+    const auto vbe_size = output_vbe.size() / batch_size;
+    for (auto b = size_t{0}; b < batch_size; b++)
     {
-        convolve<1>(m_conv_vbe_b.size(), conv_out, m_conv_vbe_w, m_conv_vbe_b, output_vbe);
+        const auto tower_out = &conv_out[b * output_size];
+        convolve_1x1(m_conv_pol_b.size(), tower_out, m_conv_pol_w, m_conv_pol_b,
+                     &output_pol[b * pol_size]);
+        convolve_1x1(m_conv_val_b.size(), tower_out, m_conv_val_w, m_conv_val_b,
+                     &output_val[b * val_size]);
+        if (m_conv_vbe_b.size() > 0)
+        {
+            convolve_1x1(m_conv_vbe_b.size(), tower_out, m_conv_vbe_w, m_conv_vbe_b,
+                         &output_vbe[b * vbe_size]);
+        }
     }
 }
 
@@ -463,7 +719,27 @@ void CPUPipe::push_weights(unsigned int /*filter_size*/,
                            unsigned int outputs,
                            std::shared_ptr<const ForwardPipeWeights> weights)
 {
-    m_weights = weights;
+    m_weights = fold_batchnorm(*weights);
+
+    // With --numa, each NUMA node gets a copy of the residual tower,
+    // which is where the bulk of the memory traffic of a forward pass
+    // goes. Each copy is made by a thread running on its node, so that
+    // its pages are placed there on first touch.
+    m_node_weights.clear();
+    if (cfg_numa && SMP::get_num_nodes() > 1) {
+        m_node_weights.resize(SMP::get_num_nodes());
+        auto copiers = std::vector<std::thread>{};
+        for (auto node = size_t{0}; node < m_node_weights.size(); node++) {
+            copiers.emplace_back([this, node] {
+                SMP::pin_thread_to_node(node);
+                m_node_weights[node] =
+                    std::make_shared<const ForwardPipeWeights>(*m_weights);
+            });
+        }
+        for (auto& copier : copiers) {
+            copier.join();
+        }
+    }
 
     // Output head convolutions
     m_conv_pol_w = weights->m_conv_pol_w;
@@ -32,6 +32,7 @@
 #define CPUPIPE_H_INCLUDED
 #include "config.h"
 
+#include <memory>
 #include <vector>
 #include <cassert>
 
@@ -44,37 +45,93 @@ public:
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val,
                          std::vector<float>& output_vbe);
+    // Runs the positions of the batch through each layer together, so
+    // that the GEMMs of the Winograd convolutions are batch_size times
+    // wider.
+    virtual void forward_batch(const size_t batch_size,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe);
 
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights);
-private:
-    void winograd_transform_in(const std::vector<float>& in,
-                               std::vector<float>& V,
-                               const int C);
 
+    // Winograd transforms of the C input channels and the K output
+    // channels of batch_size positions. V and M store, for each element
+    // of a tile, the channels of each tile of each position one after
+    // the other, the layout winograd_sgemm() works on. Groups of 8 or 16
+    // channels are transformed at once when AVX2 or AVX-512 is enabled.
+    // The output transform also adds the bias of each output channel
+    // and the residual, if any, and applies the ReLU.
+    static void winograd_transform_in(const std::vector<float>& in,
+                                      std::vector<float>& V,
+                                      const int C,
+                                      const int batch_size);
+    static void winograd_transform_out(const std::vector<float>& M,
+                                       std::vector<float>& Y,
+                                       const int K,
+                                       const int batch_size,
+                                       const float* bias,
+                                       const float* residual = nullptr);
+
+    // The same, one channel at a time. The reference for the above.
+    static void winograd_transform_in_ref(const std::vector<float>& in,
+                                          std::vector<float>& V,
+                                          const int C,
+                                          const int batch_size);
+    static void winograd_transform_out_ref(const std::vector<float>& M,
+                                           std::vector<float>& Y,
+                                           const int K,
+                                           const int batch_size,
+                                           const float* bias,
+                                           const float* residual = nullptr);
+
+    // The weights of the tower with the batch normalizations folded
+    // into the convolutions, as forward() uses them.
+    static std::shared_ptr<const ForwardPipeWeights>
+    fold_batchnorm(const ForwardPipeWeights& weights);
+protected:
+    // The weights of the residual tower, preferably the copy on the
+    // NUMA node of the calling thread.
+    const ForwardPipeWeights& get_weights() const;
+
+    // Convolution number layer of the tower, the input one being 0,
+    // with its batch normalization, the residual add if residual is
+    // not null, and the ReLU.
+    virtual void convolve3(const ForwardPipeWeights& weights,
+                           const size_t layer,
+                           const int batch_size,
+                           const std::vector<float>& input,
+                           const float* residual,
+                           std::vector<float>& output);
+
+    int m_input_channels;
+
+private:
     void winograd_sgemm(const std::vector<float>& U,
                         const std::vector<float>& V,
                         std::vector<float>& M,
-                        const int C, const int K);
+                        const int C, const int K,
+                        const int N);
 
-    void winograd_transform_out(const std::vector<float>& M,
-                                std::vector<float>& Y,
-                                const int K);
-
-    void winograd_convolve3(const int outputs,
+    void winograd_convolve3(const int batch_size,
+                            const int outputs,
                             const std::vector<float>& input,
                             const std::vector<float>& U,
+                            const std::vector<float>& bias,
+                            const float* residual,
                             std::vector<float>& V,
                             std::vector<float>& M,
                             std::vector<float>& output);
 
-
-    int m_input_channels;
-
     // Input + residual block tower
     std::shared_ptr<const ForwardPipeWeights> m_weights;
+    // Copies of m_weights, indexed by NUMA node. Empty unless --numa
+    // is set and there is more than one node.
+    std::vector<std::shared_ptr<const ForwardPipeWeights>> m_node_weights;
 
     std::vector<float> m_conv_pol_w;
     std::vector<float> m_conv_val_w;
@@ -0,0 +1,472 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+    Copyright (C) 2019 SAI Team
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX512BW__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "CPUPipeInt8.h"
+#include "Network.h"
+
+namespace {
+
+// Largest quantized activation and weight.
+constexpr auto QMAX = 127;
+
+// Output channels convolved together, see QuantizedFilters.
+constexpr auto KB = CPUPipeInt8::QuantizedFilters::BLOCK;
+
+// The quantized input is stored by groups of 4 channels, the 4 values
+// of a point next to each other, on a board with a border of zeroes.
+// The filter tap (ky, kx) of the output at (y, x) is then the input at
+// (y + ky, x + kx), and the inputs of WIDTH consecutive outputs of a
+// row are consecutive. The outputs are computed for whole rows of the
+// bordered board, the last 2 points of a row are discarded.
+constexpr auto WPAD = BOARD_SIZE + 2;
+constexpr auto ROW_OUTPUTS = BOARD_SIZE * WPAD;
+
+#if defined(__AVX512BW__) || defined(__AVX2__)
+#define USE_INT8_SIMD
+
+// The 32-bit sums of the outputs of a SIMD register, one in each lane.
+struct Int8Vec {
+#ifdef __AVX512BW__
+    static constexpr auto WIDTH = 16;
+    __m512i v;
+
+    static Int8Vec zero() { return {_mm512_setzero_si512()}; }
+    static Int8Vec load(const std::uint8_t* const p) {
+        return {_mm512_loadu_si512(p)};
+    }
+    void store(std::int32_t* const p) const { _mm512_storeu_si512(p, v); }
+    // Adds to each lane the dot product of the 4 unsigned bytes of the
+    // lane of a with the 4 signed bytes of w.
+    Int8Vec dot(const Int8Vec a, const std::int32_t w) const {
+#ifdef __AVX512VNNI__
+        return {_mm512_dpbusd_epi32(v, a.v, _mm512_set1_epi32(w))};
+#else
+        const auto pairs = _mm512_maddubs_epi16(a.v, _mm512_set1_epi32(w));
+        return {_mm512_add_epi32(
+            v, _mm512_madd_epi16(pairs, _mm512_set1_epi16(1)))};
+#endif
+    }
+#else
+    static constexpr auto WIDTH = 8;
+    __m256i v;
+
+    static Int8Vec zero() { return {_mm256_setzero_si256()}; }
+    static Int8Vec load(const std::uint8_t* const p) {
+        return {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))};
+    }
+    void store(std::int32_t* const p) const {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+    }
+    Int8Vec dot(const Int8Vec a, const std::int32_t w) const {
+#ifdef __AVXVNNI__
+        return {_mm256_dpbusd_avx_epi32(v, a.v, _mm256_set1_epi32(w))};
+#else
+        const auto pairs = _mm256_maddubs_epi16(a.v, _mm256_set1_epi32(w));
+        return {_mm256_add_epi32(
+            v, _mm256_madd_epi16(pairs, _mm256_set1_epi16(1)))};
+#endif
+    }
+#endif
+};
+#else
+// One output at a time, v holds either a sum or the 4 input bytes.
+struct Int8Vec {
+    static constexpr auto WIDTH = 1;
+    std::int32_t v;
+
+    static Int8Vec zero() { return {0}; }
+    static Int8Vec load(const std::uint8_t* const p) {
+        auto a = Int8Vec{};
+        std::memcpy(&a.v, p, sizeof(a.v));
+        return a;
+    }
+    void store(std::int32_t* const p) const { *p = v; }
+    Int8Vec dot(const Int8Vec a, const std::int32_t w) const {
+        std::uint8_t in[4];
+        std::int8_t weights[4];
+        std::memcpy(in, &a.v, sizeof(in));
+        std::memcpy(weights, &w, sizeof(weights));
+        return {v + in[0] * weights[0] + in[1] * weights[1]
+                  + in[2] * weights[2] + in[3] * weights[3]};
+    }
+};
+#endif
+
+// Outputs convolved together: two registers, so that there are enough
+// independent sums to hide the latency of the dot products.
+constexpr auto OUTPUT_BLOCK = 2 * Int8Vec::WIDTH;
+
+// Bytes between two groups of 4 channels of the quantized input: the
+// bordered board, and room for the loads of the discarded outputs of
+// the last block.
+constexpr auto PLANE_SIZE =
+    4 * ((ROW_OUTPUTS + OUTPUT_BLOCK - 1) / OUTPUT_BLOCK * OUTPUT_BLOCK
+         + 2 * WPAD + 2);
+
+// Buffers of a thread for the int8 convolutions, kept from one call to
+// the next as in CPUPipe.
+struct Workspace {
+    // The quantized input. Nothing ever writes to the borders, which
+    // stay zero.
+    std::vector<std::uint8_t> planes;
+};
+
+thread_local Workspace t_workspace;
+
+using BlockSums = std::array<std::array<std::int32_t, OUTPUT_BLOCK>, KB>;
+
+// Sums of the KB output channels of a block for OUTPUT_BLOCK outputs.
+// in points to the input of the first of them at tap (0, 0), weights
+// to the weights of the block. Each load of the input is used for the
+// KB channels and each weight for the two registers of outputs, whose
+// sums stay in registers.
+void dot_block(const std::uint8_t* const in,
+               const int channel_groups,
+               const std::int32_t* weights,
+               BlockSums& sums) {
+    static_assert(KB == 4, "dot_block() convolves 4 output channels");
+    constexpr auto SECOND = Int8Vec::WIDTH * 4;
+    auto acc00 = Int8Vec::zero();
+    auto acc01 = Int8Vec::zero();
+    auto acc10 = Int8Vec::zero();
+    auto acc11 = Int8Vec::zero();
+    auto acc20 = Int8Vec::zero();
+    auto acc21 = Int8Vec::zero();
+    auto acc30 = Int8Vec::zero();
+    auto acc31 = Int8Vec::zero();
+    for (auto ky = 0; ky < 3; ky++) {
+        for (auto kx = 0; kx < 3; kx++) {
+            auto tap = in + (ky * WPAD + kx) * 4;
+            for (auto g = 0; g < channel_groups; g++, tap += PLANE_SIZE) {
+                const auto a0 = Int8Vec::load(tap);
+                const auto a1 = Int8Vec::load(tap + SECOND);
+                acc00 = acc00.dot(a0, weights[0]);
+                acc01 = acc01.dot(a1, weights[0]);
+                acc10 = acc10.dot(a0, weights[1]);
+                acc11 = acc11.dot(a1, weights[1]);
+                acc20 = acc20.dot(a0, weights[2]);
+                acc21 = acc21.dot(a1, weights[2]);
+                acc30 = acc30.dot(a0, weights[3]);
+                acc31 = acc31.dot(a1, weights[3]);
+                weights += KB;
+            }
+        }
+    }
+    constexpr auto W = Int8Vec::WIDTH;
+    acc00.store(&sums[0][0]);
+    acc01.store(&sums[0][W]);
+    acc10.store(&sums[1][0]);
+    acc11.store(&sums[1][W]);
+    acc20.store(&sums[2][0]);
+    acc21.store(&sums[2][W]);
+    acc30.store(&sums[3][0]);
+    acc31.store(&sums[3][W]);
+}
+
+// Dequantizes the sums of output channel k for OUTPUT_BLOCK outputs
+// from first, adds the bias and the residual and applies the ReLU.
+void store_output(const std::int32_t* const sums,
+                  const int first,
+                  const int k,
+                  const float scale,
+                  const float bias,
+                  const float* const residual,
+                  float* const output) {
+    for (auto i = 0; i < OUTPUT_BLOCK; i++) {
+        const auto y = (first + i) / WPAD;
+        const auto x = (first + i) % WPAD;
+        if (y >= BOARD_SIZE) {
+            break;
+        }
+        if (x >= BOARD_SIZE) {
+            continue;
+        }
+        const auto idx = k * NUM_INTERSECTIONS + y * BOARD_SIZE + x;
+        auto val = sums[i] * scale + bias;
+        if (residual) {
+            val += residual[idx];
+        }
+        output[idx] = std::max(val, 0.0f);
+    }
+}
+
+}
+
+CPUPipeInt8::QuantizedFilters
+CPUPipeInt8::quantize_filters(const std::vector<float>& f,
+                              const int outputs,
+                              const int channels) {
+    const auto groups = (channels + 3) / 4;
+    const auto blocks = (outputs + KB - 1) / KB;
+    auto q = QuantizedFilters{};
+    q.channels = channels;
+    q.weights.assign(blocks * 9 * groups * KB, 0);
+    const auto bytes = reinterpret_cast<std::int8_t*>(q.weights.data());
+    q.scales.resize(outputs);
+    for (auto k = 0; k < outputs; k++) {
+        const auto row = &f[k * channels * 9];
+        auto max = 0.0f;
+        for (auto r = 0; r < channels * 9; r++) {
+            max = std::max(max, std::abs(row[r]));
+        }
+        const auto scale = max > 0.0f ? max / QMAX : 1.0f;
+        for (auto c = 0; c < channels; c++) {
+            for (auto tap = 0; tap < 9; tap++) {
+                const auto idx =
+                    (((k / KB * 9 + tap) * groups + c / 4) * KB
+                     + k % KB) * 4 + c % 4;
+                bytes[idx] = static_cast<std::int8_t>(
+                    std::lround(row[c * 9 + tap] / scale));
+            }
+        }
+        q.scales[k] = scale;
+    }
+    return q;
+}
+
+std::vector<float> CPUPipeInt8::winograd_untransform_f(const std::vector<float>& U,
+                                                       const int outputs,
+                                                       const int channels) {
+    // The G of Network::winograd_transform_f(). U = G f G^T for each
+    // pair of channels. G has more rows than columns, so f is recovered
+    // with its left inverse, (G^T G)^-1 G^T.
+    const auto G = std::array<double, 3 * WINOGRAD_ALPHA>
+                    { 1.0,         0.0,        0.0,
+                      -2.0/3.0,   -SQ2/3.0,   -1.0/3.0,
+                      -2.0/3.0,    SQ2/3.0,   -1.0/3.0,
+                      1.0/6.0,     SQ2/6.0,    1.0/3.0,
+                      1.0/6.0,    -SQ2/6.0,    1.0/3.0,
+                      0.0,         0.0,        1.0};
+
+    auto GtG = std::array<double, 9>{};
+    for (auto a = 0; a < 3; a++) {
+        for (auto b = 0; b < 3; b++) {
+            for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                GtG[a * 3 + b] += G[i * 3 + a] * G[i * 3 + b];
+            }
+        }
+    }
+    // Inverse of the 3x3 matrix, its adjugate over its determinant.
+    const auto m = [&GtG](const int r, const int c) { return GtG[(r % 3) * 3 + c % 3]; };
+    auto inv = std::array<double, 9>{};
+    for (auto r = 0; r < 3; r++) {
+        for (auto c = 0; c < 3; c++) {
+            inv[c * 3 + r] = m(r + 1, c + 1) * m(r + 2, c + 2)
+                             - m(r + 1, c + 2) * m(r + 2, c + 1);
+        }
+    }
+    const auto det = GtG[0] * inv[0] + GtG[1] * inv[3] + GtG[2] * inv[6];
+    auto Ginv = std::array<double, 3 * WINOGRAD_ALPHA>{};
+    for (auto a = 0; a < 3; a++) {
+        for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+            for (auto b = 0; b < 3; b++) {
+                Ginv[a * WINOGRAD_ALPHA + i] += inv[a * 3 + b] * G[i * 3 + b] / det;
+            }
+        }
+    }
+
+    auto f = std::vector<float>(outputs * channels * 9);
+    auto temp = std::array<double, 3 * WINOGRAD_ALPHA>{};
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            const auto tile = [&](const int xi, const int nu) {
+                return U[(xi * WINOGRAD_ALPHA + nu) * outputs * channels
+                         + c * outputs + o];
+            };
+            for (auto a = 0; a < 3; a++) {
+                for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                    auto acc = 0.0;
+                    for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                        acc += Ginv[a * WINOGRAD_ALPHA + xi] * tile(xi, nu);
+                    }
+                    temp[a * WINOGRAD_ALPHA + nu] = acc;
+                }
+            }
+            for (auto a = 0; a < 3; a++) {
+                for (auto b = 0; b < 3; b++) {
+                    auto acc = 0.0;
+                    for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                        acc += temp[a * WINOGRAD_ALPHA + nu]
+                               * Ginv[b * WINOGRAD_ALPHA + nu];
+                    }
+                    f[(o * channels + c) * 9 + a * 3 + b] = acc;
+                }
+            }
+        }
+    }
+    return f;
+}
+
+void CPUPipeInt8::convolve3_int8(const int batch_size,
+                                 const std::vector<float>& input,
+                                 const float input_scale,
+                                 const QuantizedFilters& filters,
+                                 const float* const bias,
+                                 const float* const residual,
+                                 std::vector<float>& output) {
+    const auto channels = filters.channels;
+    const auto outputs = static_cast<int>(filters.scales.size());
+    const auto groups = (channels + 3) / 4;
+    const auto blocks = (outputs + KB - 1) / KB;
+
+    auto& ws = t_workspace;
+    if (ws.planes.size() < size_t(batch_size * groups * PLANE_SIZE)) {
+        ws.planes.resize(batch_size * groups * PLANE_SIZE);
+    }
+
+    const auto to_quantized = QMAX / input_scale;
+    for (auto b = 0; b < batch_size; b++) {
+        // The channels that pad the last group are zero.
+        for (auto c = 0; c < groups * 4; c++) {
+            const auto plane = &input[(b * channels + std::min(c, channels - 1))
+                                      * NUM_INTERSECTIONS];
+            const auto scale = c < channels ? to_quantized : 0.0f;
+            auto dst = &ws.planes[(b * groups + c / 4) * PLANE_SIZE
+                                  + (WPAD + 1) * 4 + c % 4];
+            for (auto y = 0; y < BOARD_SIZE; y++, dst += WPAD * 4) {
+                for (auto x = 0; x < BOARD_SIZE; x++) {
+                    const auto q = std::min(
+                        std::max(plane[y * BOARD_SIZE + x] * scale, 0.0f),
+                        float(QMAX));
+                    dst[x * 4] = static_cast<std::uint8_t>(q + 0.5f);
+                }
+            }
+        }
+    }
+
+    // A sum times this and the scale of the weights of its output
+    // channel is the float sum.
+    const auto from_quantized = input_scale / QMAX;
+    const auto weights = filters.weights.data();
+    auto sums = BlockSums{};
+    for (auto b = 0; b < batch_size; b++) {
+        const auto in = &ws.planes[b * groups * PLANE_SIZE];
+        const auto out = &output[b * outputs * NUM_INTERSECTIONS];
+        const auto res = residual ? residual + b * outputs * NUM_INTERSECTIONS
+                                  : nullptr;
+        for (auto first = 0; first < ROW_OUTPUTS; first += OUTPUT_BLOCK) {
+            for (auto block = 0; block < blocks; block++) {
+                dot_block(in + first * 4, groups,
+                          weights + block * 9 * groups * KB, sums);
+                for (auto kb = 0; kb < KB && block * KB + kb < outputs; kb++) {
+                    const auto k = block * KB + kb;
+                    store_output(sums[kb].data(), first, k,
+                                 from_quantized * filters.scales[k],
+                                 bias[k], res, out);
+                }
+            }
+        }
+    }
+}
+
+void CPUPipeInt8::convolve3(const ForwardPipeWeights& weights,
+                            const size_t layer,
+                            const int batch_size,
+                            const std::vector<float>& input,
+                            const float* const residual,
+                            std::vector<float>& output) {
+    // The input convolution has few input channels, it stays in floats,
+    // as the whole tower does after use_float().
+    if (layer == 0 || m_use_float.load(std::memory_order_relaxed)) {
+        CPUPipe::convolve3(weights, layer, batch_size, input, residual, output);
+        return;
+    }
+    if (m_calibrating) {
+        const auto size = batch_size * m_input_channels * NUM_INTERSECTIONS;
+        auto& max = m_input_max[layer - 1];
+        max = std::max(max, *std::max_element(begin(input), begin(input) + size));
+        CPUPipe::convolve3(weights, layer, batch_size, input, residual, output);
+        return;
+    }
+    convolve3_int8(batch_size, input, m_input_scales[layer - 1],
+                   m_filters[layer - 1], weights.m_conv_biases[layer].data(),
+                   residual, output);
+}
+
+void CPUPipeInt8::push_weights(unsigned int filter_size,
+                               unsigned int channels,
+                               unsigned int outputs,
+                               std::shared_ptr<const ForwardPipeWeights> weights) {
+    CPUPipe::push_weights(filter_size, channels, outputs, weights);
+
+    // The batch normalizations are folded into the filters before they
+    // are quantized.
+    const auto& folded = get_weights();
+    const auto layers = folded.m_conv_weights.size();
+    m_filters.clear();
+    for (auto i = size_t{1}; i < layers; i++) {
+        const auto f = winograd_untransform_f(folded.m_conv_weights[i],
+                                              outputs, outputs);
+        m_filters.emplace_back(quantize_filters(f, outputs, outputs));
+    }
+
+    // The float tower evaluates the calibration positions and records
+    // the largest input of each convolution.
+    const auto in_size = channels * NUM_INTERSECTIONS;
+    const auto positions = m_calibration_input.size() / in_size;
+    assert(positions > 0);
+    const auto pol_size = weights->m_conv_pol_w.size() / outputs * NUM_INTERSECTIONS;
+    const auto val_size = weights->m_conv_val_w.size() / outputs * NUM_INTERSECTIONS;
+    const auto vbe_size = weights->m_conv_vbe_w.size() / outputs * NUM_INTERSECTIONS;
+    auto input = std::vector<float>{};
+    auto output_pol = std::vector<float>{};
+    auto output_val = std::vector<float>{};
+    auto output_vbe = std::vector<float>{};
+
+    m_input_max.assign(m_filters.size(), 0.0f);
+    m_calibrating = true;
+    for (auto first = size_t{0}; first < positions; first += CALIBRATION_BATCH) {
+        const auto count = std::min(CALIBRATION_BATCH, positions - first);
+        input.assign(begin(m_calibration_input) + first * in_size,
+                     begin(m_calibration_input) + (first + count) * in_size);
+        output_pol.resize(count * pol_size);
+        output_val.resize(count * val_size);
+        output_vbe.resize(count * vbe_size);
+        forward_batch(count, input, output_pol, output_val, output_vbe);
+    }
+    m_calibrating = false;
+
+    m_input_scales.resize(m_input_max.size());
+    for (auto i = size_t{0}; i < m_input_max.size(); i++) {
+        m_input_scales[i] = m_input_max[i] > 0.0f ? m_input_max[i] : 1.0f;
+    }
+}
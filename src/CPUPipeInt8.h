@@ -0,0 +1,140 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2018 Junhee Yoo and contributors
+    Copyright (C) 2019 SAI Team
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef CPUPIPEINT8_H_INCLUDED
+#define CPUPIPEINT8_H_INCLUDED
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "CPUPipe.h"
+
+// CPUPipe with the residual tower evaluated with 8-bit integers: the
+// activations are unsigned, the weights signed, and their products are
+// summed in 32 bits, 4 at a time by the VNNI or AVX2 dot product
+// instructions. The input convolution and the heads stay in floats.
+//
+// The weights of each output channel have their own scale. The scale
+// of the activations entering each convolution is calibrated when the
+// weights are pushed, from the largest activation the float tower
+// produces on a sample of positions. Activations come out of a ReLU and
+// use 7 bits, so that the pairwise sums of the AVX2 instructions, which
+// saturate at 16 bits, can't overflow.
+//
+// The convolutions are direct, not Winograd ones: the input transform
+// of F(4x4, 3x3) sums the activations of a tile with weights of both
+// signs, widening their range several times, so that 8 bits of the
+// transformed tiles lose too much of the small activations. The direct
+// convolution does 4 times the multiplications of the Winograd one, but
+// the 8-bit ones go 4 times as fast, and there are no transforms to do.
+// This pays most at small batches, about 1.5x at batch 1 but not much
+// more than the float pipe from batch 8.
+class CPUPipeInt8 : public CPUPipe {
+public:
+    // calibration_input holds the input planes of the sample positions
+    // one after the other, as forward_batch() takes them. At least one
+    // position is needed.
+    explicit CPUPipeInt8(std::vector<float>&& calibration_input)
+        : m_calibration_input(std::move(calibration_input)) {}
+
+    virtual void push_weights(unsigned int filter_size,
+                              unsigned int channels,
+                              unsigned int outputs,
+                              std::shared_ptr<const ForwardPipeWeights> weights);
+
+    // 3x3 filters of a convolution quantized to 8 bits, a weight times
+    // the scale of its output channel being the float weight. Each word
+    // of weights holds the weights of 4 input channels. The words are
+    // ordered by blocks of BLOCK output channels, then by filter tap,
+    // then by group of 4 input channels, then by output channel in the
+    // block. The blocks and the groups are padded with zero weights.
+    struct QuantizedFilters {
+        static constexpr auto BLOCK = 4;
+        int channels;
+        std::vector<std::int32_t> weights;
+        std::vector<float> scales;
+    };
+    // f has the layout of the filters of the weights file.
+    static QuantizedFilters quantize_filters(const std::vector<float>& f,
+                                             const int outputs,
+                                             const int channels);
+
+    // The 3x3 filters a Winograd transformed U was made from, the
+    // inverse of Network::winograd_transform_f().
+    static std::vector<float> winograd_untransform_f(const std::vector<float>& U,
+                                                     const int outputs,
+                                                     const int channels);
+
+    // Convolution of the batch_size positions of input, whose values
+    // must be positive, with filters. The input is quantized with
+    // input_scale, the value of 127. The output gets the bias, the
+    // residual if not null, and the ReLU, as in CPUPipe.
+    static void convolve3_int8(const int batch_size,
+                               const std::vector<float>& input,
+                               const float input_scale,
+                               const QuantizedFilters& filters,
+                               const float* bias,
+                               const float* residual,
+                               std::vector<float>& output);
+
+    // Evaluates the tower in floats from now on, as CPUPipe does, when
+    // a self-check found the int8 one too far off. Evaluations in
+    // progress may finish either way. Returns false if it already did.
+    bool use_float() {
+        return !m_use_float.exchange(true);
+    }
+
+protected:
+    virtual void convolve3(const ForwardPipeWeights& weights,
+                           const size_t layer,
+                           const int batch_size,
+                           const std::vector<float>& input,
+                           const float* residual,
+                           std::vector<float>& output);
+
+private:
+    // Number of calibration positions evaluated together.
+    static constexpr auto CALIBRATION_BATCH = size_t{8};
+
+    std::vector<float> m_calibration_input;
+    // Set while the float tower evaluates the calibration positions.
+    bool m_calibrating{false};
+    std::atomic<bool> m_use_float{false};
+
+    // Indexed by layer - 1, the input convolution is not quantized.
+    std::vector<QuantizedFilters> m_filters;
+    std::vector<float> m_input_max;
+    std::vector<float> m_input_scales;
+};
+
+#endif
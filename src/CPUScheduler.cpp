@@ -0,0 +1,86 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2018 Junhee Yoo and contributors
+    Copyright (C) 2019 SAI Team
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "CPUScheduler.h"
+#include "GTP.h"
+#include "SMP.h"
+
+CPUScheduler::~CPUScheduler() {
+    stop_workers();
+}
+
+void CPUScheduler::initialize(const int channels) {
+    m_pipe->initialize(channels);
+
+    // Enough workers to keep the search threads busy with full batches,
+    // but no more than one per CPU: a batch is evaluated by one thread.
+    const auto batches = std::max(cfg_num_threads / cfg_cpu_batch_size, 1u);
+    const auto num_worker_threads =
+        std::min(size_t{batches}, std::max(SMP::get_num_cpus(), size_t{1}));
+    for (auto i = size_t{0}; i < num_worker_threads; i++) {
+        auto t = std::thread(&CPUScheduler::batch_worker, this, i);
+        m_worker_threads.push_back(std::move(t));
+    }
+}
+
+void CPUScheduler::push_weights(
+    unsigned int filter_size,
+    unsigned int channels,
+    unsigned int outputs,
+    std::shared_ptr<const ForwardPipeWeights> weights) {
+    m_pipe->push_weights(filter_size, channels, outputs, weights);
+}
+
+void CPUScheduler::forward_batch(const size_t batch_size,
+                                 const std::vector<float>& input,
+                                 std::vector<float>& output_pol,
+                                 std::vector<float>& output_val,
+                                 std::vector<float>& output_vbe) {
+    m_pipe->forward_batch(batch_size, input, output_pol, output_val, output_vbe);
+}
+
+void CPUScheduler::batch_worker(const size_t index) {
+    if (cfg_numa) {
+        SMP::pin_thread_to_cpu(SMP::get_thread_cpu(index));
+    }
+
+    run_batches(cfg_cpu_batch_size, [this] (const size_t count,
+                                            const std::vector<float>& input,
+                                            std::vector<float>& output_pol,
+                                            std::vector<float>& output_val,
+                                            std::vector<float>& output_vbe) {
+        m_pipe->forward_batch(count, input, output_pol, output_val, output_vbe);
+    });
+}
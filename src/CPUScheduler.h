@@ -0,0 +1,69 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2018 Junhee Yoo and contributors
+    Copyright (C) 2019 SAI Team
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef CPUSCHEDULER_H_INCLUDED
+#define CPUSCHEDULER_H_INCLUDED
+#include "config.h"
+
+#include <memory>
+#include <vector>
+
+#include "BatchScheduler.h"
+#include "CPUPipe.h"
+
+// Gathers the positions that the search threads evaluate at the same
+// time into batches for CPUPipe::forward_batch(), in the same way that
+// OpenCLScheduler does for the GPUs. The search threads wait while the
+// worker threads, one per CPU at most, evaluate the batches.
+class CPUScheduler : public BatchScheduler {
+public:
+    // pipe evaluates the batches, a CPUPipe or a subclass of it.
+    explicit CPUScheduler(std::unique_ptr<CPUPipe>&& pipe)
+        : m_pipe(std::move(pipe)) {}
+    virtual ~CPUScheduler();
+
+    virtual void initialize(const int channels);
+    // Already a batch, evaluated right away by the calling thread.
+    virtual void forward_batch(const size_t batch_size,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe);
+    virtual void push_weights(unsigned int filter_size,
+                              unsigned int channels,
+                              unsigned int outputs,
+                              std::shared_ptr<const ForwardPipeWeights> weights);
+private:
+    std::unique_ptr<CPUPipe> m_pipe;
+
+    void batch_worker(const size_t index);
+};
+
+#endif
@@ -108,30 +108,30 @@ void FastState::play_move(int vertex) {
 }
 
 void FastState::play_move(int color, int vertex) {
-    board.m_hash ^= Zobrist::zobrist_ko[m_komove];
+    board.hash_ko(m_komove);
     if (vertex == FastBoard::PASS) {
         // No Ko move
         m_komove = FastBoard::NO_VERTEX;
     } else {
         m_komove = board.update_board(color, vertex);
     }
-    board.m_hash ^= Zobrist::zobrist_ko[m_komove];
+    board.hash_ko(m_komove);
 
     m_lastmove = vertex;
     m_movenum++;
 
     if (board.m_tomove == color) {
-        board.m_hash ^= Zobrist::zobrist_blacktomove;
+        board.hash_symmetric(Zobrist::zobrist_blacktomove);
     }
     board.m_tomove = !color;
 
-    board.m_hash ^= Zobrist::zobrist_pass[get_passes()];
+    board.hash_symmetric(Zobrist::zobrist_pass[get_passes()]);
     if (vertex == FastBoard::PASS) {
         increment_passes();
     } else {
         set_passes(0);
     }
-    board.m_hash ^= Zobrist::zobrist_pass[get_passes()];
+    board.hash_symmetric(Zobrist::zobrist_pass[get_passes()]);
 }
 
 size_t FastState::get_movenum() const {
@@ -31,6 +31,7 @@
 #ifndef FORWARDPIPE_H_INCLUDED
 #define FORWARDPIPE_H_INCLUDED
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -66,6 +67,33 @@ public:
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val,
                          std::vector<float>& output_vbe) = 0;
+    // Evaluate batch_size inputs stored one after the other in input,
+    // the outputs are stored in the same way. Pipes that can do better
+    // than one forward() after the other override this.
+    virtual void forward_batch(const size_t batch_size,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               std::vector<float>& output_vbe) {
+        const auto in_size = input.size() / batch_size;
+        const auto pol_size = output_pol.size() / batch_size;
+        const auto val_size = output_val.size() / batch_size;
+        const auto vbe_size = output_vbe.size() / batch_size;
+        // Kept by the thread from one call to the next, as the
+        // workspaces of CPUPipe.
+        thread_local std::vector<float> in, pol, val, vbe;
+        in.resize(in_size);
+        pol.resize(pol_size);
+        val.resize(val_size);
+        vbe.resize(vbe_size);
+        for (auto b = size_t{0}; b < batch_size; b++) {
+            std::copy_n(begin(input) + b * in_size, in_size, begin(in));
+            forward(in, pol, val, vbe);
+            std::copy(begin(pol), end(pol), begin(output_pol) + b * pol_size);
+            std::copy(begin(val), end(val), begin(output_val) + b * val_size);
+            std::copy(begin(vbe), end(vbe), begin(output_vbe) + b * vbe_size);
+        }
+    }
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
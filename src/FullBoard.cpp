@@ -40,13 +40,81 @@
 
 using namespace Utils;
 
+static_assert(FullBoard::NUM_SYMMETRIES == Network::NUM_SYMMETRIES,
+              "Symmetry count mismatch");
+
+// Vertex that each vertex goes to under each symmetry.
+// Only valid for boards of BOARD_SIZE, the only ones the
+// network evaluates. The other boards don't keep m_sym_hash.
+static const auto s_symmetry_vertex = []() {
+    constexpr auto side = BOARD_SIZE + 2;
+    auto table = std::array<std::array<unsigned short, FastBoard::NUM_VERTICES>,
+                            FullBoard::NUM_SYMMETRIES>{};
+    for (auto s = 0; s < FullBoard::NUM_SYMMETRIES; s++) {
+        for (auto v = 0; v < FastBoard::NUM_VERTICES; v++) {
+            table[s][v] = v;
+        }
+        for (auto y = 0; y < BOARD_SIZE; y++) {
+            for (auto x = 0; x < BOARD_SIZE; x++) {
+                const auto sym = Network::get_symmetry({x, y}, s);
+                table[s][(y + 1) * side + x + 1] =
+                    (sym.second + 1) * side + sym.first + 1;
+            }
+        }
+    }
+    return table;
+}();
+
+void FullBoard::hash_vertex(int old_state, int new_state, int vertex) {
+    m_hash ^= Zobrist::zobrist[old_state][vertex];
+    m_hash ^= Zobrist::zobrist[new_state][vertex];
+    if (m_boardsize != BOARD_SIZE) {
+        return;
+    }
+    for (auto s = 0; s < NUM_SYMMETRIES; s++) {
+        const auto sym_vertex = s_symmetry_vertex[s][vertex];
+        m_sym_hash[s] ^= Zobrist::zobrist[old_state][sym_vertex];
+        m_sym_hash[s] ^= Zobrist::zobrist[new_state][sym_vertex];
+    }
+}
+
+void FullBoard::hash_ko(int komove) {
+    m_hash ^= Zobrist::zobrist_ko[komove];
+    if (m_boardsize != BOARD_SIZE) {
+        return;
+    }
+    for (auto s = 0; s < NUM_SYMMETRIES; s++) {
+        m_sym_hash[s] ^= Zobrist::zobrist_ko[s_symmetry_vertex[s][komove]];
+    }
+}
+
+void FullBoard::hash_symmetric(std::uint64_t key) {
+    m_hash ^= key;
+    for (auto& hash : m_sym_hash) {
+        hash ^= key;
+    }
+}
+
+std::pair<std::uint64_t, int> FullBoard::get_canonical_hash() const {
+    if (m_boardsize != BOARD_SIZE) {
+        return {m_hash, Network::IDENTITY_SYMMETRY};
+    }
+    auto best = 0;
+    for (auto s = 1; s < NUM_SYMMETRIES; s++) {
+        if (m_sym_hash[s] < m_sym_hash[best]) {
+            best = s;
+        }
+    }
+    return {m_sym_hash[best], best};
+}
+
 int FullBoard::remove_string(int i) {
     int pos = i;
     int removed = 0;
     int color = m_state[i];
 
     do {
-        m_hash    ^= Zobrist::zobrist[m_state[pos]][pos];
+        hash_vertex(m_state[pos], EMPTY, pos);
         m_ko_hash ^= Zobrist::zobrist[m_state[pos]][pos];
 
         m_state[pos] = EMPTY;
@@ -58,7 +126,6 @@ int FullBoard::remove_string(int i) {
         m_empty[m_empty_cnt]  = pos;
         m_empty_cnt++;
 
-        m_hash    ^= Zobrist::zobrist[m_state[pos]][pos];
         m_ko_hash ^= Zobrist::zobrist[m_state[pos]][pos];
 
         removed++;
@@ -129,7 +196,7 @@ std::uint64_t FullBoard::get_ko_hash() const {
 
 void FullBoard::set_to_move(int tomove) {
     if (m_tomove != tomove) {
-        m_hash ^= Zobrist::zobrist_blacktomove;
+        hash_symmetric(Zobrist::zobrist_blacktomove);
     }
     FastBoard::set_to_move(tomove);
 }
@@ -138,7 +205,7 @@ int FullBoard::update_board(const int color, const int i) {
     assert(i != FastBoard::PASS);
     assert(m_state[i] == EMPTY);
 
-    m_hash ^= Zobrist::zobrist[m_state[i]][i];
+    hash_vertex(m_state[i], color, i);
     m_ko_hash ^= Zobrist::zobrist[m_state[i]][i];
 
     m_state[i] = vertex_t(color);
@@ -147,7 +214,6 @@ int FullBoard::update_board(const int color, const int i) {
     m_libs[i] = count_pliberties(i);
     m_stones[i] = 1;
 
-    m_hash ^= Zobrist::zobrist[m_state[i]][i];
     m_ko_hash ^= Zobrist::zobrist[m_state[i]][i];
 
     /* update neighbor liberties (they all lose 1) */
@@ -195,9 +261,9 @@ int FullBoard::update_board(const int color, const int i) {
         }
     }
 
-    m_hash ^= Zobrist::zobrist_pris[color][m_prisoners[color]];
+    hash_symmetric(Zobrist::zobrist_pris[color][m_prisoners[color]]);
     m_prisoners[color] += captured_stones;
-    m_hash ^= Zobrist::zobrist_pris[color][m_prisoners[color]];
+    hash_symmetric(Zobrist::zobrist_pris[color][m_prisoners[color]]);
 
     /* move last vertex in list to our position */
     auto lastvertex = m_empty[--m_empty_cnt];
@@ -232,6 +298,10 @@ void FullBoard::reset_board(int size) {
 
     m_hash = calc_hash();
     m_ko_hash = calc_ko_hash();
+    for (auto s = 0; s < NUM_SYMMETRIES; s++) {
+        m_sym_hash[s] = size == BOARD_SIZE ? calc_symmetry_hash(NO_VERTEX, s)
+                                           : m_hash;
+    }
 }
 
 bool FullBoard::remove_dead_stones(const FullBoard & tt_endboard) {
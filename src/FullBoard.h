@@ -32,7 +32,9 @@
 #define FULLBOARD_H_INCLUDED
 
 #include "config.h"
+#include <array>
 #include <cstdint>
+#include <utility>
 #include "FastBoard.h"
 
 class FullBoard : public FastBoard {
@@ -40,10 +42,22 @@ public:
     int remove_string(int i);
     int update_board(const int color, const int i);
 
+    static constexpr auto NUM_SYMMETRIES = 8;
+
     std::uint64_t get_hash() const;
     std::uint64_t get_ko_hash() const;
+    // Smallest of the hashes of the 8 symmetries of the position, and
+    // the symmetry it belongs to. Symmetric positions have the same
+    // canonical hash. Boards of a size other than BOARD_SIZE return
+    // the plain hash with the identity symmetry.
+    std::pair<std::uint64_t, int> get_canonical_hash() const;
     void set_to_move(int tomove);
 
+    // Change the hashes for a new ko vertex or for anything that does
+    // not depend on the orientation of the board.
+    void hash_ko(int komove);
+    void hash_symmetric(std::uint64_t key);
+
     void reset_board(int size);
     void display_board(int lastmove = -1) const;
     bool remove_dead_stones(const FullBoard & tt_endboard);
@@ -57,7 +71,12 @@ public:
     std::uint64_t m_hash;
     std::uint64_t m_ko_hash;
 
+    // Hash of the board as transformed by each symmetry,
+    // kept up to date together with m_hash on boards of BOARD_SIZE.
+    std::array<std::uint64_t, NUM_SYMMETRIES> m_sym_hash;
+
 private:
+    void hash_vertex(int old_state, int new_state, int vertex);
     template<class Function>
     std::uint64_t calc_hash(int komove, Function transform) const;
     bool m_lastforced{false};
@@ -65,13 +65,22 @@ using namespace Utils;
 bool cfg_gtp_mode;
 bool cfg_japanese_mode;
 bool cfg_use_nncache;
+NNCache::Format cfg_cache_format;
+NNCache::Eviction cfg_cache_eviction;
+std::string cfg_cache_file;
+size_t cfg_cache_file_size;
+bool cfg_shared_cache;
+size_t cfg_shared_cache_size;
 bool cfg_allow_pondering;
 unsigned int cfg_num_threads;
 unsigned int cfg_batch_size;
+unsigned int cfg_cpu_batch_size;
+bool cfg_cpu_int8;
 int cfg_max_playouts;
 int cfg_max_visits;
 size_t cfg_max_memory;
 size_t cfg_max_tree_size;
+size_t cfg_max_ttable_size;
 int cfg_max_cache_ratio_percent;
 TimeManagement::enabled_t cfg_timemanage;
 int cfg_lagbuffer_cs;
@@ -87,6 +96,10 @@ bool cfg_chainsize_features;
 bool cfg_exploit_symmetries;
 bool cfg_symm_nonrandom;
 bool cfg_laddercode;
+bool cfg_transpositions;
+unsigned int cfg_batch_leaves;
+bool cfg_collect_tree;
+bool cfg_numa;
 bool cfg_pass_agree;
 float cfg_noise_value;
 float cfg_noise_weight;
@@ -347,12 +360,20 @@ void GTP::setup_default_parameters() {
     cfg_gtp_mode = false;
     cfg_japanese_mode = false;
     cfg_use_nncache = true;
+    cfg_cache_format = NNCache::Format::FULL;
+    cfg_cache_eviction = NNCache::Eviction::FIFO;
+    cfg_cache_file = "";
+    cfg_cache_file_size = 256 * MiB;
+    cfg_shared_cache = false;
+    cfg_shared_cache_size = 1024 * MiB;
     cfg_allow_pondering = true;
 
     // we will re-calculate this on Leela.cpp
     cfg_num_threads = 1;
     // we will re-calculate this on Leela.cpp
     cfg_batch_size = 1;
+    cfg_cpu_batch_size = 1;
+    cfg_cpu_int8 = false;
 
     cfg_max_memory = UCTSearch::DEFAULT_MAX_MEMORY;
     cfg_max_playouts = UCTSearch::UNLIMITED_PLAYOUTS;
@@ -363,6 +384,8 @@ void GTP::setup_default_parameters() {
     cfg_betatune = 0.0f;
     // This will be overwritten in initialize() after network size is known.
     cfg_max_tree_size = UCTSearch::DEFAULT_MAX_MEMORY;
+    cfg_max_ttable_size =
+        UCTSearch::DEFAULT_MAX_MEMORY / UCTSearch::TTABLE_SHARE;
     cfg_max_cache_ratio_percent = 10;
     cfg_timemanage = TimeManagement::AUTO;
     cfg_lagbuffer_cs = 100;
@@ -383,6 +406,10 @@ void GTP::setup_default_parameters() {
     cfg_exploit_symmetries = true;
     cfg_symm_nonrandom = true;
     cfg_laddercode = true;
+    cfg_transpositions = false;
+    cfg_batch_leaves = 1;
+    cfg_collect_tree = true;
+    cfg_numa = false;
     cfg_pass_agree = false;
     cfg_fpuzero = false;
     cfg_uselcb = true;
@@ -469,6 +496,7 @@ const std::string GTP::s_commands[] = {
     "lz-analyze",
     "lz-genmove_analyze",
     "lz-memory_report",
+    "lz-cache_stats",
     "lz-setoption",
     "gomill-explain_last_move",
     ""
@@ -1378,6 +1406,12 @@ void GTP::execute(GameState & game, const std::string& xinput) {
             "Network with overhead: %d MiB / Search tree: %d MiB / Network cache: %d\n",
             total / MiB, base_memory / MiB, tree_size / MiB, cache_size / MiB);
         return;
+    } else if (command.find("lz-cache_stats") == 0) {
+        auto stats = s_network->get_nncache_stats();
+        // Drop the final newline, gtp_printf adds its own.
+        stats.pop_back();
+        gtp_printf(id, "%s", stats.c_str());
+        return;
     } else if (command.find("lz-setoption") == 0) {
         return execute_setoption(*search.get(), id, command);
     } else if (command.find("gomill-explain_last_move") == 0) {
@@ -1436,13 +1470,21 @@ std::pair<bool, std::string> GTP::set_max_memory(size_t max_memory,
         cache_size_ratio_percent / 100;
 
     auto max_cache_count =
-        (int)(remove_overhead(max_cache_size) / NNCache::ENTRY_SIZE);
+        (int)(remove_overhead(max_cache_size)
+              / NNCache::get_entry_size(cfg_cache_format));
 
     // Verify if the setting would not result in too little cache.
     if (max_cache_count < NNCache::MIN_CACHE_COUNT) {
         return std::make_pair(false, "Not enough memory for cache.");
     }
     auto max_tree_size = max_memory_for_search - max_cache_size;
+    // The transposition table, if any, takes its share of the memory
+    // of the tree.
+    auto max_ttable_size = size_t{0};
+    if (cfg_transpositions) {
+        max_ttable_size = max_tree_size / UCTSearch::TTABLE_SHARE;
+        max_tree_size -= max_ttable_size;
+    }
 
     if (max_tree_size < UCTSearch::MIN_TREE_SPACE) {
         return std::make_pair(false, "Not enough memory for search tree.");
@@ -1453,6 +1495,7 @@ std::pair<bool, std::string> GTP::set_max_memory(size_t max_memory,
     cfg_max_cache_ratio_percent = cache_size_ratio_percent;
     // Set max_tree_size.
     cfg_max_tree_size = remove_overhead(max_tree_size);
+    cfg_max_ttable_size = max_ttable_size;
     // Resize cache.
     s_network->nncache_resize(max_cache_count);
 
@@ -83,13 +83,22 @@ private:
 extern bool cfg_gtp_mode;
 extern bool cfg_japanese_mode;
 extern bool cfg_use_nncache;
+extern NNCache::Format cfg_cache_format;
+extern NNCache::Eviction cfg_cache_eviction;
+extern std::string cfg_cache_file;
+extern size_t cfg_cache_file_size;
+extern bool cfg_shared_cache;
+extern size_t cfg_shared_cache_size;
 extern bool cfg_allow_pondering;
 extern unsigned int cfg_num_threads;
 extern unsigned int cfg_batch_size;
+extern unsigned int cfg_cpu_batch_size;
+extern bool cfg_cpu_int8;
 extern int cfg_max_playouts;
 extern int cfg_max_visits;
 extern size_t cfg_max_memory;
 extern size_t cfg_max_tree_size;
+extern size_t cfg_max_ttable_size;
 extern int cfg_max_cache_ratio_percent;
 extern TimeManagement::enabled_t cfg_timemanage;
 extern int cfg_lagbuffer_cs;
@@ -105,6 +114,10 @@ extern bool cfg_chainsize_features;
 extern bool cfg_exploit_symmetries;
 extern bool cfg_symm_nonrandom;
 extern bool cfg_laddercode;
+extern bool cfg_transpositions;
+extern unsigned int cfg_batch_leaves;
+extern bool cfg_collect_tree;
+extern bool cfg_numa;
 extern bool cfg_pass_agree;
 extern float cfg_noise_value;
 extern float cfg_noise_weight;
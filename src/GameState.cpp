@@ -83,6 +83,7 @@ void GameState::reset_game() {
 }
 
 bool GameState::forward_move() {
+    assert(m_search_history.empty());
     auto movenum = get_movenum();
     if (game_history.size() > movenum + 1) {
         ++movenum;
@@ -99,6 +100,7 @@ bool GameState::forward_move() {
 }
 
 bool GameState::undo_move() {
+    assert(m_search_history.empty());
     auto movenum = get_movenum();
     if (movenum > 0) {
         --movenum;
@@ -119,6 +121,17 @@ void GameState::rewind() {
     set_movenum(0);
 }
 
+void GameState::rewind_to(const GameState& root) {
+    assert(root.get_movenum() <= get_movenum());
+    KoState::rewind_to(root);
+    game_history.resize(root.get_movenum() + 1);
+}
+
+void GameState::begin_search(size_t input_moves) {
+    m_search_root = get_movenum();
+    m_search_history.resize(std::max(input_moves, size_t{1}));
+}
+
 void GameState::play_move(int vertex) {
     play_move(get_to_move(), vertex);
 }
@@ -130,9 +143,13 @@ void GameState::play_move(int color, int vertex) {
       KoState::play_move(color, vertex);
     }
 
-    // cut off any leftover moves from navigating
-    game_history.resize(get_movenum());
-    game_history.emplace_back(std::make_shared<KoState>(*this));
+    if (!m_search_history.empty()) {
+        m_search_history[get_movenum() % m_search_history.size()] = *this;
+    } else {
+        // cut off any leftover moves from navigating
+        game_history.resize(get_movenum());
+        game_history.emplace_back(std::make_shared<KoState>(*this));
+    }
 
     // this is the place to reset state info for comments
     reset_comment_data();
@@ -346,6 +363,17 @@ std::shared_ptr<const KoState> GameState::get_past_state(int moves_ago) const {
     return game_history[get_movenum() - moves_ago];
 }
 
+const FastState& GameState::get_past_position(int moves_ago) const {
+    assert(moves_ago >= 0 && (unsigned)moves_ago <= get_movenum());
+    const auto movenum = get_movenum() - moves_ago;
+    if (m_search_history.empty() || movenum <= m_search_root) {
+        assert(movenum < game_history.size());
+        return *game_history[movenum];
+    }
+    assert((unsigned)moves_ago < m_search_history.size());
+    return m_search_history[movenum % m_search_history.size()];
+}
+
 std::string GameState::eval_comment(bool print_header) const {
     auto comstr = std::stringstream{};
 
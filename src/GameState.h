@@ -59,9 +59,20 @@ public:
     void anchor_game_history();
 
     void rewind(); /* undo infinite */
+    // Go back to root, which must be an earlier position of this
+    // game, dropping the moves played since. Lets a search state replay
+    // from the same root without copying the whole game every time.
+    void rewind_to(const GameState& root);
+    // From now on keep only the last positions, as many as the network
+    // looks at, in a ring reused in place instead of a snapshot of each
+    // position in the game history. For search states. Moves can't be
+    // undone afterwards.
+    void begin_search(size_t input_moves);
     bool undo_move();
     bool forward_move();
     std::shared_ptr<const KoState> get_past_state(int moves_ago) const;
+    // Also works in search mode, for moves_ago < input_moves.
+    const FastState& get_past_position(int moves_ago) const;
     const FullBoard& get_past_board(int moves_ago) const;
     const std::vector<std::shared_ptr<const KoState>>& get_game_history() const;
 
@@ -93,6 +104,10 @@ private:
     bool valid_handicap(int stones);
 
     std::vector<std::shared_ptr<const KoState>> game_history;
+    // In search mode, positions after the root are kept here, indexed
+    // by move number modulo the size, and game_history stops at the root.
+    std::vector<FastState> m_search_history;
+    size_t m_search_root{0};
     TimeControl m_timecontrol;
     int m_resigned{FastBoard::EMPTY};
     std::pair<int, int> m_acceptedscore = {-1 * NUM_INTERSECTIONS, NUM_INTERSECTIONS};
@@ -45,15 +45,36 @@ void KoState::init_game(int size, float komi) {
 
     FastState::init_game(size, komi);
 
+    clear_ko_history();
+    push_ko_hash(board.get_ko_hash());
+}
+
+void KoState::clear_ko_history() {
     m_ko_hash_history.clear();
-    m_ko_hash_history.emplace_back(board.get_ko_hash());
+    m_ko_filter.fill(0);
+}
+
+void KoState::push_ko_hash(std::uint64_t ko_hash) {
+    if (!m_ko_hash_history.empty()) {
+        const auto index = ko_filter_index(m_ko_hash_history.back());
+        m_ko_filter[index / 64] |= std::uint64_t{1} << (index % 64);
+    }
+    m_ko_hash_history.push_back(ko_hash);
 }
 
 bool KoState::superko() const {
+    // Only search the history if a position other than the last one
+    // (normally the current one) falls on the same bit.
+    const auto ko_hash = board.get_ko_hash();
+    const auto index = ko_filter_index(ko_hash);
+    if (!(m_ko_filter[index / 64] & (std::uint64_t{1} << (index % 64)))) {
+        return false;
+    }
+
     auto first = crbegin(m_ko_hash_history);
     auto last = crend(m_ko_hash_history);
 
-    auto res = std::find(++first, last, board.get_ko_hash());
+    auto res = std::find(++first, last, ko_hash);
 
     return (res != last);
 }
@@ -61,8 +82,8 @@ bool KoState::superko() const {
 void KoState::reset_game() {
     FastState::reset_game();
 
-    m_ko_hash_history.clear();
-    m_ko_hash_history.push_back(board.get_ko_hash());
+    clear_ko_history();
+    push_ko_hash(board.get_ko_hash());
     const StateEval void_ev;
     set_eval(void_ev);
 }
@@ -75,7 +96,16 @@ void KoState::play_move(int color, int vertex) {
     if (vertex != FastBoard::RESIGN) {
         FastState::play_move(color, vertex);
     }
-    m_ko_hash_history.push_back(board.get_ko_hash());
+    push_ko_hash(board.get_ko_hash());
+}
+
+void KoState::rewind_to(const KoState& root) {
+    assert(root.m_ko_hash_history.size() <= m_ko_hash_history.size());
+    *(static_cast<FastState*>(this)) = root;
+    // The history of root is a prefix of ours.
+    m_ko_hash_history.resize(root.m_ko_hash_history.size());
+    m_ko_filter = root.m_ko_filter;
+    m_ev = root.m_ev;
 }
 
 StateEval KoState::get_eval() const {
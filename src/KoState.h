@@ -33,6 +33,8 @@
 
 #include "config.h"
 
+#include <array>
+#include <cstdint>
 #include <vector>
 #include <tuple>
 
@@ -76,8 +78,26 @@ public:
     void play_move(int vertex);
     void play_move(int color, int vertex);
 
+    // Return to root, which must be an earlier position of this game.
+    // Only forgets the later ko hashes instead of copying them all.
+    void rewind_to(const KoState& root);
+
 private:
+    // Bits of the ko hash filter, must be a power of two.
+    static constexpr size_t KO_FILTER_BITS = 2048;
+
+    static size_t ko_filter_index(std::uint64_t ko_hash) {
+        return ko_hash & (KO_FILTER_BITS - 1);
+    }
+    void clear_ko_history();
+    void push_ko_hash(std::uint64_t ko_hash);
+
     std::vector<std::uint64_t> m_ko_hash_history;
+    // Bits set by the hashes of m_ko_hash_history but the last one
+    // (normally the current position), so that superko() only searches
+    // the history when the position may have been seen before. It is
+    // small as it is copied with every state.
+    std::array<std::uint64_t, KO_FILTER_BITS / 64> m_ko_filter{};
     StateEval m_ev;
     /* float m_alpkt = 0.0f; */
     /* float m_beta = 1.0f; */
@@ -48,6 +48,7 @@
 #include "NNCache.h"
 #include "Random.h"
 #include "ThreadPool.h"
+#include "UCTNode.h"
 #include "Utils.h"
 #include "Zobrist.h"
 
@@ -66,7 +67,10 @@ static void license_blurb() {
 
 static void calculate_thread_count_cpu(boost::program_options::variables_map & vm) {
     // If we are CPU-based, there is no point using more than the number of CPUs/
-    auto cfg_max_threads = std::min(SMP::get_num_cpus(), size_t{MAX_CPUS});
+    // With CPU batches, the search threads whose positions make up a batch
+    // wait for one CPU to evaluate it.
+    auto cfg_max_threads = std::min(SMP::get_num_cpus() * cfg_cpu_batch_size,
+                                    size_t{MAX_CPUS});
 
 #ifndef NDEBUG
     cfg_max_threads = 1;
@@ -165,6 +169,27 @@ static void parse_commandline(int argc, char *argv[]) {
         ("nosymm", "Do not exploit symmetries.")
         ("symm", "Exploit symmetries, but choose move randomly.")
         ("noladdercode", "Don't use heuristics for deeper ladders exploration.")
+        ("transpositions", "Share the winrates of the positions reached "
+                           "by different move orders during the search. "
+                           "Their network evaluations are shared by the "
+                           "NN cache.")
+        ("batch-leaves", po::value<unsigned int>()->default_value(cfg_batch_leaves),
+                         "Positions each search thread gathers and evaluates "
+                         "as one batch. Fewer threads can then keep the "
+                         "network busy.")
+        ("cpu-batchsize", po::value<unsigned int>()->default_value(cfg_cpu_batch_size),
+                          "Positions of different search threads the CPU "
+                          "evaluates as one batch. Up to this many search "
+                          "threads per CPU are then started.")
+        ("int8", "Evaluate the residual tower on the CPU with 8-bit "
+                 "integers. Faster at small --cpu-batchsize, but slightly "
+                 "less accurate. Falls back to single precision if it is "
+                 "too far off.")
+        ("nocollect", "Stop the search when the tree is full, instead of "
+                      "pruning its subtrees with fewer visits.")
+        ("numa", "Pin the search threads to CPUs spread over the NUMA "
+                 "nodes, and keep a copy of the network weights on "
+                 "each node.")
         ("lagbuffer,b", po::value<int>()->default_value(cfg_lagbuffer_cs),
                         "Safety margin for time usage in centiseconds.")
         ("resignpct,r", po::value<float>()->default_value(cfg_resignpct),
@@ -185,6 +210,27 @@ static void parse_commandline(int argc, char *argv[]) {
         ("benchmark", "Test network and exit. Default args:\n-v3200 --noponder "
                       "-m0 -t1 -s1.")
         ("nocache", "Disable neural network cache.")
+        ("cache-format", po::value<std::string>()->default_value("full"),
+                         "[full|half|log8] Storage of the policy in the "
+                         "neural network cache.\n"
+                         "half and log8 fit about 2x and 4x more positions "
+                         "in the same memory, at some loss of precision.")
+        ("cache-eviction", po::value<std::string>()->default_value("fifo"),
+                           "[fifo|clock] Which entry of the neural network "
+                           "cache makes room for a new one.\n"
+                           "clock spares recently hit entries, fifo evicts "
+                           "the oldest.")
+        ("cache-file", po::value<std::string>(),
+                       "Keep the opening positions of the neural network "
+                       "cache in this file, shared between runs.")
+        ("cache-file-size", po::value<int>()->default_value(256),
+                            "Size of the cache file in MiB.")
+        ("shared-cache", "Share the neural network cache with the other "
+                         "SAI processes on this host using the same network. "
+                         "They must share a PID namespace.")
+        ("shared-cache-size", po::value<int>()->default_value(1024),
+                              "Size of the shared cache in MiB, "
+                              "set by the first process.")
 #ifndef USE_CPU_ONLY
         ("cpu-only", "Use CPU-only implementation and do not use OpenCL device(s).")
 #endif
@@ -438,8 +484,19 @@ static void parse_commandline(int argc, char *argv[]) {
     cfg_cpu_only = true;
 #endif
 
+    if (vm.count("cpu-batchsize")) {
+        cfg_cpu_batch_size = std::max(vm["cpu-batchsize"].as<unsigned int>(), 1u);
+    }
+
+    if (vm.count("int8")) {
+        cfg_cpu_int8 = true;
+    }
+
     if (cfg_cpu_only) {
         calculate_thread_count_cpu(vm);
+        if (cfg_cpu_batch_size > 1) {
+            myprintf("Using CPU batch size of %d\n", cfg_cpu_batch_size);
+        }
     } else {
 #ifdef USE_OPENCL
         calculate_thread_count_gpu(vm);
@@ -471,6 +528,40 @@ static void parse_commandline(int argc, char *argv[]) {
         cfg_max_cache_ratio_percent = 1;
     }
 
+    auto cache_format = vm["cache-format"].as<std::string>();
+    if (cache_format == "full") {
+        cfg_cache_format = NNCache::Format::FULL;
+    } else if (cache_format == "half") {
+        cfg_cache_format = NNCache::Format::HALF;
+    } else if (cache_format == "log8") {
+        cfg_cache_format = NNCache::Format::LOG8;
+    } else {
+        printf("Unexpected option for --cache-format, expecting full/half/log8\n");
+        exit(EXIT_FAILURE);
+    }
+
+    auto cache_eviction = vm["cache-eviction"].as<std::string>();
+    if (cache_eviction == "fifo") {
+        cfg_cache_eviction = NNCache::Eviction::FIFO;
+    } else if (cache_eviction == "clock") {
+        cfg_cache_eviction = NNCache::Eviction::CLOCK;
+    } else {
+        printf("Unexpected option for --cache-eviction, expecting fifo/clock\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm.count("cache-file")) {
+        cfg_cache_file = vm["cache-file"].as<std::string>();
+        cfg_cache_file_size =
+            size_t(std::max(1, vm["cache-file-size"].as<int>())) * MiB;
+    }
+
+    if (vm.count("shared-cache")) {
+        cfg_shared_cache = true;
+        cfg_shared_cache_size =
+            size_t(std::max(1, vm["shared-cache-size"].as<int>())) * MiB;
+    }
+
     if (vm.count("dumbpass")) {
         cfg_dumbpass = true;
     }
@@ -566,6 +657,36 @@ static void parse_commandline(int argc, char *argv[]) {
     if (vm.count("noladdercode")) {
         cfg_laddercode = false;
     }
+
+    if (vm.count("transpositions")) {
+        cfg_transpositions = true;
+        if (!cfg_use_nncache) {
+            myprintf("Transpositions share the winrates only, without the "
+                     "NN cache each one is still evaluated by the network.\n");
+        }
+    }
+    if (vm.count("batch-leaves")) {
+        cfg_batch_leaves = std::max(vm["batch-leaves"].as<unsigned int>(), 1u);
+        if (cfg_batch_leaves > 1 && !cfg_use_nncache) {
+            myprintf("Batching leaves needs the NN cache, ignoring "
+                     "--batch-leaves.\n");
+            cfg_batch_leaves = 1;
+        }
+        // Each descent of each thread holds its virtual loss on the
+        // root until the batch is evaluated.
+        const auto max_leaves = std::max(
+            UCTNode::MAX_DESCENTS / std::max(cfg_num_threads, 1u), 1u);
+        if (cfg_batch_leaves > max_leaves) {
+            myprintf("Clamping batch leaves to maximum = %d\n", max_leaves);
+            cfg_batch_leaves = max_leaves;
+        }
+    }
+    if (vm.count("nocollect")) {
+        cfg_collect_tree = false;
+    }
+    if (vm.count("numa")) {
+        cfg_numa = true;
+    }
     if (vm.count("timemanage")) {
         auto tm = vm["timemanage"].as<std::string>();
         if (tm == "auto") {
@@ -634,7 +755,15 @@ static void initialize_network() {
 
 // Setup global objects after command line has been parsed
 void init_global_objects() {
-    thread_pool.initialize(cfg_num_threads);
+    if (cfg_numa) {
+        myprintf("Pinning %d threads over %zu NUMA nodes.\n",
+                 cfg_num_threads, SMP::get_num_nodes());
+        thread_pool.initialize(cfg_num_threads, [](size_t i) {
+            SMP::pin_thread_to_cpu(SMP::get_thread_cpu(i));
+        });
+    } else {
+        thread_pool.initialize(cfg_num_threads);
+    }
 
     // Use deterministic random numbers for hashing
     auto rng = std::make_unique<Random>(5489);
@@ -28,8 +28,31 @@
 */
 
 #include "config.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+
+#include "half/half.hpp"
 
 #include "NNCache.h"
 #include "Utils.h"
@@ -38,57 +61,697 @@
 
 const int NNCache::MAX_CACHE_COUNT;
 const int NNCache::MIN_CACHE_COUNT;
-const size_t NNCache::ENTRY_SIZE;
+const size_t NNCache::NUM_SHARDS;
+const size_t NNCache::BUCKET_WAYS;
+const size_t NNCache::MOVE_CLASSES;
+const size_t NNCache::MOVE_CLASS_WIDTH;
+const size_t NNCache::AGE_CLASSES;
+const size_t NNCache::AGE_CLASS_BASE;
+
+// LOG8 codes cover probabilities down to e^-16 (about 1e-7) of the
+// largest one, code 0 is reserved for anything smaller.
+static constexpr auto LOG8_RANGE = 16.0f;
+static constexpr auto LOG8_STEPS = 254.0f;
+
+static std::array<float, 256> make_log8_table() {
+    auto table = std::array<float, 256>{};
+    table[0] = 0.0f;
+    for (auto code = 1; code < 256; code++) {
+        table[code] =
+            std::exp((code - 1) * LOG8_RANGE / LOG8_STEPS - LOG8_RANGE);
+    }
+    return table;
+}
+
+static const std::array<float, 256> s_log8_table = make_log8_table();
 
-NNCache::NNCache(int size) : m_size(size) {}
+// A cache file or shared segment starts with this header, padded to a page.
+// The magic is written last, so a file whose creation was
+// interrupted is never mistaken for a valid one. VERSION must change
+// whenever the layout of the header, a slot or a bucket changes, or
+// the keys of the entries, so that tables written by another build are
+// started over.
+struct NNCache::TableHeader {
+    static constexpr std::uint64_t MAGIC = 0x4548434143494153ULL; // SAICACHE
+    static constexpr std::uint32_t VERSION = 4;
+    static constexpr size_t SIZE = 4096;
 
-bool NNCache::lookup(std::uint64_t hash, Netresult & result) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    ++m_lookups;
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t ways;
+    std::uint32_t format;
+    std::uint32_t entry_size;
+    std::uint32_t intersections;
+    std::uint32_t shards;
+    std::uint64_t buckets;
+    char net_hash[64];
+    // Insertion stamps of the shards, so that the age of the
+    // entries carries over between runs and processes.
+    std::atomic<std::uint32_t> stamps[NUM_SHARDS];
+};
 
-    auto iter = m_cache.find(hash);
-    if (iter == m_cache.end()) {
-        return false;  // Not found.
+const std::uint64_t NNCache::TableHeader::MAGIC;
+const std::uint32_t NNCache::TableHeader::VERSION;
+const size_t NNCache::TableHeader::SIZE;
+
+size_t NNCache::get_entry_size(Format format) {
+    auto policy_size = size_t{0};
+    switch (format) {
+    case Format::FULL:
+        policy_size = NUM_INTERSECTIONS * sizeof(float);
+        break;
+    case Format::HALF:
+        policy_size = NUM_INTERSECTIONS * sizeof(std::uint16_t);
+        break;
+    case Format::LOG8:
+        policy_size = NUM_INTERSECTIONS * sizeof(std::uint8_t);
+        break;
     }
+    // Keep every slot aligned for its atomics.
+    return Utils::ceilMultiple(sizeof(Slot) + policy_size, alignof(Slot));
+}
 
-    const auto& entry = iter->second;
+NNCache::NNCache(int size, Format format)
+    : m_format(format), m_stride(get_entry_size(format)), m_size(size) {
+    resize(size);
+}
 
-    // Found it.
-    ++m_hits;
-    result = entry->result;
-    return true;
+NNCache::~NNCache() {
+    detach_file();
+}
+
+NNCache::Slot* NNCache::get_bucket(std::uint64_t hash) const {
+    // The low bits select the shard, use the others for the bucket.
+    const auto bucket = (hash / NUM_SHARDS) % m_buckets;
+    return get_slot((get_shard(hash) * m_buckets + bucket) * BUCKET_WAYS);
+}
+
+void NNCache::allocate(size_t buckets) {
+    m_buckets = buckets;
+    const auto slots = NUM_SHARDS * m_buckets * BUCKET_WAYS;
+    auto slab = static_cast<char*>(std::calloc(slots, m_stride));
+    if (!slab) {
+        throw std::bad_alloc();
+    }
+    m_slab.reset(slab);
+    m_table = slab;
+    for (auto& shard : m_shards) {
+        shard.stamp = 0;
+        shard.entries = 0;
+    }
+}
+
+void NNCache::encode(const Netresult& result, Slot& slot) const {
+    slot.policy_pass = result.policy_pass;
+    slot.value = result.value;
+    slot.alpha = result.alpha;
+    slot.beta = result.beta;
+    slot.is_sai = result.is_sai;
+
+    auto data = reinterpret_cast<char*>(&slot + 1);
+    switch (m_format) {
+    case Format::FULL:
+        std::memcpy(data, result.policy.data(),
+                    NUM_INTERSECTIONS * sizeof(float));
+        break;
+    case Format::HALF: {
+        auto policy = reinterpret_cast<std::uint16_t*>(data);
+        for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+            policy[i] = half_float::detail::float2half<std::round_to_nearest>(
+                result.policy[i]);
+        }
+        break;
+    }
+    case Format::LOG8: {
+        const auto policy_max = *std::max_element(begin(result.policy),
+                                                  end(result.policy));
+        slot.policy_max = policy_max;
+        auto policy = reinterpret_cast<std::uint8_t*>(data);
+        for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+            const auto p = result.policy[i];
+            auto code = 0;
+            if (p > 0.0f && policy_max > 0.0f) {
+                const auto scaled = (std::log(p / policy_max) + LOG8_RANGE)
+                                    * (LOG8_STEPS / LOG8_RANGE);
+                if (scaled >= -0.5f) {
+                    code = 1 + std::min(int(LOG8_STEPS),
+                                        int(std::lround(scaled)));
+                }
+            }
+            policy[i] = std::uint8_t(code);
+        }
+        break;
+    }
+    }
+}
+
+void NNCache::decode(const Slot& slot, Netresult& result) const {
+    result.policy_pass = slot.policy_pass;
+    result.value = slot.value;
+    result.alpha = slot.alpha;
+    result.beta = slot.beta;
+    result.is_sai = slot.is_sai != 0;
+
+    const auto data = reinterpret_cast<const char*>(&slot + 1);
+    switch (m_format) {
+    case Format::FULL:
+        std::memcpy(result.policy.data(), data,
+                    NUM_INTERSECTIONS * sizeof(float));
+        break;
+    case Format::HALF: {
+        const auto policy = reinterpret_cast<const std::uint16_t*>(data);
+        for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+            result.policy[i] =
+                half_float::detail::half2float<float>(policy[i]);
+        }
+        break;
+    }
+    case Format::LOG8: {
+        const auto policy = reinterpret_cast<const std::uint8_t*>(data);
+        const auto policy_max = slot.policy_max;
+        for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+            result.policy[i] = policy_max * s_log8_table[policy[i]];
+        }
+        break;
+    }
+    }
+}
+
+std::uint32_t NNCache::get_stamp(size_t shard) const {
+    if (m_shared) {
+        return m_header->stamps[shard].load(std::memory_order_relaxed);
+    }
+    return m_shards[shard].stamp;
+}
+
+bool NNCache::lookup(std::uint64_t hash, Netresult & result,
+                     size_t movenum) {
+    const auto index = get_shard(hash);
+    auto& shard = m_shards[index];
+    const auto move_class = std::min(MOVE_CLASSES - 1,
+                                     movenum / MOVE_CLASS_WIDTH);
+    shard.lookups.fetch_add(1, std::memory_order_relaxed);
+    shard.move_lookups[move_class].fetch_add(1, std::memory_order_relaxed);
+
+    auto slot = get_bucket(hash);
+    for (auto i = size_t{0}; i < BUCKET_WAYS; i++, slot = next(slot)) {
+        if (slot->key.load(std::memory_order_relaxed) != hash) {
+            continue;
+        }
+        const auto seq = slot->seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            return false;  // Being replaced.
+        }
+        const auto stamp = slot->stamp;
+        decode(*slot, result);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) != seq
+            || slot->key.load(std::memory_order_relaxed) != hash
+            || stamp == 0) {
+            return false;  // Replaced while we were copying.
+        }
+
+        // Found it.
+        if (!m_readonly
+            && !slot->referenced.load(std::memory_order_relaxed)) {
+            slot->referenced.store(1, std::memory_order_relaxed);
+        }
+        // The stamp is only read racily here, but this is statistics.
+        const auto age = size_t(get_stamp(index) - stamp) * NUM_SHARDS;
+        auto age_class = size_t{0};
+        for (auto limit = AGE_CLASS_BASE;
+             age >= limit && age_class < AGE_CLASSES - 1; limit *= 4) {
+            age_class++;
+        }
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        shard.move_hits[move_class].fetch_add(1, std::memory_order_relaxed);
+        shard.age_hits[age_class].fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;  // Not found.
 }
 
 void NNCache::insert(std::uint64_t hash,
                      const Netresult& result) {
-    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_readonly) {
+        return;
+    }
+    const auto index = get_shard(hash);
+    auto& shard = m_shards[index];
+    // Processes sharing the table can't share a mutex, they claim
+    // slots with a compare-and-swap instead.
+    std::unique_lock<std::mutex> lock(shard.mutex, std::defer_lock);
+    if (!m_shared) {
+        lock.lock();
+    }
+    const auto now = get_stamp(index);
+    // Stamps wrap around, so compare ages rather than stamps.
+    const auto older = [now](const Slot* a, const Slot* b) {
+        return now - a->stamp > now - b->stamp;
+    };
 
-    if (m_cache.find(hash) != m_cache.end()) {
-        return;  // Already in the cache.
+    auto victim = static_cast<Slot*>(nullptr);
+    auto candidates = std::array<Slot*, BUCKET_WAYS>{};
+    auto num_candidates = size_t{0};
+    auto slot = get_bucket(hash);
+    for (auto i = size_t{0}; i < BUCKET_WAYS; i++, slot = next(slot)) {
+        if (slot->stamp == 0) {
+            victim = slot;
+            break;
+        }
+        if (slot->key.load(std::memory_order_relaxed) == hash) {
+            return;  // Already in the cache.
+        }
+        const auto seq = slot->seq.load(std::memory_order_relaxed);
+        if (m_shared && (seq & 1) && !writer_died(seq)) {
+            continue;  // Being written by another process.
+        }
+        candidates[num_candidates++] = slot;
+    }
+    if (!victim) {
+        const auto first = begin(candidates);
+        const auto last = first + num_candidates;
+        for (auto it = first; it != last; ++it) {
+            if ((m_eviction == Eviction::FIFO || !(*it)->referenced)
+                && (!victim || older(*it, victim))) {
+                victim = *it;
+            }
+        }
+        const auto all_referenced = !victim;
+        if (all_referenced && num_candidates > 0) {
+            // Everything was hit, fall back to the oldest.
+            victim = *std::min_element(first, last, older);
+        }
+        if (!victim) {
+            return;
+        }
+        if (m_eviction == Eviction::CLOCK) {
+            // The older entries were hit, spare them this time only.
+            for (auto it = first; it != last; ++it) {
+                if (all_referenced || older(*it, victim)) {
+                    (*it)->referenced.store(0, std::memory_order_relaxed);
+                }
+            }
+        }
     }
 
-    m_cache.emplace(hash, std::make_unique<Entry>(result));
-    m_order.push_back(hash);
-    ++m_inserts;
+    auto seq = victim->seq.load(std::memory_order_relaxed);
+    if (m_shared) {
+        // A slot left odd by a process that died while writing it is
+        // taken over, keeping it odd.
+        const auto count = std::uint32_t(seq);
+        const auto claimed = make_seq(count + ((count & 1) ? 2 : 1),
+                                      std::uint32_t(getpid()));
+        if (((count & 1) && !writer_died(seq))
+            || !victim->seq.compare_exchange_strong(
+                   seq, claimed, std::memory_order_acquire)) {
+            return;  // Lost the slot to another process.
+        }
+        seq = claimed;
+    } else {
+        // A slot left odd by a crash is simply taken over.
+        seq |= 1;
+        victim->seq.store(seq, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
 
-    // If the cache is too large, remove the oldest entry.
-    if (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+    if (victim->stamp == 0) {
+        shard.entries.fetch_add(1, std::memory_order_relaxed);
     }
+    auto stamp = std::uint32_t{0};
+    if (m_shared) {
+        stamp = m_header->stamps[index].fetch_add(
+                    1, std::memory_order_relaxed) + 1;
+    } else {
+        stamp = ++shard.stamp;
+        if (m_header) {
+            m_header->stamps[index].store(stamp, std::memory_order_relaxed);
+        }
+    }
+    if (stamp == 0) {
+        stamp = 1;
+    }
+
+    victim->key.store(hash, std::memory_order_relaxed);
+    victim->stamp = stamp;
+    victim->referenced.store(0, std::memory_order_relaxed);
+    encode(result, *victim);
+    victim->seq.store(make_seq(std::uint32_t(seq) + 1,
+                               std::uint32_t(seq >> 32)),
+                      std::memory_order_release);
+
+    shard.inserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool NNCache::writer_died(std::uint64_t seq) {
+#ifdef _WIN32
+    (void)seq;
+    return false;
+#else
+    const auto pid = pid_t(seq >> 32);
+    return pid != 0 && kill(pid, 0) != 0 && errno == ESRCH;
+#endif
+}
+
+void NNCache::set_format(Format format) {
+    if (format == m_format || m_header) {
+        return;
+    }
+    m_format = format;
+    m_stride = get_entry_size(format);
+    allocate(m_buckets);
 }
 
 void NNCache::resize(int size) {
+    if (m_header) {
+        return;
+    }
     m_size = size;
-    while (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+    const auto ways = NUM_SHARDS * BUCKET_WAYS;
+    const auto buckets = std::max(size_t{1}, (m_size + ways - 1) / ways);
+    if (buckets == m_buckets) {
+        return;
+    }
+
+    // Move the surviving entries over, oldest first, so that the
+    // newest ones are kept if the table shrinks.
+    auto old_slab = std::move(m_slab);
+    auto old_slots = NUM_SHARDS * m_buckets * BUCKET_WAYS;
+    std::vector<std::vector<const Slot*>> old_entries(NUM_SHARDS);
+    for (auto i = size_t{0}; i < old_slots; i++) {
+        const auto slot =
+            reinterpret_cast<const Slot*>(old_slab.get() + i * m_stride);
+        if (slot->stamp != 0) {
+            old_entries[get_shard(slot->key.load())].emplace_back(slot);
+        }
+    }
+    std::array<std::uint32_t, NUM_SHARDS> old_stamps;
+    for (auto shard = size_t{0}; shard < NUM_SHARDS; shard++) {
+        old_stamps[shard] = m_shards[shard].stamp;
+    }
+
+    allocate(buckets);
+
+    auto result = Netresult{};
+    for (auto shard = size_t{0}; shard < NUM_SHARDS; shard++) {
+        auto& entries = old_entries[shard];
+        const auto now = old_stamps[shard];
+        std::sort(begin(entries), end(entries),
+            [now](const Slot* a, const Slot* b) {
+                return now - a->stamp > now - b->stamp;
+            });
+        for (const auto slot : entries) {
+            decode(*slot, result);
+            insert(slot->key.load(), result);
+        }
     }
 }
 
 void NNCache::clear() {
-    m_cache.clear();
-    m_order.clear();
+    if (m_header) {
+        return;
+    }
+    allocate(m_buckets);
+}
+
+bool NNCache::attach_file(const std::string& filename,
+                          const std::string& net_hash,
+                          size_t max_bytes) {
+#ifdef _WIN32
+    (void)filename;
+    (void)net_hash;
+    (void)max_bytes;
+    Utils::myprintf("Cache files are not supported on this platform.\n");
+    return false;
+#else
+    if (m_header) {
+        return false;  // Already attached.
+    }
+
+    // Only one process writes to the file, others can still read it.
+    // Readers take no lock, so the writer never changes the size of a
+    // file that may be mapped: it starts over in a new file, which
+    // replaces the old one while those still mapping it keep it.
+    auto fd = -1;
+    auto readonly = false;
+    for (;;) {
+        fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            Utils::myprintf("Could not open cache file: %s\n",
+                            filename.c_str());
+            return false;
+        }
+        readonly = flock(fd, LOCK_EX | LOCK_NB) != 0;
+        // The writer we got the lock from may have just replaced the
+        // file, then the lock is on the old one.
+        struct stat st, path_st;
+        if (readonly
+            || (fstat(fd, &st) == 0
+                && stat(filename.c_str(), &path_st) == 0
+                && st.st_dev == path_st.st_dev
+                && st.st_ino == path_st.st_ino)) {
+            break;
+        }
+        close(fd);
+    }
+    if (!map_table(fd, net_hash, max_bytes, !readonly, false, readonly)
+        && (readonly || !replace_file(fd, filename, net_hash, max_bytes))) {
+        Utils::myprintf("Could not use cache file: %s\n", filename.c_str());
+        close(fd);
+        return false;
+    }
+    m_shared = false;
+
+    Utils::myprintf("Using cache file %s (%zu MiB, %zu entries%s).\n",
+                    filename.c_str(), m_mapped_size / (1024 * 1024), m_size,
+                    readonly ? ", read-only" : "");
+    return true;
+#endif
+}
+
+bool NNCache::attach_shared(const std::string& name,
+                            const std::string& net_hash,
+                            size_t max_bytes) {
+#ifdef _WIN32
+    (void)name;
+    (void)net_hash;
+    (void)max_bytes;
+    Utils::myprintf("Shared caches are not supported on this platform.\n");
+    return false;
+#else
+    if (m_header) {
+        return false;  // Already attached.
+    }
+
+    // The processes attached to the segment hold a shared lock on it.
+    // One that gets an exclusive lock is alone: it sets the segment up,
+    // or starts it over if its creator died before finishing.
+    auto fd = -1;
+    auto alone = false;
+    for (;;) {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            Utils::myprintf("Could not open shared cache: %s\n",
+                            name.c_str());
+            return false;
+        }
+        alone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+        if (!alone && flock(fd, LOCK_SH) != 0) {
+            close(fd);
+            return false;
+        }
+        // The last process to detach removes the segment. If that
+        // happened while we were waiting, open the next one.
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_nlink > 0) {
+            // A segment left behind by a crash keeps its size, as it
+            // may be getting mapped by a process we raced with.
+            if (alone && st.st_size > 0) {
+                max_bytes = size_t(st.st_size);
+            }
+            break;
+        }
+        close(fd);
+    }
+    if (!map_table(fd, net_hash, max_bytes, alone, alone, false)) {
+        Utils::myprintf("Could not use shared cache: %s\n", name.c_str());
+        if (alone) {
+            shm_unlink(name.c_str());
+        }
+        close(fd);
+        return false;
+    }
+    if (alone) {
+        flock(fd, LOCK_SH);
+    }
+    m_shared_name = name;
+    m_shared = true;
+
+    Utils::myprintf("Using shared cache %s (%zu MiB, %zu entries).\n",
+                    name.c_str(), m_mapped_size / (1024 * 1024), m_size);
+    return true;
+#endif
+}
+
+#ifndef _WIN32
+bool NNCache::map_table(int fd, const std::string& net_hash,
+                        size_t max_bytes, bool sets_size, bool may_reset,
+                        bool readonly) {
+    static_assert(sizeof(TableHeader) <= TableHeader::SIZE,
+                  "Cache table header does not fit");
+
+    TableHeader header{};
+    char hash[sizeof(header.net_hash)] = {};
+    net_hash.copy(hash, sizeof(hash));
+    const auto ways = NUM_SHARDS * BUCKET_WAYS;
+    auto buckets = std::max(size_t{1},
+        (std::max(max_bytes, TableHeader::SIZE) - TableHeader::SIZE)
+        / (ways * m_stride));
+
+    // Whoever sets the size only takes a table of that size,
+    // the others go with what they find.
+    const auto matches = [&](const TableHeader& h) {
+        return h.magic == TableHeader::MAGIC
+            && h.version == TableHeader::VERSION
+            && h.ways == BUCKET_WAYS
+            && h.format == std::uint32_t(m_format)
+            && h.entry_size == m_stride
+            && h.intersections == NUM_INTERSECTIONS
+            && h.shards == NUM_SHARDS
+            && std::memcmp(h.net_hash, hash, sizeof(hash)) == 0
+            && (!sets_size || h.buckets == buckets);
+    };
+
+    struct stat st;
+    auto valid = fstat(fd, &st) == 0
+        && pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header))
+        && matches(header);
+    if (valid) {
+        buckets = header.buckets;
+        valid = size_t(st.st_size) == TableHeader::SIZE
+                                      + buckets * ways * m_stride;
+    }
+    if (!valid && !may_reset) {
+        return false;
+    }
+
+    const auto size = TableHeader::SIZE + buckets * ways * m_stride;
+    if (!valid) {
+        // Start over with an empty, zero filled table. Nobody else may
+        // have the file mapped then, or they would get SIGBUS.
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+            return false;
+        }
+    }
+
+    const auto prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+    auto base = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    m_fd = fd;
+    m_readonly = readonly;
+    m_mapped_size = size;
+    m_header = static_cast<TableHeader*>(base);
+    if (!valid) {
+        m_header->version = TableHeader::VERSION;
+        m_header->ways = BUCKET_WAYS;
+        m_header->format = std::uint32_t(m_format);
+        m_header->entry_size = std::uint32_t(m_stride);
+        m_header->intersections = NUM_INTERSECTIONS;
+        m_header->shards = NUM_SHARDS;
+        m_header->buckets = buckets;
+        std::memcpy(m_header->net_hash, hash, sizeof(hash));
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = TableHeader::MAGIC;
+    }
+
+    m_slab.reset();
+    m_table = static_cast<char*>(base) + TableHeader::SIZE;
+    m_buckets = buckets;
+    m_size = buckets * ways;
+    for (auto i = size_t{0}; i < NUM_SHARDS; i++) {
+        m_shards[i].stamp = m_header->stamps[i].load();
+        m_shards[i].entries = 0;
+    }
+    return true;
+}
+
+bool NNCache::replace_file(int fd, const std::string& filename,
+                           const std::string& net_hash, size_t max_bytes) {
+    // In the same directory, so that it can be renamed over the file.
+    auto tmpname = filename + ".XXXXXX";
+    const auto tmpfd = mkstemp(&tmpname[0]);
+    if (tmpfd < 0) {
+        return false;
+    }
+    // Locked before anyone can open it under the final name. Until
+    // the header is written, those who do find no valid table.
+    if (fchmod(tmpfd, 0644) != 0
+        || flock(tmpfd, LOCK_EX | LOCK_NB) != 0
+        || rename(tmpname.c_str(), filename.c_str()) != 0) {
+        unlink(tmpname.c_str());
+        close(tmpfd);
+        return false;
+    }
+    if (!map_table(tmpfd, net_hash, max_bytes, true, true, false)) {
+        close(tmpfd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+#endif
+
+void NNCache::detach_file() {
+#ifndef _WIN32
+    if (!m_header) {
+        return;
+    }
+    munmap(m_header, m_mapped_size);
+    if (m_shared && flock(m_fd, LOCK_EX | LOCK_NB) == 0) {
+        // We were the last process attached.
+        shm_unlink(m_shared_name.c_str());
+    }
+    close(m_fd);  // Also releases the lock.
+    m_header = nullptr;
+    m_mapped_size = 0;
+    m_fd = -1;
+    m_readonly = false;
+    m_shared = false;
+    m_shared_name.clear();
+    m_table = nullptr;
+#endif
+}
+
+void NNCache::remove_unused_shared(const std::string& prefix) {
+#ifdef __linux__
+    // POSIX does not say where the segments live,
+    // on Linux they are the files in /dev/shm.
+    namespace fs = boost::filesystem;
+    auto ec = boost::system::error_code{};
+    for (auto it = fs::directory_iterator("/dev/shm", ec);
+         !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        const auto name = "/" + it->path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        const auto fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            continue;
+        }
+        // Nobody attached to it: its processes crashed.
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            Utils::myprintf("Removing unused shared cache %s.\n",
+                            name.c_str());
+            shm_unlink(name.c_str());
+        }
+        close(fd);
+    }
+#else
+    (void)prefix;
+#endif
 }
 
 void NNCache::set_size_from_playouts(int max_playouts) {
@@ -104,13 +767,77 @@ void NNCache::set_size_from_playouts(int max_playouts) {
     resize(max_size);
 }
 
+std::pair<int, int> NNCache::hit_rate() const {
+    auto hits = 0;
+    auto lookups = 0;
+    for (const auto& shard : m_shards) {
+        hits += shard.hits.load(std::memory_order_relaxed);
+        lookups += shard.lookups.load(std::memory_order_relaxed);
+    }
+    return {hits, lookups};
+}
+
+std::string NNCache::get_stats() const {
+    auto inserts = 0;
+    auto entries = size_t{0};
+    auto move_hits = std::array<int, MOVE_CLASSES>{};
+    auto move_lookups = std::array<int, MOVE_CLASSES>{};
+    auto age_hits = std::array<int, AGE_CLASSES>{};
+    for (const auto& shard : m_shards) {
+        inserts += shard.inserts.load(std::memory_order_relaxed);
+        entries += shard.entries.load(std::memory_order_relaxed);
+        for (auto i = size_t{0}; i < MOVE_CLASSES; i++) {
+            move_hits[i] += shard.move_hits[i].load(std::memory_order_relaxed);
+            move_lookups[i] +=
+                shard.move_lookups[i].load(std::memory_order_relaxed);
+        }
+        for (auto i = size_t{0}; i < AGE_CLASSES; i++) {
+            age_hits[i] += shard.age_hits[i].load(std::memory_order_relaxed);
+        }
+    }
+    const auto hits = hit_rate();
+
+    auto out = boost::str(boost::format(
+        "NNCache: %d/%d hits/lookups = %.1f%% hitrate, %d inserts, %d size, "
+        "%s eviction\n")
+        % hits.first % hits.second % (100. * hits.first / (hits.second + 1))
+        % inserts % entries
+        % (m_eviction == Eviction::FIFO ? "fifo" : "clock"));
+
+    out += "Hitrate by move:";
+    for (auto i = size_t{0}; i < MOVE_CLASSES; i++) {
+        const auto from = i * MOVE_CLASS_WIDTH;
+        const auto range = i < MOVE_CLASSES - 1
+            ? boost::str(boost::format("%d-%d")
+                         % from % (from + MOVE_CLASS_WIDTH - 1))
+            : boost::str(boost::format("%d+") % from);
+        out += boost::str(boost::format(" %s %.1f%%")
+            % range % (100. * move_hits[i] / std::max(1, move_lookups[i])));
+    }
+    out += "\nHits by entry age (inserts):";
+    auto limit = AGE_CLASS_BASE;
+    for (auto i = size_t{0}; i < AGE_CLASSES; i++, limit *= 4) {
+        const auto range = i < AGE_CLASSES - 1
+            ? boost::str(boost::format("<%dk") % (limit / 1000))
+            : boost::str(boost::format(">=%dk") % (limit / 4000));
+        out += boost::str(boost::format(" %s %.1f%%")
+            % range % (100. * age_hits[i] / std::max(1, hits.first)));
+    }
+    out += "\n";
+    return out;
+}
+
 void NNCache::dump_stats() {
-    Utils::myprintf(
-        "NNCache: %d/%d hits/lookups = %.1f%% hitrate, %d inserts, %u size\n",
-        m_hits, m_lookups, 100. * m_hits / (m_lookups + 1),
-        m_inserts, m_cache.size());
+    Utils::myprintf("%s", get_stats().c_str());
 }
 
 size_t NNCache::get_estimated_size() {
-    return m_order.size() * NNCache::ENTRY_SIZE;
+    auto entries = size_t{0};
+    for (const auto& shard : m_shards) {
+        entries += shard.entries.load(std::memory_order_relaxed);
+    }
+    if (m_header) {
+        return m_mapped_size;
+    }
+    return entries * m_stride;
 }
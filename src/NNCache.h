@@ -32,11 +32,13 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <array>
-#include <deque>
+#include <atomic>
+#include <cstdlib>
 #include <memory>
 #include <mutex>
-#include <unordered_map>
+#include <string>
 
 class NNCache {
 public:
@@ -70,57 +72,219 @@ public:
         }
     };
 
-    static constexpr size_t ENTRY_SIZE =
-          sizeof(Netresult)
-        + sizeof(std::uint64_t)
-        + sizeof(std::unique_ptr<Netresult>);
+    // How the policy of an entry is stored.
+    enum class Format {
+        // 32-bit floats, exact.
+        FULL,
+        // 16-bit floats, about half the memory of FULL.
+        HALF,
+        // 8-bit logarithmic codes relative to the largest probability,
+        // about a quarter of the memory of FULL.
+        LOG8
+    };
+
+    // Which entry of a bucket a new one replaces.
+    enum class Eviction {
+        // The oldest one.
+        FIFO,
+        // The oldest one not hit since it was last spared, giving
+        // entries that are hit a second chance.
+        CLOCK
+    };
 
-    NNCache(int size = MAX_CACHE_COUNT);  // ~ 208MiB
+    // Memory used by one entry of the table in the given format.
+    static size_t get_entry_size(Format format);
+
+    NNCache(int size = MAX_CACHE_COUNT,
+            Format format = Format::FULL);  // ~ 212MiB when full
+    ~NNCache();
+
+    NNCache(const NNCache&) = delete;
+    NNCache& operator=(const NNCache&) = delete;
+
+    // Move the table to a file mapped in memory, so that its entries
+    // outlive the process. The file is tied to the network with the
+    // given hash and to the format of this cache, and is replaced by a
+    // new one if either differs. If another process is writing to the
+    // file, it is attached read-only. Returns false if the file can't
+    // be used.
+    // A file backed cache can't be resized or cleared, and stays
+    // attached until it is destroyed.
+    bool attach_file(const std::string& filename,
+                     const std::string& net_hash,
+                     size_t max_bytes);
+
+    // Move the table to a POSIX shared memory segment, which all the
+    // processes using the same network and format can attach to and
+    // update without locks. The first process sets its size. The last
+    // one to detach removes the segment, segments left behind by
+    // crashes are reused or removed by remove_unused_shared.
+    // The processes must share a PID namespace: a slot being written by
+    // a process which looks dead is taken over. A slot whose writer
+    // died and whose PID was reused stays unused until that PID exits.
+    // Returns false if the segment can't be used.
+    bool attach_shared(const std::string& name,
+                       const std::string& net_hash,
+                       size_t max_bytes);
+
+    // Remove the shared segments whose names start with prefix and
+    // that no process is attached to.
+    static void remove_unused_shared(const std::string& prefix);
 
     // Set a reasonable size gives max number of playouts
     void set_size_from_playouts(int max_playouts);
 
-    // Resize NNCache
+    // Change the storage format. This clears the cache.
+    void set_format(Format format);
+    Format get_format() const {
+        return m_format;
+    }
+
+    void set_eviction(Eviction eviction) {
+        m_eviction = eviction;
+    }
+
+    // Resize NNCache. Not safe to call while lookups are in flight.
     void resize(int size);
     void clear();
 
-    // Try and find an existing entry.
-    bool lookup(std::uint64_t hash, Netresult & result);
+    // Try and find an existing entry. Never blocks.
+    // The move number is only used for statistics.
+    bool lookup(std::uint64_t hash, Netresult & result, size_t movenum = 0);
 
-    // Insert a new entry.
+    // Insert a new entry. Only locks the shard the hash maps to.
     void insert(std::uint64_t hash,
                 const Netresult& result);
 
     // Return the hit rate ratio.
-    std::pair<int, int> hit_rate() const {
-        return {m_hits, m_lookups};
-    }
+    std::pair<int, int> hit_rate() const;
 
+    // Hit rates overall, by move number and by age of the entries.
+    std::string get_stats() const;
     void dump_stats();
 
     // Return the estimated memory consumption of the cache.
     size_t get_estimated_size();
 private:
+    // Number of independently locked parts of the table.
+    // Must be a power of two.
+    static constexpr size_t NUM_SHARDS = 16;
+
+    // Number of slots in a bucket. A new entry replaces an entry of
+    // its bucket, according to m_eviction.
+    static constexpr size_t BUCKET_WAYS = 4;
+
+    // Statistics are split in this many ranges of move numbers...
+    static constexpr size_t MOVE_CLASSES = 8;
+    static constexpr size_t MOVE_CLASS_WIDTH =
+        std::max(1, NUM_INTERSECTIONS / int(MOVE_CLASSES));
+    // ...and hits in this many ranges of entry ages, the first one being
+    // AGE_CLASS_BASE inserts and the others 4 times the previous one.
+    static constexpr size_t AGE_CLASSES = 6;
+    static constexpr size_t AGE_CLASS_BASE = 1000;
+
+    // A slot is protected by a sequence lock: writers make seq odd
+    // while they modify the slot, readers copy the result out and treat
+    // any concurrent modification as a miss instead of waiting.
+    // All-zero bytes is a valid empty slot.
+    // The encoded policy follows the slot in memory.
+    struct Slot {
+        // Sequence number in the low half. In a shared table, the high
+        // half is the process which claimed the slot last, so that a
+        // process claims it and becomes its writer in one step.
+        std::atomic<std::uint64_t> seq;
+        std::atomic<std::uint64_t> key;
+        // Insertion order within the shard, 0 for an empty slot.
+        std::uint32_t stamp;
+        float policy_pass;
+        float value;
+        float alpha;
+        float beta;
+        // Largest policy value, LOG8 codes are relative to it.
+        float policy_max;
+        std::uint16_t is_sai;
+        // Set by hits, cleared when CLOCK spares the entry.
+        std::atomic<std::uint16_t> referenced;
+    };
+
+    // Writer lock and statistics of a shard. Shards are larger than a
+    // cache line, so threads working on different ones mostly do not
+    // share one. Not over-aligned: the cache lives in objects created by
+    // operator new, which ignores it before C++17.
+    struct Shard {
+        std::mutex mutex;
+        std::uint32_t stamp{0};
+        std::atomic<int> hits{0};
+        std::atomic<int> lookups{0};
+        std::atomic<int> inserts{0};
+        std::atomic<size_t> entries{0};
+        std::array<std::atomic<int>, MOVE_CLASSES> move_hits{};
+        std::array<std::atomic<int>, MOVE_CLASSES> move_lookups{};
+        std::array<std::atomic<int>, AGE_CLASSES> age_hits{};
+    };
+
+    struct SlabDeleter {
+        void operator()(char* p) const { std::free(p); }
+    };
+
+    Slot* get_slot(size_t index) const {
+        return reinterpret_cast<Slot*>(m_table + index * m_stride);
+    }
+    Slot* next(Slot* slot) const {
+        return reinterpret_cast<Slot*>(
+            reinterpret_cast<char*>(slot) + m_stride);
+    }
+    Slot* get_bucket(std::uint64_t hash) const;
+    static size_t get_shard(std::uint64_t hash) {
+        return hash & (NUM_SHARDS - 1);
+    }
 
-    std::mutex m_mutex;
+    std::uint32_t get_stamp(size_t shard) const;
+    static std::uint64_t make_seq(std::uint32_t seq, std::uint32_t pid) {
+        return (std::uint64_t{pid} << 32) | seq;
+    }
+    static bool writer_died(std::uint64_t seq);
+    void allocate(size_t buckets);
+    bool map_table(int fd, const std::string& net_hash, size_t max_bytes,
+                   bool sets_size, bool may_reset, bool readonly);
+    // Map a new empty table, which then replaces the cache file fd.
+    bool replace_file(int fd, const std::string& filename,
+                      const std::string& net_hash, size_t max_bytes);
+    void detach_file();
+    void encode(const Netresult& result, Slot& slot) const;
+    void decode(const Slot& slot, Netresult& result) const;
+
+    Format m_format;
+
+    Eviction m_eviction{Eviction::FIFO};
+
+    // Bytes between the start of two slots.
+    size_t m_stride;
 
+    // Requested size in number of entries.
     size_t m_size;
 
-    // Statistics
-    int m_hits{0};
-    int m_lookups{0};
-    int m_inserts{0};
+    // Buckets per shard.
+    size_t m_buckets{0};
 
-    struct Entry {
-        Entry(const Netresult& r)
-            : result(r) {}
-        Netresult result;  // ~ 1.4KiB
-    };
+    // The table: NUM_SHARDS * m_buckets * BUCKET_WAYS slots, allocated
+    // zeroed so untouched pages cost no memory.
+    std::unique_ptr<char[], SlabDeleter> m_slab;
+
+    // Start of the slots, in m_slab or in the mapped file.
+    char* m_table{nullptr};
+
+    // Mapped cache file or shared segment, if any.
+    struct TableHeader;
+    TableHeader* m_header{nullptr};
+    size_t m_mapped_size{0};
+    int m_fd{-1};
+    bool m_readonly{false};
+    // Other processes write to the table.
+    bool m_shared{false};
+    std::string m_shared_name;
 
-    // Map from hash to {features, result}
-    std::unordered_map<std::uint64_t, std::unique_ptr<const Entry>> m_cache;
-    // Order entries were added to the map.
-    std::deque<size_t> m_order;
+    std::array<Shard, NUM_SHARDS> m_shards;
 };
 
 #endif
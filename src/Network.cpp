@@ -34,6 +34,7 @@
 #include <array>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <iterator>
 #include <memory>
 #include <sstream>
@@ -58,6 +59,8 @@
 
 #include "Network.h"
 #include "CPUPipe.h"
+#include "CPUPipeInt8.h"
+#include "CPUScheduler.h"
 #ifdef USE_OPENCL
 #include "OpenCLScheduler.h"
 #include "UCTNode.h"
@@ -69,6 +72,7 @@
 #include "GTP.h"
 #include "NNCache.h"
 #include "Random.h"
+#include "SHA256.h"
 #include "ThreadPool.h"
 #include "Timing.h"
 #include "Utils.h"
@@ -568,9 +572,13 @@ int Network::load_network_file(const std::string& filename) {
         return 1;
     }
     // Stream the gz file in to a memory buffer stream.
+    // Hash it on the way if a cache file needs to be tied to it.
     auto buffer = std::stringstream{};
     constexpr auto chunkBufferSize = 64 * 1024;
     std::vector<char> chunkBuffer(chunkBufferSize);
+    const auto hash_weights = !cfg_cache_file.empty() || cfg_shared_cache;
+    auto sha = SHA256{};
+    sha.init();
     while (true) {
         auto bytesRead = gzread(gzhandle, chunkBuffer.data(), chunkBufferSize);
         if (bytesRead == 0) break;
@@ -581,8 +589,20 @@ int Network::load_network_file(const std::string& filename) {
         }
         assert(bytesRead <= chunkBufferSize);
         buffer.write(chunkBuffer.data(), bytesRead);
+        if (hash_weights) {
+            sha.update(reinterpret_cast<unsigned char*>(chunkBuffer.data()),
+                       bytesRead);
+        }
     }
     gzclose(gzhandle);
+    if (hash_weights) {
+        unsigned char digest[SHA256::DIGEST_SIZE];
+        sha.final(digest);
+        m_weights_hash.clear();
+        for (auto byte : digest) {
+            m_weights_hash += boost::str(boost::format("%02x") % int(byte));
+        }
+    }
 
     // Read format version
     auto line = std::string{};
@@ -645,6 +665,116 @@ int Network::load_network_file(const std::string& filename) {
     return 1;
 }
 
+// Gather the positions of the search threads into batches only when
+// asked to, a batch is evaluated by a single thread.
+static std::unique_ptr<ForwardPipe> make_cpu_pipe(std::unique_ptr<CPUPipe>&& pipe) {
+    if (cfg_cpu_batch_size > 1) {
+        return std::make_unique<CPUScheduler>(std::move(pipe));
+    }
+    return std::move(pipe);
+}
+
+std::vector<GameState> Network::get_random_positions(
+    const std::uint64_t seed) const {
+    constexpr auto GAMES = 4;
+    constexpr auto POSITIONS_PER_GAME = 16;
+    // Random moves until about two thirds of the board is filled.
+    constexpr auto MOVES_BETWEEN_POSITIONS =
+        std::max(1, 2 * NUM_INTERSECTIONS / (3 * POSITIONS_PER_GAME));
+
+    // The same games for a seed, so that the network is always
+    // quantized and checked in the same way.
+    auto rng = Random{seed};
+    auto positions = std::vector<GameState>{};
+    for (auto game = 0; game < GAMES; game++) {
+        auto state = GameState{};
+        state.init_game(BOARD_SIZE, cfg_komi);
+        for (auto i = 0; i < POSITIONS_PER_GAME; i++) {
+            positions.push_back(state);
+            for (auto move = 0; move < MOVES_BETWEEN_POSITIONS; move++) {
+                const auto color = state.get_to_move();
+                auto vertex = int{FastBoard::PASS};
+                for (auto tries = 0; tries < 100; tries++) {
+                    const auto x = int(rng.randuint64(BOARD_SIZE));
+                    const auto y = int(rng.randuint64(BOARD_SIZE));
+                    const auto candidate = state.board.get_vertex(x, y);
+                    if (state.is_move_legal(color, candidate)) {
+                        vertex = candidate;
+                        break;
+                    }
+                }
+                state.play_move(vertex);
+            }
+        }
+    }
+    return positions;
+}
+
+void Network::init_cpu_net(int channels) {
+    if (!cfg_cpu_int8) {
+        myprintf("Initializing CPU-only evaluation.\n");
+        m_forward = init_net(channels, make_cpu_pipe(std::make_unique<CPUPipe>()));
+        return;
+    }
+
+    myprintf("Initializing CPU-only evaluation (int8 residual tower).\n");
+    const auto positions = get_random_positions(CALIBRATION_SEED);
+    const auto include_color = (0 == m_input_planes % 2);
+    auto calibration_input = std::vector<float>{};
+    for (auto i = size_t{0}; i < positions.size(); i++) {
+        const auto planes = gather_features(&positions[i], i % NUM_SYMMETRIES,
+                                            m_input_moves, m_adv_features,
+                                            m_chainlibs_features,
+                                            m_chainsize_features, include_color);
+        calibration_input.insert(end(calibration_input),
+                                 begin(planes), end(planes));
+    }
+    auto pipe = std::make_unique<CPUPipeInt8>(std::move(calibration_input));
+    m_forward_int8 = pipe.get();
+    m_forward = init_net(channels, make_cpu_pipe(std::move(pipe)));
+
+    // The float pipe is the reference for the self-checks, which start
+    // with positions of other games than the calibration ones.
+    m_forward_cpu = init_net(channels, std::make_unique<CPUPipe>());
+    try {
+        const auto checked = get_random_positions(SELFCHECK_SEED);
+        auto max_error = 0.0f;
+        for (auto i = size_t{0}; i < checked.size(); i++) {
+            const auto symmetry = int(i % NUM_SYMMETRIES);
+            const auto result = get_output_internal(&checked[i], symmetry);
+            const auto result_ref =
+                get_output_internal(&checked[i], symmetry, true);
+            max_error = std::max(max_error,
+                compare_net_outputs(result, result_ref, checked[i].get_komi(),
+                                    checked[i].get_to_move()));
+        }
+        myprintf("Int8 self-check: largest error %.4f in %d positions.\n",
+                 max_error, int(checked.size()));
+    } catch (const std::runtime_error&) {
+        m_forward_cpu.reset();
+        m_forward_int8 = nullptr;
+        m_forward = init_net(channels, make_cpu_pipe(std::make_unique<CPUPipe>()));
+    }
+}
+
+bool Network::selfcheck(const Netresult& data, const Netresult& ref,
+                        const float komi, const int to_move) {
+    if (m_forward_int8 == nullptr) {
+        compare_net_outputs(data, ref, komi, to_move);
+        return true;
+    }
+    // A position unlike the calibration ones. Throwing from a search
+    // thread would end the program, the float tower is used instead as
+    // when the self-check at load time fails.
+    try {
+        compare_net_outputs(data, ref, komi, to_move);
+        return true;
+    } catch (const std::runtime_error&) {
+        m_forward_int8->use_float();
+        return false;
+    }
+}
+
 std::unique_ptr<ForwardPipe>&& Network::init_net(int channels,
     std::unique_ptr<ForwardPipe>&& pipe) {
 
@@ -756,6 +886,8 @@ void Network::initialize(int playouts, const std::string & weightsfile) {
 
     // Make a guess at a good size as long as the user doesn't
     // explicitly set a maximum memory usage.
+    m_nncache.set_format(cfg_cache_format);
+    m_nncache.set_eviction(cfg_cache_eviction);
     if (cfg_use_nncache) {
         m_nncache.set_size_from_playouts(playouts);
     } else {
@@ -780,6 +912,29 @@ void Network::initialize(int playouts, const std::string & weightsfile) {
     }
     m_value_head_sai = (m_value_head_type != SINGLE);
 
+    if (cfg_use_nncache && cfg_shared_cache) {
+        // One segment per network and storage format.
+        NNCache::remove_unused_shared("/sai-nncache-");
+        const auto name = "/sai-nncache-" + m_weights_hash.substr(0, 16)
+                          + "-" + std::to_string(int(cfg_cache_format));
+        m_shared_cache = std::make_unique<NNCache>(0, cfg_cache_format);
+        m_shared_cache->set_eviction(cfg_cache_eviction);
+        if (!m_shared_cache->attach_shared(name, m_weights_hash,
+                                           cfg_shared_cache_size)) {
+            myprintf("Using a private cache instead.\n");
+            m_shared_cache.reset();
+        }
+    }
+
+    if (cfg_use_nncache && !cfg_cache_file.empty()) {
+        m_file_cache = std::make_unique<NNCache>(0, cfg_cache_format);
+        m_file_cache->set_eviction(cfg_cache_eviction);
+        if (!m_file_cache->attach_file(cfg_cache_file, m_weights_hash,
+                                       cfg_cache_file_size)) {
+            m_file_cache.reset();
+        }
+    }
+
     auto weight_index = size_t{0};
     // Input convolution
     // Winograd transform convolution weights
@@ -826,8 +981,7 @@ void Network::initialize(int playouts, const std::string & weightsfile) {
 
 #ifdef USE_OPENCL
     if (cfg_cpu_only) {
-        myprintf("Initializing CPU-only evaluation.\n");
-        m_forward = init_net(m_channels, std::make_unique<CPUPipe>());
+        init_cpu_net(m_channels);
     } else {
 #ifdef USE_OPENCL_SELFCHECK
         // initialize CPU reference first, so that we can self-check
@@ -846,8 +1000,7 @@ void Network::initialize(int playouts, const std::string & weightsfile) {
     }
 
 #else //!USE_OPENCL
-    myprintf("Initializing CPU-only evaluation.\n");
-    m_forward = init_net(m_channels, std::make_unique<CPUPipe>());
+    init_cpu_net(m_channels);
 #endif
 
     // Need to estimate size before clearing up the pipe.
@@ -855,13 +1008,15 @@ void Network::initialize(int playouts, const std::string & weightsfile) {
     m_fwd_weights.reset();
 }
 
+// The output vector is reused, it only allocates when it has to grow.
 template<bool ReLU>
-std::vector<float> innerproduct(const std::vector<float>& input,
-                                const std::vector<float>& weights,
-                                const std::vector<float>& biases) {
+void innerproduct(const std::vector<float>& input,
+                  const std::vector<float>& weights,
+                  const std::vector<float>& biases,
+                  std::vector<float>& output) {
     const auto inputs = input.size();
     const auto outputs = biases.size();
-    std::vector<float> output(outputs);
+    output.resize(outputs);
     assert(inputs*outputs == weights.size());
 #ifdef USE_BLAS
     cblas_sgemv(CblasRowMajor, CblasNoTrans,
@@ -887,8 +1042,6 @@ std::vector<float> innerproduct(const std::vector<float>& input,
         }
         output[o] = val;
     }
-
-    return output;
 }
 
 template <size_t spatial_size>
@@ -919,9 +1072,9 @@ void batchnorm(const size_t channels,
     }
 }
 
-#ifdef USE_OPENCL_SELFCHECK
-void Network::compare_net_outputs(const Netresult& data,
-                                  const Netresult& ref) {
+float Network::compare_net_outputs(const Netresult& data,
+                                   const Netresult& ref,
+                                   const float komi, const int to_move) {
     // Calculates L2-norm between data and ref.
     constexpr auto max_error = 0.2f;
 
@@ -932,39 +1085,89 @@ void Network::compare_net_outputs(const Netresult& data,
         error += diff * diff;
     }
     const auto diff_pass = data.policy_pass - ref.policy_pass;
-    const auto diff_winrate = data.value - ref.value;
+    auto diff_winrate = data.value - ref.value;
+    if (ref.is_sai) {
+        // The value of SAI networks is in alpha and beta, compare the
+        // winrates they give at the komi of the position.
+        const auto bonus = to_move == FastBoard::BLACK ? -komi : komi;
+        diff_winrate = sigmoid(data.alpha, data.beta, bonus).first
+            - sigmoid(ref.alpha, ref.beta, bonus).first;
+    }
     error += diff_pass * diff_pass;
     error += diff_winrate * diff_winrate;
 
     error = std::sqrt(error);
 
     if (error > max_error || std::isnan(error)) {
+        if (m_forward_int8 != nullptr) {
+            myprintf("Error in int8 calculation: this network loses too much "
+                     "precision, switching to single precision.\n");
+            throw std::runtime_error("Int8 self-check mismatch.");
+        }
         printf("Error in OpenCL calculation: Update your device's OpenCL drivers "
                "or reduce the amount of games played simultaneously.\n");
         throw std::runtime_error("OpenCL self-check mismatch.");
     }
+    return error;
 }
-#endif
 
-std::vector<float> softmax(const std::vector<float>& input,
-                           const float temperature = 1.0f) {
-    auto output = std::vector<float>{};
-    output.reserve(input.size());
+void softmax(const std::vector<float>& input,
+             std::vector<float>& output,
+             const float temperature = 1.0f) {
+    output.resize(input.size());
 
     const auto alpha = *std::max_element(cbegin(input), cend(input));
     auto denom = 0.0f;
 
-    for (const auto in_val : input) {
-        auto val = std::exp((in_val - alpha) / temperature);
+    for (auto i = size_t{0}; i < input.size(); i++) {
+        auto val = std::exp((input[i] - alpha) / temperature);
         denom += val;
-        output.push_back(val);
+        output[i] = val;
     }
 
     for (auto& out : output) {
         out /= denom;
     }
+}
+
+namespace {
+
+// Buffers of a thread for the evaluations of the network, kept from one
+// evaluation to the next. Once they have grown to the size of the
+// network, evaluating a position allocates nothing here.
+struct Workspace {
+    std::vector<float> policy_data;
+    std::vector<float> val_data;
+    std::vector<float> vbe_data;
+    std::vector<float> kp1;
+    std::vector<float> kp2;
+    std::vector<float> policy_out;
+    std::vector<float> policy;
+    std::vector<float> val_channels;
+    std::vector<float> val_output;
+    std::vector<float> vbe_channels;
+    std::vector<float> vbe_output;
+    // A batch of evaluate_queue().
+    std::vector<float> batch_input;
+    std::vector<float> batch_pol;
+    std::vector<float> batch_val;
+    std::vector<float> batch_vbe;
+
+    // forward_batch() finds the sizes of the positions from those of
+    // the buffers, which are set to the batch. They keep their
+    // capacity, only a larger batch than before allocates.
+    void fit(const size_t batch_size, const size_t in_size,
+             const size_t pol_size, const size_t val_size,
+             const size_t vbe_size) {
+        batch_input.resize(batch_size * in_size);
+        batch_pol.resize(batch_size * pol_size);
+        batch_val.resize(batch_size * val_size);
+        batch_vbe.resize(batch_size * vbe_size);
+    }
+};
+
+thread_local Workspace t_workspace;
 
-    return output;
 }
 
 std::pair<float,float> sigmoid(float alpha, float beta, float bonus) {
@@ -981,34 +1184,68 @@ std::pair<float,float> sigmoid(float alpha, float beta, float bonus) {
                : std::make_pair(1.0f-ret, ret);
 }
 
-bool Network::probe_cache(const GameState* const state,
-                          Network::Netresult& result) {
-    if (m_nncache.lookup(state->board.get_hash(), result)) {
-        return true;
+std::pair<std::uint64_t, int> Network::get_cache_key(
+    const GameState* const state) const {
+    // If we are not generating a self-play game, let all the
+    // symmetries of a position share one entry, stored in the
+    // orientation with the smallest hash. Self-play keeps them
+    // apart, so that each one gets its own random symmetry.
+    // The two kinds of keys agree when the position itself has the
+    // smallest hash, and never meet otherwise.
+    auto key = std::pair<std::uint64_t, int>{state->board.get_hash(),
+                                             IDENTITY_SYMMETRY};
+    if (!cfg_noise && !cfg_random_cnt) {
+        key = state->board.get_canonical_hash();
     }
-    // If we are not generating a self-play game, try to find
-    // symmetries if we are in the early opening.
-    if (!cfg_noise && !cfg_random_cnt
-        && state->get_movenum()
-           < (state->get_timecontrol().opening_moves(BOARD_SIZE) / 2)) {
-        for (auto sym = 0; sym < Network::NUM_SYMMETRIES; ++sym) {
-            if (sym == Network::IDENTITY_SYMMETRY) {
-                continue;
-            }
-            const auto hash = state->get_symmetry_hash(sym);
-            if (m_nncache.lookup(hash, result)) {
-                decltype(result.policy) corrected_policy;
-                for (auto idx = size_t{0}; idx < NUM_INTERSECTIONS; ++idx) {
-                    const auto sym_idx = symmetry_nn_idx_table[sym][idx];
-                    corrected_policy[idx] = result.policy[sym_idx];
-                }
-                result.policy = std::move(corrected_policy);
-                return true;
-            }
+    // The outputs of networks with komi policy layers depend on the
+    // komi the side to move sees, and the file and shared caches keep
+    // entries of games played at other komis.
+    if (m_komi_policy) {
+        const auto komi = state->get_to_move() == FastBoard::BLACK ?
+                          -state->get_komi() : state->get_komi();
+        std::uint32_t bits;
+        std::memcpy(&bits, &komi, sizeof(bits));
+        // -0.0f is 0.0f, on the bits as -ffast-math ignores the sign of 0.
+        if (bits << 1 == 0) {
+            bits = 0;
         }
+        key.first ^= bits * 0x9E3779B97F4A7C15ULL;
     }
+    return key;
+}
 
-    return false;
+void Network::to_cache_orientation(Netresult& result, const int symmetry) const {
+    auto oriented_policy = decltype(result.policy){};
+    for (auto idx = size_t{0}; idx < NUM_INTERSECTIONS; ++idx) {
+        oriented_policy[symmetry_nn_idx_table[symmetry][idx]] =
+            result.policy[idx];
+    }
+    result.policy = oriented_policy;
+}
+
+void Network::from_cache_orientation(Netresult& result, const int symmetry) const {
+    auto oriented_policy = decltype(result.policy){};
+    for (auto idx = size_t{0}; idx < NUM_INTERSECTIONS; ++idx) {
+        oriented_policy[idx] =
+            result.policy[symmetry_nn_idx_table[symmetry][idx]];
+    }
+    result.policy = oriented_policy;
+}
+
+bool Network::probe_cache(const GameState* const state,
+                          Network::Netresult& result) {
+    const auto key = get_cache_key(state);
+    const auto movenum = state->get_movenum();
+    auto found = get_nncache().lookup(key.first, result, movenum);
+    if (!found && use_file_cache(state)
+        && m_file_cache->lookup(key.first, result, movenum)) {
+        get_nncache().insert(key.first, result);
+        found = true;
+    }
+    if (found && key.second != IDENTITY_SYMMETRY) {
+        from_cache_orientation(result, key.second);
+    }
+    return found;
 }
 
 Network::Netresult Network::get_output(const GameState* const state,
@@ -1053,20 +1290,19 @@ Network::Netresult Network::get_output(const GameState* const state,
         assert(symmetry == -1);
         const auto rand_sym = Random::get_Rng().randfix<NUM_SYMMETRIES>();
         result = get_output_internal(state, rand_sym);
-#ifdef USE_OPENCL_SELFCHECK
-        // Both implementations are available, self-check the OpenCL driver by
-        // running both with a probability of 1/2000.
+        // Both implementations are available, self-check the OpenCL driver
+        // or the int8 pipe by running both with a probability of 1/2000.
         // selfcheck is done here because this is the only place NN
         // evaluation is done on actual gameplay.
         if (m_forward_cpu != nullptr
             && (force_selfcheck || Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0)
         ) {
             auto result_ref = get_output_internal(state, rand_sym, true);
-            compare_net_outputs(result, result_ref);
+            if (!selfcheck(result, result_ref, state->get_komi(),
+                           state->get_to_move())) {
+                result = result_ref;
+            }
         }
-#else
-        (void)force_selfcheck;
-#endif
     }
 
     // v2 format (ELF Open Go) returns black value, not stm
@@ -1082,12 +1318,123 @@ Network::Netresult Network::get_output(const GameState* const state,
         // updated with the average result, unless of course it
         // already contained that board state. Don't know if this is
         // wanted.
-        m_nncache.insert(state->board.get_hash(), result);
+        Network::write_cache(get_cache_key(state), result,
+                             use_file_cache(state));
     }
 
     return result;
 }
 
+void Network::write_cache(const std::pair<std::uint64_t, int>& key,
+                          const Netresult& result, const bool file_cache) {
+    auto oriented = result;
+    if (key.second != IDENTITY_SYMMETRY) {
+        to_cache_orientation(oriented, key.second);
+    }
+    get_nncache().insert(key.first, oriented);
+    if (file_cache) {
+        m_file_cache->insert(key.first, oriented);
+    }
+}
+
+bool Network::queue_eval(const GameState* const state,
+                         std::vector<QueuedEval>& queue) {
+    if (state->board.get_boardsize() != BOARD_SIZE) {
+        return false;
+    }
+    const auto key = get_cache_key(state);
+    for (const auto& queued : queue) {
+        if (queued.key.first == key.first) {
+            return false;
+        }
+    }
+    Netresult result;
+    if (probe_cache(state, result)) {
+        return false;
+    }
+
+    const auto include_color = (0 == m_input_planes % 2);
+    const auto symmetry =
+        static_cast<int>(Random::get_Rng().randfix<NUM_SYMMETRIES>());
+    queue.push_back({gather_features(state, symmetry, m_input_moves,
+                                     m_adv_features, m_chainlibs_features,
+                                     m_chainsize_features, include_color),
+                     key, symmetry, state->get_komi(), state->get_to_move(),
+                     use_file_cache(state)});
+    return true;
+}
+
+void Network::evaluate_queue(std::vector<QueuedEval>& queue) {
+    if (queue.empty()) {
+        return;
+    }
+    const auto batch_size = queue.size();
+    const auto in_size = queue.front().input.size();
+    const auto pol_size = m_policy_outputs * NUM_INTERSECTIONS;
+    const auto val_size = m_val_outputs * NUM_INTERSECTIONS;
+    const auto vbe_size = m_vbe_outputs * NUM_INTERSECTIONS;
+
+    auto& ws = t_workspace;
+    ws.fit(batch_size, in_size, pol_size, val_size, vbe_size);
+    auto& input_data = ws.batch_input;
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        std::copy(begin(queue[b].input), end(queue[b].input),
+                  begin(input_data) + b * in_size);
+    }
+    auto& batch_pol = ws.batch_pol;
+    auto& batch_val = ws.batch_val;
+    auto& batch_vbe = ws.batch_vbe;
+    m_forward->forward_batch(batch_size, input_data,
+                             batch_pol, batch_val, batch_vbe);
+
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        const auto& queued = queue[b];
+        ws.policy_data.assign(
+            begin(batch_pol) + b * pol_size, begin(batch_pol) + (b + 1) * pol_size);
+        ws.val_data.assign(
+            begin(batch_val) + b * val_size, begin(batch_val) + (b + 1) * val_size);
+        ws.vbe_data.assign(
+            begin(batch_vbe) + b * vbe_size, begin(batch_vbe) + (b + 1) * vbe_size);
+        auto result = get_output_heads(ws.policy_data, ws.val_data, ws.vbe_data,
+                                       queued.symmetry, queued.komi,
+                                       queued.to_move);
+        // Self-check as get_output() does, one position at a time.
+        if (m_forward_cpu != nullptr
+            && Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0) {
+            m_forward_cpu->forward(queued.input, ws.policy_data,
+                                   ws.val_data, ws.vbe_data);
+            const auto result_ref =
+                get_output_heads(ws.policy_data, ws.val_data, ws.vbe_data,
+                                 queued.symmetry, queued.komi,
+                                 queued.to_move);
+            if (!selfcheck(result, result_ref, queued.komi,
+                           queued.to_move)) {
+                result = result_ref;
+            }
+        }
+        // See get_output().
+        if (m_value_head_not_stm && queued.to_move == FastBoard::WHITE) {
+            result.value = 1.0f - result.value;
+        }
+        write_cache(queued.key, result, queued.file_cache);
+    }
+    queue.clear();
+}
+
+NNCache& Network::get_nncache() {
+    // The private cache stays allocated but untouched
+    // when the shared one is in use.
+    return m_shared_cache ? *m_shared_cache : m_nncache;
+}
+
+bool Network::use_file_cache(const GameState* const state) const {
+    // The file is bounded and shared between games, keep it for
+    // the positions that are likely to be seen again.
+    return m_file_cache
+        && state->get_movenum()
+           < state->get_timecontrol().opening_moves(BOARD_SIZE);
+}
+
 Network::Netresult Network::get_output_internal(
     const GameState* const state, const int symmetry, bool selfcheck) {
     assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
@@ -1102,51 +1449,63 @@ Network::Netresult Network::get_output_internal(
     const auto input_data = gather_features(state, symmetry, m_input_moves,
                                             m_adv_features, m_chainlibs_features,
                                             m_chainsize_features, include_color);
-    std::vector<float> policy_data(m_policy_outputs * width * height);
-    std::vector<float> val_data(m_val_outputs * width * height);
-    std::vector<float> vbe_data(m_vbe_outputs * width * height);
-#ifdef USE_OPENCL_SELFCHECK
+    auto& ws = t_workspace;
+    auto& policy_data = ws.policy_data;
+    auto& val_data = ws.val_data;
+    auto& vbe_data = ws.vbe_data;
+    policy_data.resize(m_policy_outputs * width * height);
+    val_data.resize(m_val_outputs * width * height);
+    vbe_data.resize(m_vbe_outputs * width * height);
     if (selfcheck) {
         m_forward_cpu->forward(input_data, policy_data, val_data, vbe_data);
     } else {
         m_forward->forward(input_data, policy_data, val_data, vbe_data);
     }
-#else
-    m_forward->forward(input_data, policy_data, val_data, vbe_data);
-    (void) selfcheck;
-#endif
+
+    return get_output_heads(policy_data, val_data, vbe_data, symmetry,
+                            state->get_komi(), state->get_to_move());
+}
+
+Network::Netresult Network::get_output_heads(std::vector<float>& policy_data,
+                                             std::vector<float>& val_data,
+                                             std::vector<float>& vbe_data,
+                                             const int symmetry,
+                                             const float komi,
+                                             const int to_move) {
+    auto& ws = t_workspace;
 
     // Get the moves
     batchnorm<NUM_INTERSECTIONS>(m_policy_outputs, policy_data,
         m_bn_pol_w1.data(), m_bn_pol_w2.data());
 
     if (m_komi_policy) {
-        float komi = state->get_komi();
-        komi *= ( state->get_to_move() == FastBoard::BLACK ? -1.0 : 1.0 );
-        policy_data.push_back(komi);
-        const auto kp1 =
-            innerproduct<true>(policy_data, m_kp1_pol_w, m_kp1_pol_b);
-        const auto kp2 =
-            innerproduct<true>(kp1, m_kp2_pol_w, m_kp2_pol_b);
+        auto& kp1 = ws.kp1;
+        auto& kp2 = ws.kp2;
+        policy_data.push_back(to_move == FastBoard::BLACK ? -komi : komi);
+        innerproduct<true>(policy_data, m_kp1_pol_w, m_kp1_pol_b, kp1);
+        innerproduct<true>(kp1, m_kp2_pol_w, m_kp2_pol_b, kp2);
         policy_data.pop_back();
         for (auto & i : kp2) {
             policy_data.push_back(i);
         }
     }
 
-    const auto policy_out =
-        innerproduct<false>(
-            policy_data, m_ip_pol_w, m_ip_pol_b);
-    const auto outputs = softmax(policy_out, cfg_softmax_temp);
+    auto& policy_out = ws.policy_out;
+    innerproduct<false>(
+        policy_data, m_ip_pol_w, m_ip_pol_b, policy_out);
+    auto& outputs = ws.policy;
+    softmax(policy_out, outputs, cfg_softmax_temp);
 
     // Now get the value
     batchnorm<NUM_INTERSECTIONS>(m_val_outputs, val_data,
         m_bn_val_w1.data(), m_bn_val_w2.data());
-    const auto val_channels =
-        innerproduct<true>(
-            val_data, m_ip1_val_w, m_ip1_val_b);
-    const auto val_output =
-        innerproduct<false>(val_channels, m_ip2_val_w, m_ip2_val_b);
+    auto& val_channels = ws.val_channels;
+    innerproduct<true>(
+        val_data, m_ip1_val_w, m_ip1_val_b, val_channels);
+    auto& val_output = ws.val_output;
+    innerproduct<false>(val_channels, m_ip2_val_w, m_ip2_val_b, val_output);
+    auto& vbe_channels = ws.vbe_channels;
+    auto& vbe_output = ws.vbe_output;
 
     Netresult result;
     // ln(x) = log2(x) * ln(2)
@@ -1156,28 +1515,23 @@ Network::Netresult Network::get_output_internal(
         // If double head value, also get beta
         batchnorm<NUM_INTERSECTIONS>(m_vbe_outputs, vbe_data,
                     m_bn_vbe_w1.data(), m_bn_vbe_w2.data());
-        const auto vbe_channels =
-            innerproduct<true>(vbe_data, m_ip1_vbe_w, m_ip1_vbe_b);
-        const auto vbe_output =
-            innerproduct<false>(vbe_channels, m_ip2_vbe_w, m_ip2_vbe_b);
+        innerproduct<true>(vbe_data, m_ip1_vbe_w, m_ip1_vbe_b, vbe_channels);
+        innerproduct<false>(vbe_channels, m_ip2_vbe_w, m_ip2_vbe_b, vbe_output);
 
         result.value = 0.5f;
         result.alpha = val_output[0];
         result.beta = std::exp(vbe_output[0] + beta_nat_tune) * 10.0f / NUM_INTERSECTIONS;
         result.is_sai = true;
     } else if (m_value_head_type==DOUBLE_Y) {
-        const auto vbe_channels =
-            innerproduct<true>(val_data, m_ip1_vbe_w, m_ip1_vbe_b);
-        const auto vbe_output =
-            innerproduct<false>(vbe_channels, m_ip2_vbe_w, m_ip2_vbe_b);
+        innerproduct<true>(val_data, m_ip1_vbe_w, m_ip1_vbe_b, vbe_channels);
+        innerproduct<false>(vbe_channels, m_ip2_vbe_w, m_ip2_vbe_b, vbe_output);
 
         result.value = 0.5f;
         result.alpha = val_output[0];
         result.beta = std::exp(vbe_output[0] + beta_nat_tune) * 10.0f / NUM_INTERSECTIONS;
         result.is_sai = true;
     } else if (m_value_head_type==DOUBLE_T) {
-        const auto vbe_output =
-            innerproduct<false>(val_channels, m_ip2_vbe_w, m_ip2_vbe_b);
+        innerproduct<false>(val_channels, m_ip2_vbe_w, m_ip2_vbe_b, vbe_output);
         result.value = 0.5f;
         result.alpha = val_output[0];
         result.beta = std::exp(vbe_output[0] + beta_nat_tune) * 10.0f / NUM_INTERSECTIONS;
@@ -1212,6 +1566,12 @@ Network::Netresult_extended Network::get_extended(const FastState& state, const
     const auto winrate = sigmoid(alpha,  beta, state.board.black_to_move() ? -komi : komi);
     const auto alpkt = (state.board.black_to_move() ? alpha : -alpha) - komi;
 
+    auto result_extended = get_extended(alpkt, beta);
+    result_extended.winrate = winrate.first;
+    return result_extended;
+}
+
+Network::Netresult_extended Network::get_extended(const float alpkt, const float beta) {
     const auto pi = sigmoid(alpkt, beta, 0.0f);
     // if pi is near to 1, this is much more precise than 1-pi
     //    const auto one_m_pi = sigmoid(-alpkt, beta, 0.0f);
@@ -1232,7 +1592,7 @@ Network::Netresult_extended Network::get_extended(const FastState& state, const
 
     const auto agent_eval = Utils::sigmoid_interval_avg(alpkt, beta, eval_base, eval_bonus);
 
-    return { winrate.first, alpkt, pi.first, eval_bonus, eval_base, agent_eval };
+    return { 0.5f, alpkt, pi.first, eval_bonus, eval_base, agent_eval };
 }
 
 
@@ -1336,7 +1696,7 @@ void Network::fill_input_plane_pair(const FullBoard& board,
     }
 }
 
-void Network::fill_input_plane_advfeat(std::shared_ptr<const KoState> const state,
+void Network::fill_input_plane_advfeat(const FastState& state,
                                        std::vector<float>::iterator legal,
                                        std::vector<float>::iterator atari,
                                        const int symmetry) {
@@ -1344,24 +1704,24 @@ void Network::fill_input_plane_advfeat(std::shared_ptr<const KoState> const stat
         const auto sym_idx = symmetry_nn_idx_table[symmetry][idx];
         const auto x = sym_idx % BOARD_SIZE;
         const auto y = sym_idx / BOARD_SIZE;
-        const auto vertex = state->board.get_vertex(x,y);
-        const auto tomove = state->get_to_move();
-        const auto is_legal = state->is_move_legal(tomove, vertex);
+        const auto vertex = state.board.get_vertex(x,y);
+        const auto tomove = state.get_to_move();
+        const auto is_legal = state.is_move_legal(tomove, vertex);
         legal[idx] = !is_legal;
-        atari[idx] = is_legal && (1 == state->board.liberties_to_capture(vertex));
+        atari[idx] = is_legal && (1 == state.board.liberties_to_capture(vertex));
     }
 }
 
-void Network::fill_input_plane_chainlibsfeat(std::shared_ptr<const KoState> const state,
+void Network::fill_input_plane_chainlibsfeat(const FastState& state,
                                              std::vector<float>::iterator chainlibs,
                                              const int symmetry) {
     for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
         const auto sym_idx = symmetry_nn_idx_table[symmetry][idx];
         const auto x = sym_idx % BOARD_SIZE;
         const auto y = sym_idx / BOARD_SIZE;
-        const auto peek = state->board.get_state(x,y);
+        const auto peek = state.board.get_state(x,y);
         const auto is_stone = (peek == FastBoard::BLACK || peek == FastBoard::WHITE);
-        const auto vtx = state->board.get_vertex(x,y);
+        const auto vtx = state.board.get_vertex(x,y);
         // if there is no stone, then put 0 in all planes
         // if there is a stone, then put 1 if its chain has only 1 liberty,
         //                               1 if its chain has <= 2 liberies,
@@ -1369,21 +1729,21 @@ void Network::fill_input_plane_chainlibsfeat(std::shared_ptr<const KoState> cons
         //                               1 if its chain has <= 4 liberies
         for (auto plane = size_t{0} ; plane < CHAIN_LIBERTIES_PLANES ; plane++) {
             chainlibs[idx + plane * NUM_INTERSECTIONS] = is_stone &&
-                (state->board.chain_liberties(vtx) <= plane + 1);
+                (state.board.chain_liberties(vtx) <= plane + 1);
         }
     }
 }
 
-void Network::fill_input_plane_chainsizefeat(std::shared_ptr<const KoState> const state,
+void Network::fill_input_plane_chainsizefeat(const FastState& state,
                                              std::vector<float>::iterator chainsize,
                                              const int symmetry) {
     for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
         const auto sym_idx = symmetry_nn_idx_table[symmetry][idx];
         const auto x = sym_idx % BOARD_SIZE;
         const auto y = sym_idx / BOARD_SIZE;
-        const auto peek = state->board.get_state(x,y);
+        const auto peek = state.board.get_state(x,y);
         const auto is_stone = (peek == FastBoard::BLACK || peek == FastBoard::WHITE);
-        const auto vtx = state->board.get_vertex(x,y);
+        const auto vtx = state.board.get_vertex(x,y);
         // if there is no stone, then put 0 in all planes
         // if there is a stone, then put 1 if its chain has >= 2 stones,
         //                               1 if its chain has >= 4 stones,
@@ -1391,7 +1751,7 @@ void Network::fill_input_plane_chainsizefeat(std::shared_ptr<const KoState> cons
         //                               1 if its chain has >= 8 stones
         for (auto plane = size_t{0} ; plane < CHAIN_SIZE_PLANES ; plane++) {
             chainsize[idx + plane * NUM_INTERSECTIONS] = is_stone &&
-                (state->board.chain_stones(vtx) >= 2 * plane + 2);
+                (state.board.chain_stones(vtx) >= 2 * plane + 2);
         }
     }
 }
@@ -1461,23 +1821,23 @@ std::vector<float> Network::gather_features(const GameState* const state,
     // Go back in time, fill history boards
     for (auto h = size_t{0}; h < moves; h++) {
         // collect white, black occupation planes
-        fill_input_plane_pair(state->get_past_state(h)->board,
+        fill_input_plane_pair(state->get_past_position(h).board,
                               black_it + h * NUM_INTERSECTIONS,
                               white_it + h * NUM_INTERSECTIONS,
                               symmetry);
         if (adv_features) {
-            fill_input_plane_advfeat(state->get_past_state(h),
+            fill_input_plane_advfeat(state->get_past_position(h),
                                      legal_it + h * NUM_INTERSECTIONS,
                                      atari_it + h * NUM_INTERSECTIONS,
                                      symmetry);
         }
         if (chainlibs_features) {
-            fill_input_plane_chainlibsfeat(state->get_past_state(h),
+            fill_input_plane_chainlibsfeat(state->get_past_position(h),
                                            chainlibs_it + h * NUM_INTERSECTIONS,
                                            symmetry);
         }
         if (chainsize_features) {
-            fill_input_plane_chainsizefeat(state->get_past_state(h),
+            fill_input_plane_chainsizefeat(state->get_past_position(h),
                                            chainsize_it + h * NUM_INTERSECTIONS,
                                            symmetry);
         }
@@ -1558,13 +1918,28 @@ size_t Network::get_estimated_size() {
 }
 
 size_t Network::get_estimated_cache_size() {
-    return m_nncache.get_estimated_size();
+    auto size = m_nncache.get_estimated_size();
+    if (m_shared_cache) {
+        size += m_shared_cache->get_estimated_size();
+    }
+    if (m_file_cache) {
+        size += m_file_cache->get_estimated_size();
+    }
+    return size;
 }
 
 void Network::nncache_resize(int max_count) {
     return m_nncache.resize(max_count);
 }
 
+std::string Network::get_nncache_stats() {
+    auto stats = get_nncache().get_stats();
+    if (m_file_cache) {
+        stats += "Cache file:\n" + m_file_cache->get_stats();
+    }
+    return stats;
+}
+
 void Network::nncache_clear() {
     m_nncache.clear();
 }
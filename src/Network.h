@@ -64,6 +64,8 @@ constexpr auto WINOGRAD_TILE = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
 constexpr auto WINOGRAD_P = WINOGRAD_WTILES * WINOGRAD_WTILES;
 constexpr auto SQ2 = 1.4142135623730951f; // Square root of 2
 
+class CPUPipeInt8;
+
 std::pair<float, float> sigmoid(float alpha, float beta, float bonus);
 
 extern std::array<std::array<int, NUM_INTERSECTIONS>, 8>
@@ -73,6 +75,7 @@ extern std::array<std::array<int, NUM_INTERSECTIONS>, 8>
 class NetworkHaltException : public std::exception {};
 
 class Network {
+    friend class LeelaTest;
     using ForwardPipeWeights = ForwardPipe::ForwardPipeWeights;
 
   public:
@@ -104,6 +107,25 @@ class Network {
                          const bool write_cache = true,
                          const bool force_selfcheck = false);
 
+    // A position waiting to be evaluated with others, see queue_eval().
+    struct QueuedEval {
+        std::vector<float> input;
+        std::pair<std::uint64_t, int> key;
+        int symmetry;
+        float komi;
+        int to_move;
+        bool file_cache;
+    };
+
+    // Queue the evaluation of state, unless it is already in the cache
+    // or in the queue. Returns true if it was queued.
+    bool queue_eval(const GameState *const state,
+                    std::vector<QueuedEval> &queue);
+
+    // Evaluate the queued positions in one batch and insert the results
+    // in the cache, where get_output() finds them. Clears the queue.
+    void evaluate_queue(std::vector<QueuedEval> &queue);
+
     static constexpr unsigned short int SINGLE = 1;
     static constexpr unsigned short int DOUBLE_V = 2;
     static constexpr unsigned short int DOUBLE_Y = 3;
@@ -125,6 +147,9 @@ class Network {
     static void show_heatmap(const FastState *const state,
                              const Netresult &netres, const bool topmoves);
     static Netresult_extended get_extended(const FastState &, const Netresult &result);
+    // The same from alpkt, which is all that depends on the komi,
+    // except for the winrate, which is left at 0.5.
+    static Netresult_extended get_extended(const float alpkt, const float beta);
     static std::vector<float> gather_features(const GameState *const state,
                                               const int symmetry,
                                               const int input_moves = DEFAULT_INPUT_MOVES,
@@ -140,6 +165,7 @@ class Network {
     size_t get_estimated_cache_size();
     void nncache_resize(int max_count);
     void nncache_clear();
+    std::string get_nncache_stats();
 
     int m_value_head_type = SINGLE;
     bool m_value_head_sai; // was is_multi_komi_net
@@ -194,35 +220,73 @@ class Network {
                                std::vector<float> &M, const int C, const int K);
     Netresult get_output_internal(const GameState *const state,
                                   const int symmetry, bool selfcheck = false);
+    Netresult get_output_heads(std::vector<float> &policy_data,
+                               std::vector<float> &val_data,
+                               std::vector<float> &vbe_data,
+                               const int symmetry,
+                               const float komi, const int to_move);
     static void fill_input_plane_pair(const FullBoard &board,
                                       std::vector<float>::iterator black,
                                       std::vector<float>::iterator white,
                                       const int symmetry);
-    static void fill_input_plane_advfeat(std::shared_ptr<const KoState> const state,
+    static void fill_input_plane_advfeat(const FastState& state,
                                          std::vector<float>::iterator legal,
                                          std::vector<float>::iterator atari,
                                          const int symmetry);
-    static void fill_input_plane_chainlibsfeat(std::shared_ptr<const KoState> const state,
+    static void fill_input_plane_chainlibsfeat(const FastState& state,
                                                std::vector<float>::iterator chainlibs,
                                                const int symmetry);
-    static void fill_input_plane_chainsizefeat(std::shared_ptr<const KoState> const state,
+    static void fill_input_plane_chainsizefeat(const FastState& state,
                                                std::vector<float>::iterator chainsize,
                                                const int symmetry);
 
+    std::pair<std::uint64_t, int> get_cache_key(const GameState *const state) const;
+    void to_cache_orientation(Netresult &result, const int symmetry) const;
+    void from_cache_orientation(Netresult &result, const int symmetry) const;
     bool probe_cache(const GameState *const state, Network::Netresult &result);
+    void write_cache(const std::pair<std::uint64_t, int> &key,
+                     const Netresult &result, const bool file_cache);
+    bool use_file_cache(const GameState *const state) const;
+    NNCache& get_nncache();
     std::unique_ptr<ForwardPipe> &&init_net(int channels,
                                             std::unique_ptr<ForwardPipe> &&pipe);
 #ifdef USE_HALF
     void select_precision(int channels);
 #endif
     std::unique_ptr<ForwardPipe> m_forward;
-#ifdef USE_OPENCL_SELFCHECK
-    void compare_net_outputs(const Netresult &data, const Netresult &ref);
+    // The reference m_forward is checked against, if any.
     std::unique_ptr<ForwardPipe> m_forward_cpu;
-#endif
+    // The int8 pipe inside m_forward, if any.
+    CPUPipeInt8* m_forward_int8{nullptr};
+    // Returns the error, throws if it is too large. The winrates of
+    // SAI networks are compared at komi, for to_move.
+    float compare_net_outputs(const Netresult &data, const Netresult &ref,
+                              float komi, int to_move);
+    // Checks data against ref during the search. Throws if the OpenCL
+    // pipe is off. Returns false if the int8 pipe is, having switched
+    // it to floats: ref is to be used instead of data.
+    bool selfcheck(const Netresult &data, const Netresult &ref,
+                   float komi, int to_move);
+    // Positions of random games, always the same for a seed. The int8
+    // pipe is calibrated on those of CALIBRATION_SEED and checked on
+    // those of SELFCHECK_SEED, which it hasn't seen.
+    static constexpr std::uint64_t CALIBRATION_SEED = 0x5a15eed;
+    static constexpr std::uint64_t SELFCHECK_SEED = 0x5a1c4ec;
+    std::vector<GameState> get_random_positions(std::uint64_t seed) const;
+    void init_cpu_net(int channels);
 
     NNCache m_nncache;
 
+    // Optional cache shared with other processes on the host,
+    // used instead of m_nncache when available.
+    std::unique_ptr<NNCache> m_shared_cache;
+
+    // Optional cache of opening positions kept in a file.
+    std::unique_ptr<NNCache> m_file_cache;
+    // SHA256 of the weights, only computed if needed by m_file_cache
+    // or m_shared_cache.
+    std::string m_weights_hash;
+
     size_t estimated_size{0};
 
     // Residual tower
@@ -0,0 +1,218 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2018-2019 Gian-Carlo Pascutto
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+#include "NodePool.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "SMP.h"
+
+namespace {
+
+// Block sizes are multiples of this.
+constexpr size_t GRANULARITY = 16;
+constexpr size_t NUM_CLASSES = NodePool::MAX_BYTES / GRANULARITY;
+
+// Memory moved at once between a thread and the depot.
+constexpr size_t BATCH_BYTES = 32 * 1024;
+// Memory requested from the system at once.
+constexpr size_t SLAB_BYTES = 1024 * 1024;
+
+// A free block, linked to the next one.
+struct Block {
+    Block* next;
+};
+
+size_t get_class(size_t bytes) {
+    return (std::max(bytes, size_t{1}) - 1) / GRANULARITY;
+}
+
+size_t get_block_size(size_t size_class) {
+    return (size_class + 1) * GRANULARITY;
+}
+
+size_t get_batch_count(size_t size_class) {
+    return std::max(BATCH_BYTES / get_block_size(size_class), size_t{16});
+}
+
+// Batches of free blocks shared by the threads running on a NUMA node,
+// and the slabs the new blocks are carved from.
+class Depot {
+public:
+    // Takes a list of blocks, and its length, if there is one.
+    bool take_batch(size_t size_class, std::pair<Block*, size_t>& batch) {
+        auto& part = m_parts[size_class];
+        std::lock_guard<std::mutex> lock(part.mutex);
+        if (part.batches.empty()) {
+            return false;
+        }
+        batch = part.batches.back();
+        part.batches.pop_back();
+        return true;
+    }
+
+    // Returns a list of new blocks, and its length. The calling thread
+    // is the first to touch them, the system places them on its node.
+    std::pair<Block*, size_t> carve_batch(size_t size_class) {
+        auto& part = m_parts[size_class];
+        std::lock_guard<std::mutex> lock(part.mutex);
+        const auto block_size = get_block_size(size_class);
+        const auto count = get_batch_count(size_class);
+        if (part.slab_left < count * block_size) {
+            part.slab_left = std::max(SLAB_BYTES, count * block_size);
+            part.slab = static_cast<char*>(::operator new(part.slab_left));
+        }
+        auto head = static_cast<Block*>(nullptr);
+        for (auto i = size_t{0}; i < count; i++) {
+            auto block = reinterpret_cast<Block*>(part.slab);
+            block->next = head;
+            head = block;
+            part.slab += block_size;
+        }
+        part.slab_left -= count * block_size;
+        return {head, count};
+    }
+
+    void put_batch(size_t size_class, Block* head, size_t count) {
+        auto& part = m_parts[size_class];
+        std::lock_guard<std::mutex> lock(part.mutex);
+        part.batches.emplace_back(head, count);
+    }
+
+private:
+    struct Part {
+        std::mutex mutex;
+        std::vector<std::pair<Block*, size_t>> batches;
+        char* slab{nullptr};
+        size_t slab_left{0};
+    };
+    std::array<Part, NUM_CLASSES> m_parts;
+};
+
+// One per NUMA node. Never destroyed, so that they outlive the caches of
+// the threads which are still running at exit.
+size_t get_num_depots() {
+    static const auto count = std::max(SMP::get_num_nodes(), size_t{1});
+    return count;
+}
+
+Depot& get_depot(size_t node) {
+    static auto depots = new Depot[get_num_depots()];
+    return depots[std::min(node, get_num_depots() - 1)];
+}
+
+Depot& get_depot() {
+    return get_depot(SMP::get_current_node());
+}
+
+// Blocks from the depot of the node of the calling thread, else from
+// the others before asking the system for more memory. Freed blocks go
+// to the depot of the node of the thread which frees them.
+std::pair<Block*, size_t> get_batch(size_t size_class) {
+    const auto node = SMP::get_current_node();
+    auto batch = std::pair<Block*, size_t>{};
+    for (auto i = size_t{0}; i < get_num_depots(); i++) {
+        if (get_depot((node + i) % get_num_depots()).take_batch(size_class, batch)) {
+            return batch;
+        }
+    }
+    return get_depot(node).carve_batch(size_class);
+}
+
+// Free blocks owned by a thread.
+struct ThreadCache {
+    std::array<Block*, NUM_CLASSES> heads{};
+    std::array<size_t, NUM_CLASSES> counts{};
+
+    ~ThreadCache() {
+        for (auto c = size_t{0}; c < NUM_CLASSES; c++) {
+            if (counts[c]) {
+                get_depot().put_batch(c, heads[c], counts[c]);
+            }
+        }
+    }
+
+    // Moves count blocks from the list of class c to the depot.
+    void flush(size_t c, size_t count) {
+        assert(count <= counts[c]);
+        auto head = heads[c];
+        auto tail = head;
+        for (auto i = size_t{1}; i < count; i++) {
+            tail = tail->next;
+        }
+        heads[c] = tail->next;
+        tail->next = nullptr;
+        counts[c] -= count;
+        get_depot().put_batch(c, head, count);
+    }
+};
+
+thread_local ThreadCache s_cache;
+
+}
+
+void* NodePool::allocate(size_t bytes) {
+    if (bytes > MAX_BYTES) {
+        return ::operator new(bytes);
+    }
+    const auto c = get_class(bytes);
+    auto& cache = s_cache;
+    if (!cache.heads[c]) {
+        std::tie(cache.heads[c], cache.counts[c]) = get_batch(c);
+    }
+    auto block = cache.heads[c];
+    cache.heads[c] = block->next;
+    cache.counts[c]--;
+    return block;
+}
+
+void NodePool::deallocate(void* p, size_t bytes) {
+    if (bytes > MAX_BYTES) {
+        ::operator delete(p);
+        return;
+    }
+    const auto c = get_class(bytes);
+    auto& cache = s_cache;
+    auto block = static_cast<Block*>(p);
+    block->next = cache.heads[c];
+    cache.heads[c] = block;
+    // Threads which only release, like the ones deleting old trees,
+    // hand the blocks over to the others.
+    if (++cache.counts[c] >= 2 * get_batch_count(c)) {
+        cache.flush(c, get_batch_count(c));
+    }
+}
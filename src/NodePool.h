@@ -0,0 +1,80 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2018-2019 Gian-Carlo Pascutto
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef NODEPOOL_H_INCLUDED
+#define NODEPOOL_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+
+// Allocator for the search tree: nodes and children arrays.
+// Memory is carved out of large slabs and recycled through free lists,
+// kept per size class and per thread, so that creating and releasing
+// nodes neither calls malloc nor takes a lock, except when a thread's
+// lists run empty or grow too long and exchange a batch of blocks with
+// a shared depot. Slabs are never returned to the system, the memory of
+// released subtrees is reused by the next ones.
+class NodePool {
+public:
+    // Requests larger than this go to operator new.
+    static constexpr size_t MAX_BYTES = 4096;
+
+    static void* allocate(size_t bytes);
+    static void deallocate(void* p, size_t bytes);
+
+    // For containers.
+    template <typename T>
+    struct Allocator {
+        using value_type = T;
+
+        Allocator() = default;
+        template <typename U>
+        Allocator(const Allocator<U>&) {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(NodePool::allocate(n * sizeof(T)));
+        }
+        void deallocate(T* p, size_t n) {
+            NodePool::deallocate(p, n * sizeof(T));
+        }
+    };
+};
+
+template <typename T, typename U>
+bool operator==(const NodePool::Allocator<T>&, const NodePool::Allocator<U>&) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const NodePool::Allocator<T>&, const NodePool::Allocator<U>&) {
+    return false;
+}
+
+#endif
@@ -37,7 +37,7 @@
 #include <thread>
 
 #include "SMP.h"
-#include "ForwardPipe.h"
+#include "BatchScheduler.h"
 #include "OpenCL.h"
 #include "ThreadPool.h"
 
@@ -50,54 +50,21 @@ extern batch_stats_t batch_stats;
 #endif
 
 template <typename net_t>
-class OpenCLScheduler : public ForwardPipe {
-    class ForwardQueueEntry {
-    public:
-        std::mutex mutex;
-        std::condition_variable cv;
-        const std::vector<float>& in;
-        std::vector<float>& out_p;
-        std::vector<float>& out_va;
-        std::vector<float>& out_vb;
-        ForwardQueueEntry(const std::vector<float>& input,
-                          std::vector<float>& output_pol,
-                          std::vector<float>& output_val,
-                          std::vector<float>& output_vbe)
-        : in(input), out_p(output_pol), out_va(output_val), out_vb(output_vbe)
-          {}
-    };
+class OpenCLScheduler : public BatchScheduler {
 public:
     virtual ~OpenCLScheduler();
     OpenCLScheduler();
 
     virtual void initialize(const int channels);
-    virtual void forward(const std::vector<float>& input,
-                         std::vector<float>& output_pol,
-                         std::vector<float>& output_val,
-                         std::vector<float>& output_vbe);
     virtual bool needs_autodetect();
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights);
 private:
-    bool m_running = true;
-    std::atomic<bool> m_draining{false};
     std::vector<std::unique_ptr<OpenCL_Network<net_t>>> m_networks;
     std::vector<std::unique_ptr<OpenCL<net_t>>> m_opencl;
 
-    std::mutex m_mutex;
-    std::condition_variable m_cv;
-
-    // start with 10 milliseconds : lock protected
-    int m_waittime{10};
-
-    // set to true when single (non-batch) eval is in progress
-    std::atomic<bool> m_single_eval_in_progress{false};
-
-    std::list<std::shared_ptr<ForwardQueueEntry>> m_forward_queue;
-    std::list<std::thread> m_worker_threads;
-
     void batch_worker(const size_t gnum);
     void push_input_convolution(unsigned int filter_size,
                                 unsigned int channels,
@@ -120,9 +87,6 @@ private:
                        unsigned int channels,
                        unsigned int outputs,
                        const std::vector<float>& weights);
-
-    virtual void drain();
-    virtual void resume();
 };
 
 #endif
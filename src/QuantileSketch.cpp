@@ -0,0 +1,117 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2018-2019 Gian-Carlo Pascutto
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+#include "QuantileSketch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+void QuantileSketch::add(const float value, const std::uint32_t weight) {
+    const auto first = m_centroids.begin();
+    const auto last = first + m_size;
+    const auto pos = std::upper_bound(first, last, value,
+        [](const float v, const Centroid& c) { return v < c.mean; });
+    std::move_backward(pos, last, last + 1);
+    *pos = {value, weight};
+    m_size++;
+    m_count += weight;
+
+    if (m_size > CAPACITY) {
+        compress();
+    }
+}
+
+void QuantileSketch::merge(const QuantileSketch& other) {
+    for (auto i = size_t{0}; i < other.m_size; i++) {
+        add(other.m_centroids[i].mean, other.m_centroids[i].weight);
+    }
+}
+
+void QuantileSketch::compress() {
+    // The cost of merging two neighbours is their weight, discounted
+    // the farther they are from the median.
+    const auto total = static_cast<float>(m_count);
+    auto best = size_t{0};
+    auto best_cost = std::numeric_limits<float>::max();
+    auto cumulative = 0.0f;
+    for (auto i = size_t{0}; i + 1 < m_size; i++) {
+        const auto weight = static_cast<float>(m_centroids[i].weight
+                                               + m_centroids[i + 1].weight);
+        const auto q = (cumulative + 0.5f * weight) / total;
+        const auto cost = weight * (0.5f - std::abs(q - 0.5f)
+                                    + 1.0f / CAPACITY);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = i;
+        }
+        cumulative += m_centroids[i].weight;
+    }
+
+    auto& left = m_centroids[best];
+    const auto& right = m_centroids[best + 1];
+    const auto weight = left.weight + right.weight;
+    left.mean = static_cast<float>(
+        (double(left.mean) * left.weight + double(right.mean) * right.weight)
+        / weight);
+    left.weight = weight;
+    std::move(m_centroids.begin() + best + 2, m_centroids.begin() + m_size,
+              m_centroids.begin() + best + 1);
+    m_size--;
+}
+
+float QuantileSketch::quantile(const float q) const {
+    if (m_size == 0) {
+        return 0.0f;
+    }
+    // Each centroid stands at the middle of the values it replaces.
+    const auto target = q * m_count;
+    auto prev_center = 0.5f * m_centroids[0].weight;
+    if (target <= prev_center) {
+        return m_centroids[0].mean;
+    }
+    auto cumulative = static_cast<float>(m_centroids[0].weight);
+    for (auto i = size_t{1}; i < m_size; i++) {
+        const auto center = cumulative + 0.5f * m_centroids[i].weight;
+        if (target <= center) {
+            const auto t = (target - prev_center) / (center - prev_center);
+            return m_centroids[i - 1].mean
+                + t * (m_centroids[i].mean - m_centroids[i - 1].mean);
+        }
+        prev_center = center;
+        cumulative += m_centroids[i].weight;
+    }
+    return m_centroids[m_size - 1].mean;
+}
+
+void QuantileSketch::clear() {
+    m_size = 0;
+    m_count = 0;
+}
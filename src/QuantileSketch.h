@@ -0,0 +1,85 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2018-2019 Gian-Carlo Pascutto
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef QUANTILESKETCH_H_INCLUDED
+#define QUANTILESKETCH_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Approximate quantiles of a stream of values in fixed memory.
+// Values are summarized by at most CAPACITY centroids, each one the
+// mean of a run of consecutive values in sorted order, with its count.
+// When a new value doesn't fit, the two neighbouring centroids that
+// are cheapest to join are merged. Centroids are kept smaller near the
+// median, which is the quantile the search asks for, and as long as
+// there are no more than CAPACITY values the quantiles are exact.
+// Sketches can be merged, to summarize the union of their values.
+// Not thread safe.
+class QuantileSketch {
+public:
+    static constexpr size_t CAPACITY = 16;
+
+    void add(float value, std::uint32_t weight = 1);
+    void merge(const QuantileSketch& other);
+
+    // Linear interpolation between the centroids, with the same result
+    // as Utils::median() for the median of few values. 0 if empty.
+    float quantile(float q) const;
+    float median() const {
+        return quantile(0.5f);
+    }
+
+    // Number of values added.
+    std::uint32_t count() const {
+        return m_count;
+    }
+    bool empty() const {
+        return m_count == 0;
+    }
+    void clear();
+
+private:
+    struct Centroid {
+        float mean;
+        std::uint32_t weight;
+    };
+
+    void compress();
+
+    // One more than CAPACITY, to insert before compressing.
+    std::array<Centroid, CAPACITY + 1> m_centroids;
+    std::uint8_t m_size{0};
+    std::uint32_t m_count{0};
+};
+
+#endif
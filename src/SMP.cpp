@@ -30,9 +30,18 @@
 
 #include "SMP.h"
 
+#include <algorithm>
 #include <cassert>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <thread>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 SMP::Mutex::Mutex() {
     m_lock = false;
 }
@@ -42,6 +51,12 @@ SMP::Lock::Lock(Mutex & m) {
     lock();
 }
 
+SMP::Lock::Lock(Mutex & m, std::try_to_lock_t) {
+    m_mutex = &m;
+    m_owns_lock = !m_mutex->m_lock.load(std::memory_order_relaxed)
+        && !m_mutex->m_lock.exchange(true, std::memory_order_acquire);
+}
+
 void SMP::Lock::lock() {
     assert(!m_owns_lock);
     // Test and Test-and-Set reduces memory contention
@@ -74,6 +89,159 @@ SMP::Lock::~Lock() {
     }
 }
 
+namespace {
+
+#ifdef __linux__
+std::string read_line(const std::string& filename) {
+    auto file = std::ifstream{filename};
+    auto line = std::string{};
+    std::getline(file, line);
+    return line;
+}
+
+// Parse a list of CPUs or nodes such as "0-3,8-11".
+std::vector<int> parse_list(const std::string& list) {
+    auto cpus = std::vector<int>{};
+    auto in = std::istringstream{list};
+    auto range = std::string{};
+    while (std::getline(in, range, ',')) {
+        const auto dash = range.find('-');
+        try {
+            const auto first = std::stoi(range.substr(0, dash));
+            const auto last = dash == std::string::npos ?
+                first : std::stoi(range.substr(dash + 1));
+            for (auto cpu = first; cpu <= last; cpu++) {
+                cpus.emplace_back(cpu);
+            }
+        } catch (...) {
+            // Empty or unexpected, skip it.
+        }
+    }
+    return cpus;
+}
+
+SMP::Topology query_topology() {
+    auto topology = SMP::Topology{};
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return topology;
+    }
+    auto max_cpu = -1;
+    for (const auto node : parse_list(read_line("/sys/devices/system/node/online"))) {
+        const auto list = read_line("/sys/devices/system/node/node"
+                                    + std::to_string(node) + "/cpulist");
+        auto cpus = std::vector<int>{};
+        for (const auto cpu : parse_list(list)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                cpus.emplace_back(cpu);
+                max_cpu = std::max(max_cpu, cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            topology.nodes.emplace_back(std::move(cpus));
+        }
+    }
+    if (topology.nodes.empty()) {
+        // No NUMA information, all the allowed CPUs on one node.
+        auto cpus = std::vector<int>{};
+        for (auto cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.emplace_back(cpu);
+                max_cpu = cpu;
+            }
+        }
+        if (!cpus.empty()) {
+            topology.nodes.emplace_back(std::move(cpus));
+        }
+    }
+    topology.cpu_node.assign(max_cpu + 1, -1);
+    for (auto node = size_t{0}; node < topology.nodes.size(); node++) {
+        for (const auto cpu : topology.nodes[node]) {
+            topology.cpu_node[cpu] = static_cast<int>(node);
+        }
+    }
+    return topology;
+}
+
+bool set_affinity(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+#else
+SMP::Topology query_topology() {
+    return SMP::Topology{};
+}
+#endif
+
+}
+
+const SMP::Topology& SMP::get_topology() {
+    static const auto topology = [] {
+        auto topology = query_topology();
+        if (topology.nodes.empty()) {
+            const auto cpus =
+                std::max(std::thread::hardware_concurrency(), 1u);
+            topology.nodes.resize(1);
+            for (auto cpu = 0u; cpu < cpus; cpu++) {
+                topology.nodes[0].emplace_back(static_cast<int>(cpu));
+            }
+            topology.cpu_node.assign(cpus, 0);
+        }
+        return topology;
+    }();
+    return topology;
+}
+
 size_t SMP::get_num_cpus() {
-    return std::thread::hardware_concurrency();
+    auto cpus = size_t{0};
+    for (const auto& node : get_topology().nodes) {
+        cpus += node.size();
+    }
+    return cpus;
+}
+
+size_t SMP::get_num_nodes() {
+    return get_topology().nodes.size();
+}
+
+int SMP::get_thread_cpu(const size_t index) {
+    const auto& nodes = get_topology().nodes;
+    const auto& node = nodes[index % nodes.size()];
+    return node[(index / nodes.size()) % node.size()];
+}
+
+bool SMP::pin_thread_to_cpu(const int cpu) {
+#ifdef __linux__
+    return set_affinity({cpu});
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+bool SMP::pin_thread_to_node(const size_t node) {
+#ifdef __linux__
+    const auto& nodes = get_topology().nodes;
+    return node < nodes.size() && set_affinity(nodes[node]);
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+size_t SMP::get_current_node() {
+#ifdef __linux__
+    const auto& cpu_node = get_topology().cpu_node;
+    const auto cpu = sched_getcpu();
+    if (cpu >= 0 && static_cast<size_t>(cpu) < cpu_node.size()
+        && cpu_node[cpu] >= 0) {
+        return cpu_node[cpu];
+    }
+#endif
+    return 0;
 }
@@ -35,9 +35,35 @@
 
 #include <cstddef>
 #include <atomic>
+#include <mutex>
+#include <vector>
 
 namespace SMP {
+    // The CPUs the process may run on, grouped by NUMA node, as the
+    // system reports them. Where it can't be queried, a single node with
+    // std::thread::hardware_concurrency() CPUs.
+    struct Topology {
+        std::vector<std::vector<int>> nodes;
+        // NUMA node of each CPU, by CPU number, -1 if not usable.
+        std::vector<int> cpu_node;
+    };
+    const Topology& get_topology();
+
     size_t get_num_cpus();
+    size_t get_num_nodes();
+
+    // CPU for the thread with the given index, spreading consecutive
+    // threads over the nodes.
+    int get_thread_cpu(size_t index);
+
+    // Restrict the calling thread to a CPU, or to the CPUs of a node.
+    // Return false where threads can't be pinned.
+    bool pin_thread_to_cpu(int cpu);
+    bool pin_thread_to_node(size_t node);
+
+    // NUMA node of the CPU the calling thread is running on, 0 if it
+    // is unknown.
+    size_t get_current_node();
 
     class Mutex {
     public:
@@ -51,9 +77,14 @@ namespace SMP {
     class Lock {
     public:
         explicit Lock(Mutex & m);
+        // Doesn't wait if the mutex is held, see owns_lock().
+        Lock(Mutex & m, std::try_to_lock_t);
         ~Lock();
         void lock();
         void unlock();
+        bool owns_lock() const {
+            return m_owns_lock;
+        }
     private:
         Mutex * m_mutex;
         bool m_owns_lock{false};
@@ -0,0 +1,102 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2018-2019 Gian-Carlo Pascutto
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+#include "TTable.h"
+
+#include <cstring>
+#include <new>
+
+TTable::TTable(size_t entries) {
+    m_size = 1;
+    while (m_size * 2 <= entries) {
+        m_size *= 2;
+    }
+    // All-zero bytes are unused entries, and untouched pages cost no
+    // memory.
+    auto table = std::calloc(m_size, sizeof(Entry));
+    if (!table) {
+        throw std::bad_alloc();
+    }
+    m_entries.reset(static_cast<Entry*>(table));
+}
+
+std::uint64_t TTable::get_key(std::uint64_t hash, float komi,
+                              float bonus_father, float base_father) {
+    std::uint32_t komi_bits, bonus, base;
+    std::memcpy(&komi_bits, &komi, sizeof(komi_bits));
+    // -0.0f is 0.0f, on the bits as -ffast-math ignores the sign of 0.
+    if (komi_bits << 1 == 0) {
+        komi_bits = 0;
+    }
+    std::memcpy(&bonus, &bonus_father, sizeof(bonus));
+    std::memcpy(&base, &base_father, sizeof(base));
+    auto key = hash ^ (komi_bits * 0x94D049BB133111EBULL)
+                    ^ (bonus * 0x9E3779B97F4A7C15ULL)
+                    ^ (base * 0xC2B2AE3D27D4EB4FULL);
+    // 0 marks an unused entry.
+    return key ? key : 1;
+}
+
+bool TTable::acquire(Entry& entry, std::uint64_t key) {
+    if (entry.refs.fetch_add(1) < 0) {
+        // Being taken over.
+        entry.refs.fetch_sub(1);
+        return false;
+    }
+    // It can't be taken over while referenced, but it could have been
+    // before the reference.
+    if (entry.key.load() != key) {
+        release(&entry);
+        return false;
+    }
+    return true;
+}
+
+TTable::Entry* TTable::get_entry(std::uint64_t key) {
+    for (auto i = size_t{0}; i < MAX_PROBES; i++) {
+        auto& entry = m_entries[(key + i) & (m_size - 1)];
+        if (entry.key.load() == key && acquire(entry, key)) {
+            return &entry;
+        }
+    }
+    for (auto i = size_t{0}; i < MAX_PROBES; i++) {
+        auto& entry = m_entries[(key + i) & (m_size - 1)];
+        auto refs = 0;
+        if (entry.refs.compare_exchange_strong(refs, TAKEN_OVER)) {
+            entry.key = key;
+            entry.visits = 0;
+            entry.blackevals = 0.0;
+            // Keeps the references of the lookups still backing off.
+            entry.refs.fetch_add(1 - TAKEN_OVER);
+            return &entry;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,97 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2018-2019 Gian-Carlo Pascutto
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef TTABLE_H_INCLUDED
+#define TTABLE_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+// Statistics shared by the nodes of the search tree which reach the
+// same position through different move orders. Each node keeps its
+// own visits, which drive exploration and the choice of the move, but
+// selection looks at the winrate of all the visits to the position.
+// Because the tree itself stays a tree, path dependent results like
+// superko are still decided per node. Only the winrates are shared
+// here, the network evaluation of a transposition comes from the
+// NN cache.
+//
+// The table is never cleared: the entries stay valid from one move to
+// the next, and those no node links any more are taken over by new
+// keys. The table must outlive the nodes linked to it.
+class TTable {
+public:
+    struct Entry {
+        std::atomic<std::uint64_t> key;
+        std::atomic<int> visits;
+        // Nodes linked to the entry, negative while it is taken over.
+        std::atomic<int> refs;
+        std::atomic<double> blackevals;
+    };
+
+    // Number of entries is rounded down to a power of two.
+    explicit TTable(size_t entries);
+
+    // Key of a position. The evaluations backed up to a node depend on
+    // the komi and on the bonus of its parent, so those of different
+    // komis or bonuses are kept apart.
+    static std::uint64_t get_key(std::uint64_t hash, float komi,
+                                 float bonus_father, float base_father);
+
+    // Entry for key, with a reference the caller must release(). If
+    // the key has none, it takes over a slot no node uses. Returns
+    // nullptr if the table is too full around the key.
+    Entry* get_entry(std::uint64_t key);
+    static void release(Entry* entry) {
+        entry->refs.fetch_sub(1);
+    }
+
+private:
+    // Slots looked at for a key.
+    static constexpr size_t MAX_PROBES = 8;
+    // Added to the references of an entry being taken over, so that
+    // the lookups racing with it back off.
+    static constexpr int TAKEN_OVER = -(1 << 30);
+
+    struct TableDeleter {
+        void operator()(Entry* p) const { std::free(p); }
+    };
+
+    static bool acquire(Entry& entry, std::uint64_t key);
+
+    size_t m_size;
+    // Allocated zeroed so untouched pages cost no memory.
+    std::unique_ptr<Entry[], TableDeleter> m_entries;
+};
+
+#endif
@@ -26,82 +26,303 @@
     distribution.
 */
 
-#include <cstddef>
-#include <vector>
-#include <thread>
-#include <queue>
-#include <mutex>
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
-#include <memory>
-#include <future>
+#include <cstddef>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace Utils {
 
+// A callable taking no arguments, like std::function<void()>, but which
+// is stored in place when it is small enough, so that queueing it does
+// not allocate memory. Movable only.
+class Task {
+public:
+    Task() = default;
+
+    template<class F,
+             class = typename std::enable_if<
+                 !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) {
+        using Fn = typename std::decay<F>::type;
+        constexpr auto fits = sizeof(Fn) <= INLINE_SIZE
+            && alignof(Fn) <= alignof(Storage)
+            && std::is_nothrow_move_constructible<Fn>::value;
+        init<Fn>(std::forward<F>(f), std::integral_constant<bool, fits>{});
+    }
+
+    Task(Task&& other) noexcept {
+        move_from(other);
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            move_from(other);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        reset();
+    }
+
+    void operator()() {
+        m_ops->invoke(&m_storage);
+    }
+
+private:
+    static constexpr size_t INLINE_SIZE = 64;
+    using Storage =
+        std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type;
+
+    struct Ops {
+        void (*invoke)(void* storage);
+        // Move the callable to uninitialized storage and destroy it.
+        void (*relocate)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    template<class Fn>
+    static const Ops* inline_ops() {
+        static const Ops ops = {
+            [](void* storage) { (*static_cast<Fn*>(storage))(); },
+            [](void* from, void* to) {
+                new (to) Fn(std::move(*static_cast<Fn*>(from)));
+                static_cast<Fn*>(from)->~Fn();
+            },
+            [](void* storage) { static_cast<Fn*>(storage)->~Fn(); }
+        };
+        return &ops;
+    }
+
+    template<class Fn>
+    static const Ops* heap_ops() {
+        static const Ops ops = {
+            [](void* storage) { (**static_cast<Fn**>(storage))(); },
+            [](void* from, void* to) {
+                *static_cast<Fn**>(to) = *static_cast<Fn**>(from);
+            },
+            [](void* storage) { delete *static_cast<Fn**>(storage); }
+        };
+        return &ops;
+    }
+
+    template<class Fn, class F>
+    void init(F&& f, std::true_type) {
+        new (&m_storage) Fn(std::forward<F>(f));
+        m_ops = inline_ops<Fn>();
+    }
+
+    template<class Fn, class F>
+    void init(F&& f, std::false_type) {
+        *reinterpret_cast<Fn**>(&m_storage) = new Fn(std::forward<F>(f));
+        m_ops = heap_ops<Fn>();
+    }
+
+    void move_from(Task& other) {
+        if (other.m_ops) {
+            other.m_ops->relocate(&other.m_storage, &m_storage);
+            m_ops = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+
+    void reset() {
+        if (m_ops) {
+            m_ops->destroy(&m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    const Ops* m_ops{nullptr};
+    Storage m_storage;
+};
+
+// Work-stealing thread pool. Every thread has its own deque of tasks:
+// it runs the last one it queued first, while idle threads steal the
+// oldest ones of the others. Tasks queued by threads outside the pool
+// are spread over the deques.
 class ThreadPool {
 public:
     ThreadPool() = default;
     ~ThreadPool();
 
-    // create worker threads.  This version has no initializers.
-    void initialize(std::size_t);
+    // create worker threads.  Only to be called once.  Each thread
+    // calls initializer with its index before doing anything, so that
+    // the user can initialize per-thread state, or pin the thread.
+    void initialize(std::size_t threads,
+                    std::function<void(std::size_t)> initializer = nullptr);
+
+    std::size_t size() const {
+        return m_workers.size();
+    }
+
+    // Queue task, tagged with group. Without threads, task is run here.
+    void add_task(Task&& task, const void* group = nullptr);
+
+    // Run a queued task of group on the calling thread, taking it from
+    // the deque of the thread if it belongs to the pool, or stealing it.
+    // Returns false if there is none.
+    bool run_pending_task(const void* group);
 
-    // add an extra thread.  The thread calls initializer() before doing anything,
-    // so that the user can initialize per-thread data structures before doing work.
-    void add_thread(std::function<void()> initializer);
-    template<class F, class... Args>
-    auto add_task(F&& f, Args&&... args)
-        -> std::future<typename std::result_of<F(Args...)>::type>;
 private:
+    struct Job {
+        Task task;
+        const void* group;
+    };
+
+    // Each deque has its own lock. Not over-aligned, operator new
+    // ignores it before C++17.
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    struct Current {
+        const ThreadPool* pool{nullptr};
+        std::size_t index{0};
+    };
+    static Current& current() {
+        static thread_local Current current;
+        return current;
+    }
+
+    bool take_job(Job& job, bool any_group, const void* group);
+    bool take_from(Worker& worker, bool back, bool any_group,
+                   const void* group, Job& job);
+
     std::vector<std::thread> m_threads;
-    std::queue<std::function<void()>> m_tasks;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<std::size_t> m_next_worker{0};
 
+    // Jobs in the deques, the threads sleep when there are none.
+    std::atomic<std::size_t> m_pending{0};
     std::mutex m_mutex;
     std::condition_variable m_condvar;
     bool m_exit{false};
 };
 
-inline void ThreadPool::add_thread(std::function<void()> initializer) {
-    m_threads.emplace_back([this, initializer] {
-        initializer();
-        for (;;) {
-            std::function<void()> task;
-            {
+inline void ThreadPool::initialize(size_t threads,
+                                   std::function<void(size_t)> initializer) {
+    for (size_t i = 0; i < threads; i++) {
+        m_workers.emplace_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        m_threads.emplace_back([this, i, initializer] {
+            if (initializer) {
+                initializer(i);
+            }
+            current() = {this, i};
+            for (;;) {
+                Job job;
+                if (take_job(job, true, nullptr)) {
+                    job.task();
+                    continue;
+                }
                 std::unique_lock<std::mutex> lock(m_mutex);
-                m_condvar.wait(lock, [this]{ return m_exit || !m_tasks.empty(); });
-                if (m_exit && m_tasks.empty()) {
+                m_condvar.wait(lock, [this]{ return m_exit || m_pending > 0; });
+                if (m_exit && m_pending == 0) {
                     return;
                 }
-                task = std::move(m_tasks.front());
-                m_tasks.pop();
             }
-            task();
-        }
-    });
+        });
+    }
 }
 
-inline void ThreadPool::initialize(size_t threads) {
-    for (size_t i = 0; i < threads; i++) {
-        add_thread([](){} /* null function */);
+inline void ThreadPool::add_task(Task&& task, const void* group) {
+    if (m_workers.empty()) {
+        task();
+        return;
+    }
+    const auto& self = current();
+    const auto index = self.pool == this ?
+        self.index : m_next_worker++ % m_workers.size();
+    {
+        auto& worker = *m_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.jobs.push_back({std::move(task), group});
+        m_pending++;
+    }
+    // Taking the lock orders this with a thread going to sleep.
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
     }
+    m_condvar.notify_one();
 }
 
-template<class F, class... Args>
-auto ThreadPool::add_task(F&& f, Args&&... args)
-    -> std::future<typename std::result_of<F(Args...)>::type> {
-    using return_type = typename std::result_of<F(Args...)>::type;
+inline bool ThreadPool::take_from(Worker& worker, const bool back,
+                                  const bool any_group, const void* group,
+                                  Job& job) {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    auto& jobs = worker.jobs;
+    if (jobs.empty()) {
+        return false;
+    }
+    if (any_group) {
+        if (back) {
+            job = std::move(jobs.back());
+            jobs.pop_back();
+        } else {
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        m_pending--;
+        return true;
+    }
+    const auto size = jobs.size();
+    for (size_t i = 0; i < size; i++) {
+        const auto it = back ? jobs.begin() + (size - 1 - i) : jobs.begin() + i;
+        if (it->group == group) {
+            job = std::move(*it);
+            jobs.erase(it);
+            m_pending--;
+            return true;
+        }
+    }
+    return false;
+}
 
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-    );
+inline bool ThreadPool::take_job(Job& job, const bool any_group,
+                                 const void* group) {
+    if (m_workers.empty()) {
+        return false;
+    }
+    const auto& self = current();
+    const auto own = self.pool == this;
+    const auto first = own ? self.index : m_next_worker.load();
+    if (own && take_from(*m_workers[first], true, any_group, group, job)) {
+        return true;
+    }
+    for (size_t i = own ? 1 : 0; i < m_workers.size(); i++) {
+        auto& victim = *m_workers[(first + i) % m_workers.size()];
+        if (take_from(victim, false, any_group, group, job)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_tasks.emplace([task](){(*task)();});
+inline bool ThreadPool::run_pending_task(const void* group) {
+    Job job;
+    if (!take_job(job, false, group)) {
+        return false;
     }
-    m_condvar.notify_one();
-    return res;
+    job.task();
+    return true;
 }
 
 inline ThreadPool::~ThreadPool() {
@@ -115,25 +336,107 @@ inline ThreadPool::~ThreadPool() {
     }
 }
 
+// Tasks run on a pool, which can be waited for together. Waiting for
+// them runs those still queued on the waiting thread, so that groups
+// can be waited for from the tasks of another group.
 class ThreadGroup {
 public:
-    ThreadGroup(ThreadPool & pool) : m_pool(pool) {}
-    template<class F, class... Args>
-    void add_task(F&& f, Args&&... args) {
-        m_taskresults.emplace_back(
-            m_pool.add_task(std::forward<F>(f), std::forward<Args>(args)...)
-        );
+    ThreadGroup(ThreadPool & pool)
+        : m_pool(pool), m_state(std::make_unique<State>()) {}
+    ThreadGroup(ThreadGroup&&) = default;
+    // Waits for the tasks, without rethrowing their exceptions.
+    ~ThreadGroup() {
+        if (m_state) {
+            wait();
+        }
+    }
+
+    template<class F>
+    void add_task(F&& f) {
+        const auto state = m_state.get();
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->pending++;
+        }
+        m_pool.add_task(
+            [state, f = std::forward<F>(f)]() mutable {
+                try {
+                    f();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (!state->exception) {
+                        state->exception = std::current_exception();
+                    }
+                }
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (--state->pending == 0) {
+                    state->condvar.notify_all();
+                }
+            },
+            state);
     }
+
+    // Add tasks which call f(i) for every i in [0, count), in a few
+    // chunks per thread of the pool. Each chunk has a copy of f.
+    template<class F>
+    void add_range(std::size_t count, F f) {
+        const auto chunks = std::min(count, 4 * (m_pool.size() + 1));
+        for (std::size_t c = 0; c < chunks; c++) {
+            const auto begin = count * c / chunks;
+            const auto end = count * (c + 1) / chunks;
+            add_task([f, begin, end]() mutable {
+                for (auto i = begin; i < end; i++) {
+                    f(i);
+                }
+            });
+        }
+    }
+
+    // Wait for the tasks and rethrow the first exception they threw.
+    // The group can be given new tasks afterwards.
     void wait_all() {
-        for (auto && result : m_taskresults) {
-            result.get();
+        wait();
+        std::exception_ptr exception;
+        std::swap(exception, m_state->exception);
+        if (exception) {
+            std::rethrow_exception(exception);
         }
     }
+
 private:
+    struct State {
+        std::mutex mutex;
+        std::condition_variable condvar;
+        std::size_t pending{0};
+        std::exception_ptr exception;
+    };
+
+    void wait() {
+        const auto state = m_state.get();
+        // Tasks still queued are run here, then wait for the running ones.
+        do {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->pending == 0) {
+                return;
+            }
+        } while (m_pool.run_pending_task(state));
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->condvar.wait(lock, [state]{ return state->pending == 0; });
+    }
+
     ThreadPool & m_pool;
-    std::vector<std::future<void>> m_taskresults;
+    std::unique_ptr<State> m_state;
 };
 
+// Call f(i) for every i in [0, count), on the threads of pool and the
+// calling one. Returns when all are done.
+template<class F>
+void parallel_for(ThreadPool & pool, std::size_t count, F&& f) {
+    ThreadGroup tg(pool);
+    tg.add_range(count, [&f](std::size_t i) { f(i); });
+    tg.wait_all();
+}
+
 }
 
 #endif
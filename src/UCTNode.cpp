@@ -34,6 +34,7 @@
 #include <cstdio>
 #include <cstdint>
 #include <algorithm>
+#include <bitset>
 #include <cmath>
 #include <functional>
 #include <iterator>
@@ -54,11 +55,25 @@
 
 using namespace Utils;
 
-UCTNode::UCTNode(int vertex, float policy) : m_move(vertex), m_policy(policy) {
+// The size of the nodes of release builds on 64 bit platforms, with
+// USE_EVALCMD. Debug builds add m_last_urgency.
+#ifdef NDEBUG
+static_assert(sizeof(void*) != 8 || sizeof(UCTNode) <= 144,
+              "UCTNode grew, see the note on its members");
+#endif
+
+UCTNode::UCTNode(int vertex, float policy) : m_policy(policy), m_move(vertex) {
+}
+
+UCTNode::~UCTNode() {
+    delete m_subtree.load();
+    if (const auto entry = m_tt_entry.load()) {
+        TTable::release(entry);
+    }
 }
 
 bool UCTNode::first_visit() const {
-    return m_visits == 0;
+    return visits_of(m_counts.load()) == 0;
 }
 
 bool UCTNode::create_children(Network & network,
@@ -264,7 +279,7 @@ void UCTNode::link_nodelist(std::atomic<int>& nodecount,
     m_min_psa_ratio_children = skipped_children ? min_psa_ratio : 0.0f;
 }
 
-const std::vector<UCTNodePointer>& UCTNode::get_children() const {
+const UCTNode::ChildrenList& UCTNode::get_children() const {
     return m_children;
 }
 
@@ -273,19 +288,28 @@ int UCTNode::get_move() const {
     return m_move;
 }
 
-void UCTNode::virtual_loss() {
-    m_virtual_loss += VIRTUAL_LOSS_COUNT;
+bool UCTNode::virtual_loss() {
+    const auto counts = m_counts.fetch_add(VIRTUAL_LOSS_COUNT);
+    // The threads and batch leaves are limited to MAX_DESCENTS, see
+    // UCTSearch::prefetch_leaves(), this only keeps a bad count from
+    // carrying into the forced visits for longer than this.
+    if (virtual_loss_of(counts) + VIRTUAL_LOSS_COUNT > MAX_VIRTUAL_LOSS) {
+        m_counts -= VIRTUAL_LOSS_COUNT;
+        return false;
+    }
+    return true;
 }
 
 void UCTNode::virtual_loss_undo() {
-    m_virtual_loss -= VIRTUAL_LOSS_COUNT;
+    m_counts -= VIRTUAL_LOSS_COUNT;
 }
 
 void UCTNode::clear_visits() {
-    m_visits = 0;
-    m_forced = 0;
+    // Keep the virtual losses.
+    m_counts &= MAX_VIRTUAL_LOSS;
     m_blackevals = 0;
     m_alpkt_median = 0;
+    delete m_subtree.exchange(nullptr);
 }
 
 void UCTNode::clear_children_visits() {
@@ -296,25 +320,42 @@ void UCTNode::clear_children_visits() {
     }
 }
 
-void UCTNode::update(float eval, bool forced) {
+bool UCTNode::update(float eval, bool forced) {
     // Cache values to avoid race conditions.
-    auto old_eval = static_cast<float>(m_blackevals);
-    auto old_visits = static_cast<int>(m_visits);
+    auto old_eval = static_cast<float>(get_blackevals());
+    auto counts = m_counts.load();
+    if (forced) {
+        auto next = std::uint64_t{};
+        do {
+            next = counts + (std::uint64_t{1} << VISITS_SHIFT);
+            if (forced_of(counts) < MAX_FORCED) {
+                next += std::uint64_t{1} << FORCED_SHIFT;
+            }
+        } while (!m_counts.compare_exchange_weak(counts, next));
+    } else {
+        counts = m_counts.fetch_add(std::uint64_t{1} << VISITS_SHIFT);
+    }
+    auto old_visits = visits_of(counts);
     auto old_delta = old_visits > 0 ? eval - old_eval / old_visits : 0.0f;
-    m_visits++;
+    const auto first = (old_visits == 0);
     accumulate_eval(eval);
     auto new_delta = eval - (old_eval + eval) / (old_visits + 1);
     // Welford's online algorithm for calculating variance.
     auto delta = old_delta * new_delta;
-    atomic_add(m_squared_eval_diff, delta);
-    if (forced) {
-        m_forced++;
+    m_squared_eval_diff += to_fixed(delta);
+    if (const auto entry = m_tt_entry.load()) {
+        entry->visits++;
+        atomic_add(entry->blackevals, double(eval));
+    }
+    if (!first && m_terminal) {
+        add_subtree_ending(m_net_alpkt);
     }
+    return first;
 }
 
 void UCTNode::update_alpkt_median(float new_alpkt, float new_beta) {
     // Cache values to avoid race conditions.
-    const auto new_visits = static_cast<int>(m_visits);
+    const auto new_visits = get_visits();
     assert (new_visits > 0);
     // Sometimes this function is not called when visits==1 so be
     // flexible and set the first value also in those cases.
@@ -423,18 +464,22 @@ bool UCTNode::low_visits_child(UCTNode* const child) const {
 }
 
 float UCTNode::get_eval_variance(float default_var) const {
-    return m_visits > 1 ? m_squared_eval_diff / (m_visits - 1) : default_var;
+    const auto visits = get_visits();
+    return visits > 1 ?
+        static_cast<float>(from_fixed(m_squared_eval_diff) / (visits - 1)) :
+        default_var;
 }
 
 int UCTNode::get_visits() const {
-    return m_visits;
+    return visits_of(m_counts.load());
 }
 
 int UCTNode::get_denom() const {
+    const auto counts = m_counts.load();
     if (cfg_laddercode) {
-        return 1 + m_visits - m_forced;
+        return 1 + visits_of(counts) - forced_of(counts);
     } else {
-        return 1 + m_visits;
+        return 1 + visits_of(counts);
     }
 }
 
@@ -467,7 +512,11 @@ float UCTNode::get_eval_lcb(int color) const {
 }
 
 float UCTNode::get_raw_eval(int tomove, int virtual_loss) const {
-    auto visits = get_visits() + virtual_loss;
+    return compute_eval(tomove, get_visits(), virtual_loss);
+}
+
+float UCTNode::compute_eval(int tomove, int visits, int virtual_loss) const {
+    visits += virtual_loss;
     assert(visits > 0);
     auto blackeval = get_blackevals();
     if (tomove == FastBoard::WHITE) {
@@ -484,7 +533,48 @@ float UCTNode::get_eval(int tomove) const {
     // Due to the use of atomic updates and virtual losses, it is
     // possible for the visit count to change underneath us. Make sure
     // to return a consistent result to the caller by caching the values.
-    return get_raw_eval(tomove, m_virtual_loss);
+    const auto counts = m_counts.load();
+    return compute_eval(tomove, visits_of(counts), virtual_loss_of(counts));
+}
+
+float UCTNode::get_select_eval(int tomove) const {
+    const auto entry = m_tt_entry.load();
+    if (!entry || entry->visits == 0) {
+        return get_eval(tomove);
+    }
+    // Same as get_raw_eval(), with the visits of the entry and the
+    // virtual losses of this node.
+    const auto virtual_loss = virtual_loss_of(m_counts.load());
+    auto visits = entry->visits + virtual_loss;
+    auto blackeval = entry->blackevals.load();
+    if (tomove == FastBoard::WHITE) {
+        blackeval += static_cast<double>(virtual_loss);
+    }
+    auto eval = static_cast<float>(blackeval / double(visits));
+    if (tomove == FastBoard::WHITE) {
+        eval = 1.0f - eval;
+    }
+    return eval;
+}
+
+bool UCTNode::has_tt_entry() const {
+    return m_tt_entry.load() != nullptr;
+}
+
+void UCTNode::set_tt_entry(TTable::Entry* entry) {
+    auto expected = static_cast<TTable::Entry*>(nullptr);
+    if (!entry) {
+        return;
+    }
+    if (m_tt_entry.compare_exchange_strong(expected, entry)) {
+        const auto visits = get_visits();
+        if (visits > 0) {
+            entry->visits += visits;
+            atomic_add(entry->blackevals, get_blackevals());
+        }
+    } else {
+        TTable::release(entry);
+    }
 }
 
 float UCTNode::get_net_eval(int tomove) const {
@@ -502,11 +592,42 @@ float UCTNode::get_agent_eval(int tomove) const {
 }
 
 double UCTNode::get_blackevals() const {
-    return m_blackevals;
+    return from_fixed(m_blackevals);
 }
 
 void UCTNode::accumulate_eval(float eval) {
-    atomic_add(m_blackevals, double(eval));
+    m_blackevals += to_fixed(eval);
+}
+
+namespace {
+// Statistics of the children of a node, gathered by uct_select_child()
+// in contiguous arrays so that scoring them is a tight loop.
+struct ChildScratch {
+    // Winrate of visited children, including virtual losses.
+    std::vector<float> eval;
+    // Added to the winrate: -0.05 for a pass we'd rather not play.
+    std::vector<double> penalty;
+    std::vector<float> psa;
+    std::vector<double> denom;
+    // 1 if the child is being expanded by another thread.
+    std::vector<std::uint8_t> expanding;
+    // 1 if the child has visits.
+    std::vector<std::uint8_t> visited;
+    // 1 if the child can be chosen.
+    std::vector<std::uint8_t> eligible;
+    std::vector<double> value;
+
+    void resize(size_t size) {
+        eval.resize(size);
+        penalty.resize(size);
+        psa.resize(size);
+        denom.resize(size);
+        expanding.resize(size);
+        visited.resize(size);
+        eligible.resize(size);
+        value.resize(size);
+    }
+};
 }
 
 UCTNode* UCTNode::uct_select_child(const GameState & currstate, bool is_root,
@@ -525,100 +646,110 @@ UCTNode* UCTNode::uct_select_child(const GameState & currstate, bool is_root,
     const auto color = currstate.get_to_move();
     auto max_eval = 0.0f;
 
-    for (const auto& child : m_children) {
-        if (child.valid()) {
-            parentvisits += child.get_visits();
-            if (child.get_visits() > 0) {
-	      const auto child_eval = child.get()->get_raw_eval(color);
-                max_eval = std::max (max_eval, child_eval);
-                total_visited_policy += child.get_policy();
-            }
-        }
+    // Moves allowed at the root, indexed by vertex + 1 to fit pass.
+    auto allowed = std::bitset<FastBoard::NUM_VERTICES + 1>{};
+    for (const auto move : move_list) {
+        allowed.set(move + 1);
     }
 
-    const auto numerator = std::sqrt(double(parentvisits) *
-            std::log(cfg_logpuct * double(parentvisits) + cfg_logconst));
-    const auto fpu_reduction = (is_root ? cfg_fpu_root_reduction : cfg_fpu_reduction) * std::sqrt(total_visited_policy);
-    // Estimated eval for unknown nodes = parent (not NN) eval - reduction
-    const auto fpu_eval = cfg_fpuzero ? 0.0f : (max_eval - fpu_reduction);
-
-
-    auto best = static_cast<UCTNodePointer*>(nullptr);
-    auto best_value = std::numeric_limits<double>::lowest();
-
-#ifndef NDEBUG
-    auto b_psa = 0.0f;
-    auto b_q = 0.0f;
-    auto b_denom = 0.0f;
-#endif
-
-    for (auto& child : m_children) {
-        if (!child.active()) {
-            continue;
-        }
+    // Read each child once, the following loops only look at the arrays.
+    thread_local ChildScratch scratch;
+    const auto count = m_children.size();
+    scratch.resize(count);
+
+    for (auto i = size_t{0}; i < count; i++) {
+        const auto& child = m_children[i];
+        const auto node = child.is_inflated() ? child.get() : nullptr;
+        const auto status = node ? node->m_status.load() : ACTIVE;
+        const auto visits = node ? node->get_visits() : 0;
+        const auto move = child.get_move();
+        auto psa = child.get_policy();
 
-        if( !move_list.empty() &&
-            std::find( begin(move_list), end(move_list),
-                       child.get_move() ) == end(move_list) ) {
-          continue;
+        if (status != INVALID) {
+            parentvisits += visits;
+            if (visits > 0) {
+                max_eval = std::max(max_eval, node->get_raw_eval(color));
+                total_visited_policy += psa;
+            }
         }
 
-        const auto visits = child.get_visits();
-
         // If max_visits is specified, then stop choosing nodes that
         // already have enough visits. This guarantees that
         // exploration is wide enough and not too deep when doing fast
         // roll-outs in the endgame exploration.
-        if (max_visits > 0 && visits >= max_visits) {
-            continue;
-        }
+        scratch.eligible[i] = status == ACTIVE
+            && (move_list.empty() || allowed[move + 1])
+            && !(max_visits > 0 && visits >= max_visits);
 
-        auto winrate = fpu_eval;
-        if (child.is_inflated() &&
-            child->m_expand_state.load() == ExpandState::EXPANDING) {
-            // Someone else is expanding this node, never select it
-            // if we can avoid so, because we'd block on it.
-            winrate = -1.0f - fpu_reduction; // why not simply 'continue'?
-        } else if (visits > 0) {
-            winrate = child.get_eval(color);
-        }
-        auto psa = child.get_policy();
+        scratch.expanding[i] = node &&
+            node->m_expand_state.load() == ExpandState::EXPANDING;
+        scratch.visited[i] = visits > 0;
+        scratch.eval[i] = visits > 0 ? node->get_select_eval(color) : 0.0f;
+        scratch.penalty[i] = 0.0;
 
-        if (nopass && child.get_move() == FastBoard::PASS) {
+        if (nopass && move == FastBoard::PASS) {
             psa = 0.0;
-            winrate -= 0.05; // is this correct?
+            scratch.penalty[i] = -0.05; // is this correct?
         }
 
-        if (currstate.get_passes() >= 1 &&
-            child.get_move() == FastBoard::PASS) {
+        if (currstate.get_passes() >= 1 && move == FastBoard::PASS) {
             psa += 0.2;
         }
 
         if (cfg_stdevuct) {
-            const auto stdev = std::sqrt(child.get_eval_variance(0.25f));
+            const auto variance = node ? node->get_eval_variance(0.25f)
+                                       : 0.25f;
+            const auto stdev = std::sqrt(variance);
             // maximum stdev is 0.5 so double it to get something of
             // order 1; still this term will increase the relative
             // weight of winrate, so also consider increasing cfg_puct
             psa *= 2.0f * stdev;
         }
-        const auto denom = child.get_denom();
-        const auto puct = cfg_puct * psa * (numerator / denom);
+        scratch.psa[i] = psa;
+        scratch.denom[i] = node ? node->get_denom() : 1;
+    }
 
-        auto value = winrate + puct;
-        assert(value > std::numeric_limits<double>::lowest());
+    const auto numerator = std::sqrt(double(parentvisits) *
+            std::log(cfg_logpuct * double(parentvisits) + cfg_logconst));
+    const auto fpu_reduction = (is_root ? cfg_fpu_root_reduction : cfg_fpu_reduction) * std::sqrt(total_visited_policy);
+    // Estimated eval for unknown nodes = parent (not NN) eval - reduction
+    const auto fpu_eval = cfg_fpuzero ? 0.0f : (max_eval - fpu_reduction);
+    // Someone else is expanding this node, never select it if we can
+    // avoid so, because we'd block on it.
+    const auto expanding_eval = -1.0f - fpu_reduction;
+    const auto lowest = std::numeric_limits<double>::lowest();
+
+    // No branches, so that the compiler can vectorize it.
+    for (auto i = size_t{0}; i < count; i++) {
+        auto winrate = scratch.visited[i] ? scratch.eval[i] : fpu_eval;
+        winrate = scratch.expanding[i] ? expanding_eval : winrate;
+        winrate = static_cast<float>(winrate + scratch.penalty[i]);
+        const auto puct = cfg_puct * scratch.psa[i]
+            * (numerator / scratch.denom[i]);
+        const auto value = winrate + puct;
+        scratch.value[i] = scratch.eligible[i] ? value : lowest;
+    }
 
-        if (value > best_value) {
-            best_value = value;
-            best = &child;
-#ifndef NDEBUG
-            b_psa = psa;
-            b_q = winrate;
-            b_denom = denom;
-#endif
+    auto best = static_cast<UCTNodePointer*>(nullptr);
+    auto best_value = lowest;
+    auto best_index = size_t{0};
+    for (auto i = size_t{0}; i < count; i++) {
+        if (scratch.eligible[i] && scratch.value[i] > best_value) {
+            best_value = scratch.value[i];
+            best_index = i;
+            best = &m_children[i];
         }
     }
-
     assert(best != nullptr);
+#ifndef NDEBUG
+    const auto b_psa = scratch.psa[best_index];
+    auto b_q = scratch.visited[best_index] ? scratch.eval[best_index] : fpu_eval;
+    b_q = scratch.expanding[best_index] ? expanding_eval : b_q;
+    b_q = static_cast<float>(b_q + scratch.penalty[best_index]);
+    const auto b_denom = scratch.denom[best_index];
+#else
+    (void)best_index;
+#endif
     if(best->get_visits() == 0) {
         best->inflate();
         best->get()->set_values(m_net_eval, m_net_alpkt, m_net_beta);
@@ -722,12 +853,22 @@ UCTNode& UCTNode::get_best_root_child(int color) {
     return *(ret->get());
 }
 
-size_t UCTNode::count_nodes_and_clear_expand_state() {
+size_t UCTNode::count_nodes_and_clear_expand_state(const bool parallel) {
     auto nodecount = size_t{0};
     nodecount += m_children.size();
     if (expandable()) {
         m_expand_state = ExpandState::INITIAL;
     }
+    if (parallel) {
+        std::atomic<size_t> subtrees{0};
+        parallel_for(thread_pool, m_children.size(), [this, &subtrees](size_t i) {
+            const auto& child = m_children[i];
+            if (child.is_inflated()) {
+                subtrees += child->count_nodes_and_clear_expand_state();
+            }
+        });
+        return nodecount + subtrees;
+    }
     for (auto& child : m_children) {
         if (child.is_inflated()) {
             nodecount += child->count_nodes_and_clear_expand_state();
@@ -767,90 +908,451 @@ UCTNode* UCTNode::select_child(int move) {
     return nullptr;
 }
 
-void UCTNode::get_subtree_alpkts(std::vector<float> & vector,
-                                 int passes,
-                                 bool is_tromptaylor_scoring) const {
-    auto children_visits = 0;
-
+float UCTNode::estimate_alpkt(int passes,
+                              bool is_tromptaylor_scoring) const {
     // check and correct: 'passes' doesn't do anything here.
+    (void)passes;
 
-    vector.emplace_back(get_net_alpkt());
-    for (auto& child : m_children) {
-        const auto child_visits = child.get_visits();
-        if (child_visits > 0) {
-            const auto pass = (child.get_move() == FastBoard::PASS) ? 1 : 0;
-            child->get_subtree_alpkts(vector, ++passes * pass,
-                                      is_tromptaylor_scoring);
-                       children_visits += child_visits;
+    const auto summary = get_subtree_summary();
+    if (summary.nodes == 0) {
+        return get_net_alpkt();
+    }
+    if (!is_tromptaylor_scoring) {
+        return summary.alpkts.median();
+    }
+    // Each simulation counts once, also when it ends at a node
+    // already visited, which happens only on the second pass, where
+    // get_net_alpkt() is the Tromp-Taylor score.
+    auto alpkts = summary.alpkts;
+    alpkts.merge(summary.endings);
+    return alpkts.median();
+}
+
+void* UCTNode::SubtreeStats::operator new(size_t size) {
+    UCTNodePointer::increment_tree_size(size);
+    return NodePool::allocate(size);
+}
+
+void UCTNode::SubtreeStats::operator delete(void* p, size_t size) {
+    UCTNodePointer::decrement_tree_size(size);
+    NodePool::deallocate(p, size);
+}
+
+void* UCTNode::SubtreeStats::Shard::operator new(size_t size) {
+    UCTNodePointer::increment_tree_size(size);
+    return NodePool::allocate(size);
+}
+
+void UCTNode::SubtreeStats::Shard::operator delete(void* p, size_t size) {
+    UCTNodePointer::decrement_tree_size(size);
+    NodePool::deallocate(p, size);
+}
+
+UCTNode::SubtreeStats::SubtreeStats(const SubtreeSummary& summary) {
+    reset(summary);
+}
+
+UCTNode::SubtreeStats::~SubtreeStats() {
+    for (auto& shard : shards) {
+        delete shard.load();
+    }
+    UCTNodePointer::decrement_tree_size(pruned.size() * sizeof(pruned[0]));
+}
+
+template <typename F>
+void UCTNode::SubtreeStats::update(F&& update) {
+    for (auto& slot : shards) {
+        auto shard = slot.load();
+        if (!shard) {
+            auto fresh = new Shard;
+            if (slot.compare_exchange_strong(shard, fresh)) {
+                shard = fresh;
+            } else {
+                delete fresh;
+            }
+        }
+        SMP::Lock lock(shard->mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            update(shard->summary);
+            return;
+        }
+    }
+    // More threads than shards are here, wait for one.
+    auto& shard = *shards.back().load();
+    LOCK(shard.mutex, lock);
+    update(shard.summary);
+}
+
+UCTNode::SubtreeSummary UCTNode::SubtreeStats::merge_shards() const {
+    auto summary = SubtreeSummary{};
+    for (const auto& slot : shards) {
+        if (const auto shard = slot.load()) {
+            LOCK(shard->mutex, lock);
+            summary.merge(shard->summary);
         }
     }
+    return summary;
+}
 
-    const auto missing_nodes = get_visits() - children_visits - 1;
-    if (missing_nodes > 0 && is_tromptaylor_scoring) {
-        // check: this seems to happen only on second pass node, where
-        // get_net_alpkt() would return a meningless value
+void UCTNode::SubtreeStats::reset(const SubtreeSummary& summary) {
+    auto first = shards[0].load();
+    if (!first) {
+        first = new Shard;
+        shards[0] = first;
+    }
+    first->summary = summary;
+    for (auto i = size_t{1}; i < SHARDS; i++) {
+        delete shards[i].exchange(nullptr);
+    }
+}
 
-        const std::vector<float> rep(missing_nodes, get_net_alpkt());
-        vector.insert(vector.end(), std::begin(rep), std::end(rep));
+bool UCTNode::SubtreeStats::is_pruned(const int move) const {
+    return std::any_of(begin(pruned), end(pruned),
+        [move](const Pruned& record) {
+            return record.move == move;
+        });
+}
+
+UCTNode::SubtreeStats* UCTNode::get_subtree_stats() {
+    auto stats = m_subtree.load();
+    if (!stats) {
+        auto fresh = new SubtreeStats(compute_subtree_summary());
+        if (m_subtree.compare_exchange_strong(stats, fresh)) {
+            stats = fresh;
+        } else {
+            delete fresh;
+        }
     }
+    return stats;
+}
 
-    return;
+size_t UCTNode::get_subtree_stats_size() const {
+    const auto stats = m_subtree.load();
+    if (!stats) {
+        return 0;
+    }
+    auto size = sizeof(SubtreeStats)
+        + stats->pruned.size() * sizeof(stats->pruned[0]);
+    for (const auto& shard : stats->shards) {
+        if (shard.load()) {
+            size += sizeof(SubtreeStats::Shard);
+        }
+    }
+    return size;
 }
 
-float UCTNode::estimate_alpkt(int passes,
-                              bool is_tromptaylor_scoring) const {
-    std::vector<float> subtree_alpkts;
+size_t UCTNode::get_pruned_record_size(const int move) const {
+    const auto stats = m_subtree.load();
+    if (stats && stats->is_pruned(move)) {
+        return 0;
+    }
+    return sizeof(SubtreeStats::Pruned);
+}
 
-    get_subtree_alpkts(subtree_alpkts, passes, is_tromptaylor_scoring);
+size_t UCTNode::get_new_stats_size() {
+    return sizeof(SubtreeStats) + sizeof(SubtreeStats::Shard);
+}
 
-    return Utils::median(subtree_alpkts);
+bool UCTNode::add_subtree_node(const int move, const float net_eval,
+                               const float net_alpkt, const float net_beta) {
+    const auto stats = m_subtree.load();
+    if (!stats) {
+        return true;
+    }
+    // The records only change with the search stopped.
+    if (stats->is_pruned(move)) {
+        return false;
+    }
+    stats->update([=](SubtreeSummary& summary) {
+        summary.add_node(net_eval, net_alpkt, net_beta);
+    });
+    return true;
 }
 
-void UCTNode::get_subtree_betas(std::vector<float> & vector) const {
-    vector.emplace_back(get_net_beta());
-    for (auto& child : m_children) {
-        if (child.get_visits() > 0) {
-            child->get_subtree_betas(vector);
-        }
+bool UCTNode::add_subtree_ending(const int move, const float net_alpkt) {
+    const auto stats = m_subtree.load();
+    if (!stats) {
+        return true;
+    }
+    if (stats->is_pruned(move)) {
+        return false;
     }
+    add_subtree_ending(net_alpkt);
+    return true;
 }
 
-float UCTNode::get_beta_median() const {
-    std::vector<float> subtree_betas;
+void UCTNode::add_subtree_ending(const float net_alpkt) {
+    if (const auto stats = m_subtree.load()) {
+        stats->update([=](SubtreeSummary& summary) {
+            summary.endings.add(net_alpkt);
+        });
+    }
+}
 
-    get_subtree_betas(subtree_betas);
+void UCTNode::set_terminal() {
+    m_terminal = true;
+}
 
-    return Utils::median(subtree_betas);
+void UCTNode::SubtreeSummary::add_node(const float net_eval,
+                                       const float net_alpkt,
+                                       const float net_beta) {
+    eval_sum += net_eval;
+    nodes++;
+    betas.add(net_beta);
+    alpkts.add(net_alpkt);
 }
 
-void UCTNode::az_sum_recursion(float& sum, size_t& n) const {
-    sum += get_net_eval();
-    n++;
-    for (auto& child : m_children) {
-        if (child.get_visits() > 0) {
-            child->az_sum_recursion(sum, n);
+void UCTNode::SubtreeSummary::merge(const SubtreeSummary& other) {
+    eval_sum += other.eval_sum;
+    nodes += other.nodes;
+    betas.merge(other.betas);
+    alpkts.merge(other.alpkts);
+    endings.merge(other.endings);
+}
+
+UCTNode::SubtreeSummary UCTNode::get_subtree_summary() const {
+    if (const auto stats = m_subtree.load()) {
+        return stats->merge_shards();
+    }
+    return compute_subtree_summary();
+}
+
+UCTNode::SubtreeSummary UCTNode::compute_subtree_summary() const {
+    auto summary = SubtreeSummary{};
+    const auto visits = get_visits();
+    if (visits > 0) {
+        summary.add_node(m_net_eval, m_net_alpkt, m_net_beta);
+        // One by one as update() adds them, the sketch spreads the
+        // weight of a value around it.
+        if (m_terminal) {
+            for (auto i = 1; i < visits; i++) {
+                summary.endings.add(m_net_alpkt);
+            }
         }
     }
+    if (has_children()) {
+        for (const auto& child : m_children) {
+            if (child.is_inflated() && child.get_visits() > 0) {
+                summary.merge(child->get_subtree_summary());
+            }
+        }
+    }
+    return summary;
+}
+
+void UCTNode::keep_pruned_subtree(const UCTNode& child) {
+    const auto move = child.get_move();
+    const auto visits = child.get_visits();
+    const auto blackevals = child.m_blackevals.load();
+    // The sum of the squares from the sum of the squared differences
+    // from the mean, see update().
+    const auto sum = from_fixed(blackevals);
+    const auto squared_evals = visits > 0 ?
+        to_fixed(from_fixed(child.m_squared_eval_diff) + sum * sum / visits) :
+        std::int64_t{0};
+
+    // Created, if needed, while the subtree of child is still there,
+    // and go on counting it.
+    const auto stats = get_subtree_stats();
+    auto& records = stats->pruned;
+    const auto record = std::find_if(begin(records), end(records),
+        [move](const SubtreeStats::Pruned& pruned) {
+            return pruned.move == move;
+        });
+    if (record == end(records)) {
+        records.push_back({move, visits, blackevals, squared_evals});
+        UCTNodePointer::increment_tree_size(sizeof(records.back()));
+    } else {
+        // Different simulations, through the same positions.
+        record->visits += visits;
+        record->blackevals += blackevals;
+        record->squared_evals += squared_evals;
+    }
 }
 
-float UCTNode::get_azwinrate_avg() const {
-    auto sum = 0.0f;
-    auto n = size_t{0};
+float UCTNode::get_beta_median() const {
+    return get_beta_median(get_subtree_summary());
+}
 
-    az_sum_recursion(sum, n);
+float UCTNode::get_beta_median(const SubtreeSummary& summary) const {
+    if (summary.nodes == 0) {
+        return get_net_beta();
+    }
+    return summary.betas.median();
+}
 
-    return static_cast<float>(sum / double(n));
+float UCTNode::get_azwinrate_avg() const {
+    return get_azwinrate_avg(get_subtree_summary());
+}
+
+float UCTNode::get_azwinrate_avg(const SubtreeSummary& summary) const {
+    if (summary.nodes == 0) {
+        return get_net_eval();
+    }
+    return static_cast<float>(summary.eval_sum / double(summary.nodes));
 }
 
 UCTStats UCTNode::get_uct_stats() const {
     UCTStats stats;
 
+    // One walk of the tree for both.
+    const auto summary = get_subtree_summary();
     stats.alpkt_online_median = m_alpkt_median;
-    stats.beta_median = get_beta_median();
-    stats.azwinrate_avg = get_azwinrate_avg();
+    stats.beta_median = get_beta_median(summary);
+    stats.azwinrate_avg = get_azwinrate_avg(summary);
     return stats;
 }
 
+void UCTNode::change_komi(const float komi_delta, const bool is_sai,
+                          const int passes, const bool tromp_taylor) {
+    const auto change = KomiChange{komi_delta, is_sai, tromp_taylor};
+    const auto weight = begin_komi_change(change, passes);
+    add_komi_change_evals(change, {this}, weight);
+
+    // The subtrees of the children only share the root.
+    ThreadGroup tg(thread_pool);
+    for (auto& child : m_children) {
+        if (child.get_visits() == 0) {
+            continue;
+        }
+        const auto node = child.get();
+        const auto child_passes =
+            node->get_move() == FastBoard::PASS ? passes + 1 : 0;
+        tg.add_task([this, node, change, child_passes]() {
+            auto path = std::vector<UCTNode*>{this};
+            node->change_komi_subtree(change, child_passes, path);
+        });
+    }
+    tg.wait_all();
+
+    end_komi_change();
+}
+
+void UCTNode::change_komi_subtree(const KomiChange& change, const int passes,
+                                  std::vector<UCTNode*>& path) {
+    const auto weight = begin_komi_change(change, passes);
+    path.emplace_back(this);
+    add_komi_change_evals(change, path, weight);
+    for (auto& child : m_children) {
+        if (child.get_visits() == 0) {
+            continue;
+        }
+        const auto node = child.get();
+        node->change_komi_subtree(
+            change, node->get_move() == FastBoard::PASS ? passes + 1 : 0, path);
+    }
+    path.pop_back();
+    end_komi_change();
+}
+
+int UCTNode::begin_komi_change(const KomiChange& change, const int passes) {
+    // alpkt is alpha minus the komi from the point of view of black,
+    // and so are the board scores of the terminal nodes.
+    m_net_alpkt = m_net_alpkt - change.delta;
+    m_alpkt_median = m_alpkt_median - change.delta;
+    if (passes >= 2 && change.tromp_taylor) {
+        m_net_eval = Utils::winner(m_net_alpkt);
+    } else if (change.is_sai) {
+        const auto result_extended =
+            Network::get_extended(m_net_alpkt, m_net_beta);
+        m_net_eval = result_extended.pi;
+        // Terminal nodes are never expanded and keep their bonuses.
+        if (passes < 2) {
+            m_eval_bonus = result_extended.eval_bonus;
+            m_eval_base = result_extended.eval_base;
+            m_agent_eval = result_extended.agent_eval;
+        }
+    }
+
+    // The children see the new bonuses from their father.
+    auto children_visits = 0;
+    for (auto& child : m_children) {
+        const auto visits = child.get_visits();
+        if (visits > 0) {
+            child->set_eval_bonus_father(m_eval_bonus);
+            child->set_eval_base_father(m_eval_base);
+            children_visits += visits;
+        } else if (child.is_inflated()) {
+            // Not walked by change_komi(), but given an entry before
+            // its evaluation failed or was interrupted.
+            child->clear_tt_entries();
+        }
+    }
+    if (const auto stats = m_subtree.load()) {
+        for (const auto& pruned : stats->pruned) {
+            children_visits += pruned.visits;
+        }
+    }
+
+    // Accumulate the sum and the sum of squares of the evaluations
+    // backed up here, until end_komi_change().
+    m_blackevals = 0;
+    m_squared_eval_diff = 0;
+    if (const auto entry = m_tt_entry.exchange(nullptr)) {
+        TTable::release(entry);
+    }
+
+    // Number of simulations which ended at this node.
+    return std::max(0, get_visits() - children_visits);
+}
+
+void UCTNode::clear_tt_entries() {
+    if (const auto entry = m_tt_entry.exchange(nullptr)) {
+        TTable::release(entry);
+    }
+    for (auto& child : m_children) {
+        if (child.is_inflated()) {
+            child->clear_tt_entries();
+        }
+    }
+}
+
+void UCTNode::add_komi_change_evals(const KomiChange& change,
+                                    const std::vector<UCTNode*>& path,
+                                    const int weight) const {
+    const auto stats = m_subtree.load();
+    for (const auto node : path) {
+        // What play_simulation() backs up to each node of the path.
+        if (weight > 0) {
+            const auto eval = change.is_sai ?
+                Utils::sigmoid_interval_avg(m_net_alpkt, m_net_beta,
+                                            node->get_eval_base_father(),
+                                            node->get_eval_bonus_father()) :
+                m_net_eval;
+            // As weight calls of accumulate_eval(), to the last bit.
+            node->m_blackevals += weight * to_fixed(eval);
+            node->m_squared_eval_diff +=
+                weight * to_fixed(double(eval) * eval);
+        }
+        // The simulations through the pruned children keep what they
+        // backed up to this node.
+        if (stats) {
+            for (const auto& pruned : stats->pruned) {
+                node->m_blackevals += pruned.blackevals;
+                node->m_squared_eval_diff += pruned.squared_evals;
+            }
+        }
+    }
+}
+
+void UCTNode::end_komi_change() {
+    const auto visits = get_visits();
+    if (visits > 0) {
+        const auto sum = get_blackevals();
+        const auto squares = from_fixed(m_squared_eval_diff);
+        m_squared_eval_diff = to_fixed(
+            1e-4 + std::max(0.0, squares - sum * sum / visits));
+    } else {
+        m_squared_eval_diff = to_fixed(1e-4);
+    }
+
+    // Computed again from the new values, those of the children are
+    // done.
+    if (const auto stats = m_subtree.load()) {
+        stats->reset(compute_subtree_summary());
+    }
+}
+
 std::tuple<float, float, float> UCTNode::score_stats() const {
     const auto alpkt_for_score = get_alpkt_online_median();
     const auto beta_for_score = get_net_beta();
@@ -42,6 +42,9 @@
 
 #include "GameState.h"
 #include "Network.h"
+#include "NodePool.h"
+#include "QuantileSketch.h"
+#include "TTable.h"
 #include "SMP.h"
 #include "UCTNodePointer.h"
 #include "UCTSearch.h"
@@ -53,15 +56,30 @@ struct UCTStats {
 };
 
 class UCTNode {
+    friend class LeelaTest;
+
 public:
     // When we visit a node, add this amount of virtual losses
     // to it to encourage other CPUs to explore other parts of the
     // search tree.
     static constexpr auto VIRTUAL_LOSS_COUNT = 3;
+    // Descents which can hold their virtual loss on a node at once,
+    // see m_counts.
+    static constexpr auto MAX_DESCENTS = ((1 << 14) - 1) / VIRTUAL_LOSS_COUNT;
     // Defined in UCTNode.cpp
     explicit UCTNode(int vertex, float policy);
     UCTNode() = delete;
-    ~UCTNode() = default;
+    ~UCTNode();
+
+    // Nodes and their children arrays come from the NodePool.
+    static void* operator new(size_t size) {
+        return NodePool::allocate(size);
+    }
+    static void operator delete(void* p, size_t size) {
+        NodePool::deallocate(p, size);
+    }
+    using ChildrenList =
+        std::vector<UCTNodePointer, NodePool::Allocator<UCTNodePointer>>;
 
     bool create_children(Network & network,
                          std::atomic<int>& nodecount,
@@ -69,7 +87,7 @@ public:
                                      float& beta,
                          float min_psa_ratio = 0.0f);
 
-    const std::vector<UCTNodePointer>& get_children() const;
+    const ChildrenList& get_children() const;
     void sort_children_by_policy();
     void sort_children(int color, float lcb_min_visits);
     UCTNode& get_best_root_child(int color);
@@ -78,7 +96,9 @@ public:
                               const std::vector<int> & move_list,
                               bool nopass = false);
 
-    size_t count_nodes_and_clear_expand_state();
+    // With parallel, the subtrees of the children are walked on the
+    // thread pool.
+    size_t count_nodes_and_clear_expand_state(bool parallel = false);
     bool first_visit() const;
     bool has_children() const;
     bool expandable(const float min_psa_ratio = 0.0f) const;
@@ -94,6 +114,13 @@ public:
     void set_policy(float policy);
     float get_eval_variance(float default_var = 0.0f) const;
     float get_eval(int tomove) const;
+    // Winrate to select this node with, shared with the transpositions
+    // of the node if it has a TTable entry.
+    float get_select_eval(int tomove) const;
+    bool has_tt_entry() const;
+    // Link the node to its entry, unless another thread did. The visits
+    // the node had before are added to the entry.
+    void set_tt_entry(TTable::Entry* entry);
     float get_raw_eval(int tomove, int virtual_loss = 0) const;
     float get_net_eval(int tomove) const;
     float get_agent_eval(int tomove) const;
@@ -118,11 +145,14 @@ public:
                      float num, float den);
     std::array<float, 5> get_urgency() const;
 #endif
-    void virtual_loss();
+    // Returns false, adding nothing, if the node already holds the
+    // virtual loss of MAX_DESCENTS descents.
+    bool virtual_loss();
     void virtual_loss_undo();
     void clear_visits();
     void clear_children_visits();
-    void update(float eval, bool forced=false);
+    // Returns true on the first visit of the node.
+    bool update(float eval, bool forced=false);
     float get_eval_lcb(int color) const;
 
     // Defined in UCTNodeRoot.cpp, only to be called on m_root in UCTSearch
@@ -147,11 +177,61 @@ public:
     float get_beta_median() const;
     float get_azwinrate_avg() const;
     UCTStats get_uct_stats() const;
+    // Add to the statistics of the subtree, if the node keeps them, a
+    // node visited for the first time, with its network outputs, or a
+    // simulation which ended again at a terminal node, with its alpkt,
+    // below the child with the given move. Return false if that child
+    // was pruned: the positions it goes through are counted already,
+    // here and in the ancestors.
+    bool add_subtree_node(int move, float net_eval,
+                          float net_alpkt, float net_beta);
+    bool add_subtree_ending(int move, float net_alpkt);
+    // Two passes were played before this node, which was scored.
+    void set_terminal();
+    // Keep the statistics of the subtree of child, which is about
+    // to be pruned, and the sums of the evaluations it backed up. The
+    // search must be stopped.
+    void keep_pruned_subtree(const UCTNode& child);
+    // Memory allocated for the statistics of the subtree, which is
+    // part of UCTNodePointer::get_tree_size().
+    size_t get_subtree_stats_size() const;
+    // Memory keep_pruned_subtree() adds for a child with the given
+    // move. A node without statistics also gets them, once, which adds
+    // get_new_stats_size().
+    size_t get_pruned_record_size(int move) const;
+    static size_t get_new_stats_size();
     void update_alpkt_median(float new_alpkt_value, float new_beta_value);
     std::tuple<float, float, float> score_stats() const;
 
     void clear_expand_state();
+
+    // Re-derive the komi dependent values of the tree after the komi
+    // changed by komi_delta, as if it had been searched with the new
+    // komi, without evaluating positions again. passes is the number
+    // of passes before this node, tromp_taylor whether two passes are
+    // scored by the board. All the nodes lose their TTable entries,
+    // which are for the old komi. Only to be called on the root, the
+    // subtrees of the children are done in parallel, and not on trees
+    // searched with cfg_restrict_tt. The simulations through pruned
+    // subtrees keep the evaluations they backed up to the parent of
+    // the subtree, see collect_tree().
+    void change_komi(float komi_delta, bool is_sai, int passes,
+                     bool tromp_taylor);
 private:
+    struct KomiChange {
+        float delta;
+        bool is_sai;
+        bool tromp_taylor;
+    };
+    int begin_komi_change(const KomiChange& change, int passes);
+    void add_komi_change_evals(const KomiChange& change,
+                               const std::vector<UCTNode*>& path,
+                               int weight) const;
+    void change_komi_subtree(const KomiChange& change, int passes,
+                             std::vector<UCTNode*>& path);
+    void end_komi_change();
+    // Unlink the subtree from its entries.
+    void clear_tt_entries();
     enum Status : char {
         INVALID, // superko
         PRUNED,
@@ -161,25 +241,36 @@ private:
                        std::vector<Network::PolicyVertexPair>& nodelist,
                        float min_psa_ratio);
     void accumulate_eval(float eval);
+    float compute_eval(int tomove, int visits, int virtual_loss) const;
     void kill_superkos(const GameState& state);
     void dirichlet_noise(float epsilon, float alpha);
-    void get_subtree_alpkts(std::vector<float> & vector, int passes,
-                            bool is_tromptaylor_scoring) const;
-    void get_subtree_betas(std::vector<float> & vector) const;
-    void az_sum_recursion(float& sum, size_t& n) const;
 
     // Note : This class is very size-sensitive as we are going to create
     // tens of millions of instances of these.  Please put extra caution
     // if you want to add/remove/reorder any variables here.
 
-    // Move
-    std::int16_t m_move;
-    // UCT
-    std::atomic<std::int16_t> m_virtual_loss{0};
-    std::atomic<int> m_visits{0};
-    // number of forced moves visited after this node, to be
-    // subtracted from visits in the denominator of psa
-    std::atomic<int> m_forced{0};
+    // UCT: visits, number of forced moves visited after this node (to
+    // be subtracted from visits in the denominator of psa) and virtual
+    // losses, packed in one word so that a simulation changes them with
+    // one atomic operation and readers get them together.
+    // Bits [63:32] are the visits, [31:14] the forced visits, which
+    // saturate, and [13:0] the virtual losses.
+    static constexpr auto VISITS_SHIFT = 32;
+    static constexpr auto FORCED_SHIFT = 14;
+    static constexpr auto MAX_FORCED = (1 << (VISITS_SHIFT - FORCED_SHIFT)) - 1;
+    static constexpr auto MAX_VIRTUAL_LOSS = (1 << FORCED_SHIFT) - 1;
+    static_assert(MAX_DESCENTS * VIRTUAL_LOSS_COUNT <= MAX_VIRTUAL_LOSS,
+                  "the virtual losses of MAX_DESCENTS overflow");
+    static int visits_of(std::uint64_t counts) {
+        return static_cast<int>(counts >> VISITS_SHIFT);
+    }
+    static int forced_of(std::uint64_t counts) {
+        return static_cast<int>(counts >> FORCED_SHIFT) & MAX_FORCED;
+    }
+    static int virtual_loss_of(std::uint64_t counts) {
+        return static_cast<int>(counts) & MAX_VIRTUAL_LOSS;
+    }
+    std::atomic<std::uint64_t> m_counts{0};
     // UCT eval
     float m_policy;
     // Original net eval for this node (not children).
@@ -204,15 +295,106 @@ private:
 
     // the following is used only in fpu, with reduction
     float m_agent_eval{0.5f}; // eval_with_bonus(eval_bonus()) no father
+    // The sums of evaluations are kept in fixed point, with EVAL_SCALE
+    // units per 1.0, which atomics add in one operation, without the
+    // compare and swap loops of floating point.
+    static constexpr auto EVAL_SCALE = 4294967296.0; // 2^32
+    static std::int64_t to_fixed(double x) {
+        return static_cast<std::int64_t>(x * EVAL_SCALE);
+    }
+    static double from_fixed(std::int64_t x) {
+        return static_cast<double>(x) / EVAL_SCALE;
+    }
     // Variable used for calculating variance of evaluations.
     // Initialized to small non-zero value to avoid accidental zero variances
     // at low visits.
-    std::atomic<float> m_squared_eval_diff{1e-4f};
-    std::atomic<double> m_blackevals{0.0};
+    std::atomic<std::int64_t> m_squared_eval_diff{
+        static_cast<std::int64_t>(1e-4 * EVAL_SCALE)};
+    std::atomic<std::int64_t> m_blackevals{0};
     std::atomic<Status> m_status{ACTIVE};
+    // Here to fill the padding of m_status.
+    std::atomic<bool> m_terminal{false};
+    std::int16_t m_move;
 
     std::atomic<float> m_alpkt_median{0.0f};
 
+    // Shared statistics of the position, if transpositions are used.
+    std::atomic<TTable::Entry*> m_tt_entry{nullptr};
+
+    // Network outputs of the visited nodes of a subtree, and alpkt of
+    // the simulations which ended again at one of its terminal nodes.
+    struct SubtreeSummary {
+        double eval_sum{0.0};
+        int nodes{0};
+        QuantileSketch betas;
+        QuantileSketch alpkts;
+        QuantileSketch endings;
+
+        void add_node(float net_eval, float net_alpkt, float net_beta);
+        void merge(const SubtreeSummary& other);
+    };
+    // Merged from the statistics if the node keeps them, computed
+    // from the subtree otherwise.
+    SubtreeSummary get_subtree_summary() const;
+    // This node and the summaries of its children.
+    SubtreeSummary compute_subtree_summary() const;
+
+    float get_beta_median(const SubtreeSummary& summary) const;
+    float get_azwinrate_avg(const SubtreeSummary& summary) const;
+
+    // Statistics of the subtree, this node included, kept only by the
+    // parents of pruned subtrees, whose nodes can't be walked anymore.
+    // play_simulation() adds to them as it backs up, reading them only
+    // merges their shards. The other nodes walk their subtree when
+    // their statistics are asked for, a few times per move for the
+    // training record and the choice of the move, so that the backups
+    // of the search don't pay for them.
+    struct SubtreeStats {
+        // Threads backing up through the node at the same time add to
+        // different shards, each with its own lock. A shard is only
+        // allocated when all the others are held, so that most nodes
+        // have one.
+        struct Shard {
+            SMP::Mutex mutex;
+            SubtreeSummary summary;
+
+            static void* operator new(size_t size);
+            static void operator delete(void* p, size_t size);
+        };
+        static constexpr auto SHARDS = 8;
+        std::array<std::atomic<Shard*>, SHARDS> shards{};
+        // A pruned child, with what it backed up. A child searched
+        // again after being pruned adds to the same record when it is
+        // pruned again.
+        struct Pruned {
+            int move;
+            int visits;
+            // Fixed point sums of the evaluations and their squares.
+            std::int64_t blackevals;
+            std::int64_t squared_evals;
+        };
+        std::vector<Pruned> pruned;
+
+        explicit SubtreeStats(const SubtreeSummary& summary);
+        ~SubtreeStats();
+        // Call update with the summary of a shard no other thread holds.
+        template <typename F>
+        void update(F&& update);
+        SubtreeSummary merge_shards() const;
+        // Replace the shards by one with summary.
+        void reset(const SubtreeSummary& summary);
+        bool is_pruned(int move) const;
+
+        static void* operator new(size_t size);
+        static void operator delete(void* p, size_t size);
+    };
+    // Created from the subtree if needed. A node visited for the first
+    // time by another thread meanwhile may be counted twice.
+    SubtreeStats* get_subtree_stats();
+    // A simulation ended again at this terminal node.
+    void add_subtree_ending(float net_alpkt);
+    std::atomic<SubtreeStats*> m_subtree{nullptr};
+
     // m_expand_state acts as the lock for m_children.
     // see manipulation methods below for possible state transition
     enum class ExpandState : std::uint8_t {
@@ -232,7 +414,7 @@ private:
 
     // Tree data
     std::atomic<float> m_min_psa_ratio_children{2.0f};
-    std::vector<UCTNodePointer> m_children;
+    ChildrenList m_children;
 
     //  m_expand_state manipulation methods
     // INITIAL -> EXPANDING
@@ -74,13 +74,18 @@ UCTNodePointer::UCTNodePointer(UCTNodePointer&& n) {
     increment_tree_size(sizeof(UCTNodePointer));
 }
 
-UCTNodePointer::UCTNodePointer(std::int16_t vertex, float policy) {
+std::uint64_t UCTNodePointer::make_uninflated(std::int16_t vertex,
+                                              float policy) {
     std::uint32_t i_policy;
     auto i_vertex = static_cast<std::uint16_t>(vertex);
     std::memcpy(&i_policy, &policy, sizeof(i_policy));
 
-    m_data =  (static_cast<std::uint64_t>(i_policy) << 32)
-            | (static_cast<std::uint64_t>(i_vertex) << 16);
+    return (static_cast<std::uint64_t>(i_policy) << 32)
+         | (static_cast<std::uint64_t>(i_vertex) << 16);
+}
+
+UCTNodePointer::UCTNodePointer(std::int16_t vertex, float policy) {
+    m_data = make_uninflated(vertex, policy);
     increment_tree_size(sizeof(UCTNodePointer));
 }
 
@@ -122,6 +127,15 @@ void UCTNodePointer::inflate() const {
     }
 }
 
+UCTNode * UCTNodePointer::deflate() const {
+    auto v = m_data.load();
+    auto node = read_ptr(v);
+    m_data = make_uninflated(static_cast<std::int16_t>(node->get_move()),
+                             node->get_policy());
+    decrement_tree_size(sizeof(UCTNode));
+    return node;
+}
+
 bool UCTNodePointer::valid() const {
     auto v = m_data.load();
     if (is_inflated(v)) return read_ptr(v)->valid();
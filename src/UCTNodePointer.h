@@ -60,8 +60,6 @@ private:
     static constexpr std::uint64_t UNINFLATED = 0;
 
     static std::atomic<size_t> m_tree_size;
-    static void increment_tree_size(size_t sz);
-    static void decrement_tree_size(size_t sz);
 
     // the raw storage used here.
     // if bit [1:0] is 1, m_data is the actual pointer.
@@ -95,8 +93,13 @@ private:
         return (v & 3ULL) == POINTER;
     }
 
+    static std::uint64_t make_uninflated(std::int16_t vertex, float policy);
+
 public:
     static size_t get_tree_size();
+    // Also for the memory the nodes allocate besides themselves.
+    static void increment_tree_size(size_t sz);
+    static void decrement_tree_size(size_t sz);
 
     ~UCTNodePointer();
     UCTNodePointer(UCTNodePointer&& n);
@@ -124,6 +127,11 @@ public:
     // construct UCTNode instance from the vertex/policy pair
     void inflate() const;
 
+    // go back to the vertex/policy pair of the UCTNode instance and
+    // return it, the caller owns it. This is the opposite of inflate()
+    // and it is only safe when no other thread uses the pointer.
+    UCTNode * deflate() const;
+
     // proxy of UCTNode methods which can be called without
     // constructing UCTNode
     bool valid() const;
@@ -33,6 +33,7 @@
 
 #include <boost/format.hpp>
 #include <boost/scope_exit.hpp>
+#include <array>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
@@ -124,6 +125,11 @@ UCTSearch::UCTSearch(GameState& g, Network& network)
     set_visit_limit(cfg_max_visits);
 
     m_root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f);
+
+    if (cfg_transpositions) {
+        m_ttable = std::make_unique<TTable>(
+            std::max(cfg_max_ttable_size / sizeof(TTable::Entry), size_t{1}));
+    }
 }
 
 void UCTSearch::reset() {
@@ -141,7 +147,14 @@ bool UCTSearch::advance_to_new_rootstate() {
         return false;
     }
 
-    if (m_rootstate.get_komi() != m_last_rootstate->get_komi()) {
+    // The tree can be kept for another komi, unless the network takes
+    // it into account for the policy, or the first passes were backed
+    // up with their own evaluation (see update_with_current in
+    // play_simulation()), which UCTNode::change_komi() can't tell from
+    // the simulations which ended there.
+    const auto komi_delta =
+        m_rootstate.get_komi() - m_last_rootstate->get_komi();
+    if (komi_delta != 0.0f && (m_network.m_komi_policy || cfg_restrict_tt)) {
         return false;
     }
 
@@ -202,6 +215,12 @@ bool UCTSearch::advance_to_new_rootstate() {
         return false;
     }
 
+    if (komi_delta != 0.0f) {
+        m_root->change_komi(komi_delta, m_network.m_value_head_sai,
+                            m_rootstate.get_passes(),
+                            !(cfg_japanese_mode && m_chn_scoring));
+    }
+
     return true;
 }
 
@@ -217,12 +236,11 @@ void UCTSearch::update_root(bool is_evaluating) {
     if ( (!advance_to_new_rootstate() && !is_evaluating) || !m_root) {
         m_root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f);
     }
-
     // Clear last_rootstate to prevent accidental use.
     m_last_rootstate.reset(nullptr);
 
     // Check how big our search tree (reused or new) is.
-    m_nodes = m_root->count_nodes_and_clear_expand_state();
+    m_nodes = m_root->count_nodes_and_clear_expand_state(true);
 
     #ifndef NDEBUG
     if (m_nodes > 0) {
@@ -254,6 +272,7 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
                                         UCTNode* const node) {
     auto result = SearchResult{};
     auto new_node = false;
+    auto terminal = false;
 
 #ifndef NDEBUG
     sim_node_info sminfo;
@@ -261,15 +280,19 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
     sminfo.visits = node->get_visits();
 #endif
 
-    node->virtual_loss();
+    const auto virtual_loss = node->virtual_loss();
 
     // This will undo virtual loss even if something throws an exception.
-    BOOST_SCOPE_EXIT(node) {
-        node->virtual_loss_undo();
+    BOOST_SCOPE_EXIT(node, virtual_loss) {
+        if (virtual_loss) {
+            node->virtual_loss_undo();
+        }
     } BOOST_SCOPE_EXIT_END
 
     if (node->expandable()) {
         if (currstate.get_passes() >= 2) {
+            terminal = true;
+            node->set_terminal();
             if (cfg_japanese_mode && m_chn_scoring) {
                 result = SearchResult::from_eval(node->get_net_eval(),
                                                  node->get_net_alpkt(),
@@ -308,6 +331,9 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
                 }
 #endif
                 result = SearchResult::from_eval(value, alpkt, beta);
+                result.set_new_node(node->get_net_eval(),
+                                    node->get_net_alpkt(),
+                                    node->get_net_beta());
                 new_node = true;
 #ifndef NDEBUG
                 sminfo.leafstr = "new";
@@ -328,35 +354,51 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
     auto update_with_current = false;
 
     if (node->has_children() && !result.valid()) {
-        auto next = node->uct_select_child(currstate,
-                                           node == m_root.get(),
-                                           m_per_node_maxvisits,
-                                           m_allowed_root_children,
-                                           m_nopass);
+        const auto passes = currstate.get_passes();
+        auto superko = false;
+        auto next = descend(currstate, *node, superko);
         if (next != nullptr) {
             auto move = next->get_move();
             next->set_eval_bonus_father(node->get_eval_bonus());
             next->set_eval_base_father(node->get_eval_base());
 
             restrict_return = (cfg_restrict_tt &&
-                               currstate.get_passes() == 1 &&
+                               passes == 1 &&
                                move == FastBoard::PASS);
 
-            currstate.play_move(move);
-            if (move != FastBoard::PASS && currstate.superko()) {
+            if (superko) {
                 next->invalidate();
             } else {
-                const auto allowed = m_allowed_root_children;
-                m_allowed_root_children = {};
-                if (m_nopass) {
-                    currstate.set_passes(0);
+                // A node that found no room in the table tries again
+                // with exponential back-off, at 1, 2, 4... visits.
+                const auto visits = next->get_visits();
+                if (m_ttable && !next->has_tt_entry()
+                    && (visits & (visits - 1)) == 0) {
+                    const auto key = TTable::get_key(
+                        currstate.board.get_hash(),
+                        currstate.get_komi(),
+                        next->get_eval_bonus_father(),
+                        next->get_eval_base_father());
+                    next->set_tt_entry(m_ttable->get_entry(key));
                 }
                 result = play_simulation(currstate, next);
                 if (currstate.board.last_forced()) {
                     result.set_forced();
                 }
+                if (result.has_new_node()) {
+                    if (!node->add_subtree_node(move,
+                                                result.get_leaf_eval(),
+                                                result.get_leaf_alpkt(),
+                                                result.get_leaf_beta())) {
+                        result.clear_leaf();
+                    }
+                } else if (result.has_revisit()) {
+                    if (!node->add_subtree_ending(move,
+                                                  result.get_leaf_alpkt())) {
+                        result.clear_leaf();
+                    }
+                }
 
-                m_allowed_root_children = allowed;
                 if (m_stopping_flag && node == m_root.get()) {
                     m_bestmove = move;
                 }
@@ -374,6 +416,7 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
     auto current_node_result = SearchResult::from_eval(node->get_net_eval(),
                                                        node->get_net_alpkt(),
                                                        node->get_net_beta());
+    current_node_result.copy_leaf(result);
 
     // New node was updated in create_children.
     if (result.valid() && !new_node) {
@@ -399,7 +442,15 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
             result_for_updating.eval_with_bonus(node->get_eval_bonus_father(),
                                                 node->get_eval_base_father()) :
             result_for_updating.eval();
-        node->update(eval, result.is_forced());
+        if (node->update(eval, result.is_forced())) {
+            // Only a leaf can be visited for the first time here.
+            result.set_new_node(node->get_net_eval(),
+                                node->get_net_alpkt(),
+                                node->get_net_beta());
+        } else if (terminal) {
+            // update() counted it in the statistics of the node.
+            result.set_revisit(node->get_net_alpkt());
+        }
         // should check whether it is sai or lz before updating alpkt_median
         node->update_alpkt_median(result_for_updating.get_alpkt(), result_for_updating.get_beta());
 
@@ -432,6 +483,25 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
     return update_with_current ? current_node_result : result;
 }
 
+UCTNode* UCTSearch::descend(GameState& currstate, UCTNode& node,
+                            bool& superko) {
+    static const auto no_restriction = std::vector<int>{};
+    const auto is_root = (&node == m_root.get());
+    const auto next = node.uct_select_child(
+        currstate, is_root, m_per_node_maxvisits,
+        is_root ? m_allowed_root_children : no_restriction, m_nopass);
+    if (next == nullptr) {
+        return nullptr;
+    }
+    const auto move = next->get_move();
+    currstate.play_move(move);
+    superko = (move != FastBoard::PASS && currstate.superko());
+    if (!superko && m_nopass) {
+        currstate.set_passes(0);
+    }
+    return next;
+}
+
 void UCTSearch::dump_stats(FastState & state, UCTNode & parent) {
     if (cfg_quiet || !parent.has_children()) {
         return;
@@ -892,9 +962,227 @@ std::string UCTSearch::get_analysis(int playouts) {
 }
 
 bool UCTSearch::is_running() const {
+    return m_run && (m_collect_tree
+                     || UCTNodePointer::get_tree_size() < cfg_max_tree_size);
+}
+
+bool UCTSearch::is_searching() const {
     return m_run && UCTNodePointer::get_tree_size() < cfg_max_tree_size;
 }
 
+namespace {
+    // collect_tree() prunes the subtrees with fewer than 2^level visits,
+    // for the lowest level which frees enough memory.
+    constexpr auto PRUNE_LEVELS = 32;
+
+    int prune_level(const int visits) {
+        auto level = 0;
+        while (level < PRUNE_LEVELS && (1LL << level) <= visits) {
+            level++;
+        }
+        return level;
+    }
+
+    // The children with most visits and those with at least half of
+    // its visits are the contenders, the others may be pruned. The
+    // children of the root are never pruned, they are expected to
+    // stay inflated.
+    bool is_prunable(const UCTNodePointer& child, const int max_visits) {
+        return child.is_inflated() && child.valid()
+            && 2 * child.get_visits() < max_visits;
+    }
+
+    int get_max_visits(const UCTNode& node) {
+        auto max_visits = 0;
+        for (const auto& child : node.get_children()) {
+            max_visits = std::max(max_visits, child.get_visits());
+        }
+        return max_visits;
+    }
+
+    struct TreeSize {
+        size_t bytes;
+        size_t nodes;
+    };
+
+    // Memory the parent keeps for the pruned child, see
+    // UCTNode::keep_pruned_subtree(). Smaller subtrees are not pruned.
+    size_t get_record_size(const UCTNode& parent,
+                           const UCTNodePointer& child) {
+        auto size = parent.get_pruned_record_size(child.get_move());
+        if (parent.get_subtree_stats_size() == 0) {
+            size += UCTNode::get_new_stats_size();
+        }
+        return size;
+    }
+
+    // Measure the subtree of node, in the units of
+    // UCTNodePointer::get_tree_size() and of node counts. The subtrees
+    // pruned at a level are the prunable ones without a prunable
+    // ancestor pruned at the same level: their sizes, less what their
+    // parents keep of them, are added to freed from their own level up
+    // to the level of the ancestor.
+    TreeSize measure_subtree(const UCTNode& node, const bool is_root,
+                             const int ancestor_level,
+                             std::array<size_t, PRUNE_LEVELS + 1>& freed) {
+        const auto& children = node.get_children();
+        auto size = TreeSize{
+            sizeof(UCTNode) + children.size() * sizeof(UCTNodePointer)
+            + node.get_subtree_stats_size(),
+            children.size()};
+        const auto max_visits = get_max_visits(node);
+        // Lowest level at which a child is pruned.
+        auto pruned_level = ancestor_level;
+        for (const auto& child : children) {
+            if (!child.is_inflated()) {
+                continue;
+            }
+            if (!is_root && is_prunable(child, max_visits)) {
+                const auto level =
+                    std::min(prune_level(child.get_visits()), ancestor_level);
+                auto child_freed = std::array<size_t, PRUNE_LEVELS + 1>{};
+                const auto child_size =
+                    measure_subtree(*child, false, level, child_freed);
+                const auto record = get_record_size(node, child);
+                if (child_size.bytes > record) {
+                    for (auto i = 0; i < level; i++) {
+                        freed[i] += child_freed[i];
+                    }
+                    const auto kept = node.get_pruned_record_size(
+                        child.get_move());
+                    for (auto i = level; i < ancestor_level; i++) {
+                        freed[i] += child_size.bytes - kept;
+                    }
+                    pruned_level = std::min(pruned_level, level);
+                    size.bytes += child_size.bytes;
+                    size.nodes += child_size.nodes;
+                    continue;
+                }
+                // Not worth pruning, measured again as it stays.
+            }
+            const auto child_size =
+                measure_subtree(*child, false, ancestor_level, freed);
+            size.bytes += child_size.bytes;
+            size.nodes += child_size.nodes;
+        }
+        // The statistics of the node are created once, by the first
+        // child pruned, which is larger than them.
+        if (node.get_subtree_stats_size() == 0) {
+            for (auto i = pruned_level; i < ancestor_level; i++) {
+                freed[i] -= UCTNode::get_new_stats_size();
+            }
+        }
+        return size;
+    }
+
+    // Deflate the prunable children with fewer than 2^level visits,
+    // moving their nodes to pruned. Returns the nodes pruned.
+    size_t prune_subtree(UCTNode& node, const bool is_root,
+                         const int level, std::vector<UCTNode*>& pruned) {
+        auto freed = std::array<size_t, PRUNE_LEVELS + 1>{};
+        auto nodes = size_t{0};
+        const auto max_visits = get_max_visits(node);
+        for (const auto& child : node.get_children()) {
+            if (!child.is_inflated()) {
+                continue;
+            }
+            if (!is_root && is_prunable(child, max_visits)
+                && prune_level(child.get_visits()) <= level) {
+                const auto size = measure_subtree(*child, false, 0, freed);
+                if (size.bytes > get_record_size(node, child)) {
+                    nodes += size.nodes;
+                    node.keep_pruned_subtree(*child);
+                    pruned.emplace_back(child.deflate());
+                    continue;
+                }
+            }
+            nodes += prune_subtree(*child, false, level, pruned);
+        }
+        return nodes;
+    }
+}
+
+// Prune low-visit subtrees until the tree uses less than
+// TREE_COLLECT_TARGET of the maximum tree size, with the search
+// stopped. The pruned nodes go back to the vertex and policy of their
+// UCTNodePointer, to be searched again from scratch if needed, and are
+// destroyed by the idle thread pool before the search goes on. Their
+// ancestors keep the visits, the
+// evaluations and the subtree statistics they got from them, which
+// remain true of the positions. Returns false if the tree can't be
+// pruned that much.
+bool UCTSearch::collect_tree() {
+    // Wait for the nodes of the previous roots, which are part of the
+    // tree size until they are destroyed.
+    while (!m_delete_futures.empty()) {
+        m_delete_futures.front().wait_all();
+        m_delete_futures.pop_front();
+    }
+
+    const auto tree_size = UCTNodePointer::get_tree_size();
+    const auto target =
+        static_cast<size_t>(TREE_COLLECT_TARGET * cfg_max_tree_size);
+    if (tree_size <= target) {
+        return true;
+    }
+
+    auto freed = std::array<size_t, PRUNE_LEVELS + 1>{};
+    measure_subtree(*m_root, true, PRUNE_LEVELS, freed);
+    auto level = 0;
+    while (level < PRUNE_LEVELS - 1 && tree_size - freed[level] > target) {
+        level++;
+    }
+    if (tree_size - freed[level] > target) {
+        return false;
+    }
+
+    auto pruned = std::vector<UCTNode*>{};
+    const auto nodes = prune_subtree(*m_root, true, level, pruned);
+    m_nodes -= static_cast<int>(nodes);
+
+    // The search threads are stopped, the pool would only run a
+    // deletion in the background once the search is over.
+    ThreadGroup tg(thread_pool);
+    tg.add_range(pruned.size(), [&pruned](size_t i) {
+        delete pruned[i];
+    });
+    tg.wait_all();
+
+    myprintf("Tree %zu MiB: pruned %zu subtrees with fewer than %lld "
+             "visits, %zu MiB.\n",
+             tree_size / (1024 * 1024), pruned.size(), 1LL << level,
+             freed[level] / (1024 * 1024));
+    return true;
+}
+
+// Called by the thread which runs the search of tg.
+void UCTSearch::collect_tree_if_full(ThreadGroup& tg) {
+    if (!m_collect_tree
+        || UCTNodePointer::get_tree_size()
+           < TREE_COLLECT_START * cfg_max_tree_size) {
+        return;
+    }
+
+    // The search threads finish the simulation they are running. They
+    // are started again only if the search was not being stopped.
+    const auto was_running = m_run.exchange(false);
+    tg.wait_all();
+
+    if (!collect_tree()) {
+        // The tree is made of the lines the search is contending, it
+        // stops when the tree is full.
+        m_collect_tree = false;
+    }
+
+    if (!was_running) {
+        return;
+    }
+    m_run = true;
+    for (auto i = size_t{0}; i < cfg_num_threads; i++) {
+        tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
+    }
+}
+
 int UCTSearch::est_playouts_left(int elapsed_centis, int time_for_move) const {
     auto playouts = m_playouts.load();
     const auto playouts_left =
@@ -993,15 +1281,70 @@ bool UCTSearch::stop_thinking(int elapsed_centis, int time_for_move) const {
            || elapsed_centis >= time_for_move;
 }
 
+std::unique_ptr<GameState> UCTSearch::make_search_state() const {
+    auto state = std::make_unique<GameState>(m_rootstate);
+    state->begin_search(m_network.m_input_moves);
+    return state;
+}
+
+void UCTSearch::prefetch_leaves(GameState& currstate, const size_t leaves) {
+    auto path = std::vector<UCTNode*>{};
+    auto queue = std::vector<Network::QueuedEval>{};
+
+    // This will undo virtual loss even if something throws an exception.
+    BOOST_SCOPE_EXIT(&path) {
+        for (auto node : path) {
+            node->virtual_loss_undo();
+        }
+    } BOOST_SCOPE_EXIT_END
+
+    for (auto i = size_t{0}; i < leaves; i++) {
+        currstate.rewind_to(m_rootstate);
+        auto node = m_root.get();
+        while (true) {
+            if (node->virtual_loss()) {
+                path.push_back(node);
+            }
+            if (node->expandable()) {
+                if (currstate.get_passes() < 2) {
+                    m_network.queue_eval(&currstate, queue);
+                }
+                break;
+            }
+            if (!node->has_children()) {
+                break;
+            }
+            auto superko = false;
+            const auto next = descend(currstate, *node, superko);
+            if (next == nullptr || superko) {
+                break;
+            }
+            node = next;
+        }
+    }
+
+    m_network.evaluate_queue(queue);
+}
+
 void UCTWorker::operator()() {
     try {
+        // Copy the game once, each simulation then starts by going
+        // back to the root.
+        auto currstate = m_search->make_search_state();
+        const auto leaves = std::max(cfg_batch_leaves, 1u);
         do {
-            auto currstate = std::make_unique<GameState>(m_rootstate);
-            auto result = m_search->play_simulation(*currstate, m_root);
-            if (result.valid()) {
-                m_search->increment_playouts();
+            if (leaves > 1 && cfg_use_nncache) {
+                m_search->prefetch_leaves(*currstate, leaves);
+            }
+            for (auto i = 0u; i < leaves
+                     && (i == 0 || m_search->is_searching()); i++) {
+                currstate->rewind_to(m_rootstate);
+                auto result = m_search->play_simulation(*currstate, m_root);
+                if (result.valid()) {
+                    m_search->increment_playouts();
+                }
             }
-        } while (m_search->is_running());
+        } while (m_search->is_searching());
     } catch (NetworkHaltException&) {
         // intentionally empty
     }
@@ -1077,6 +1420,7 @@ int UCTSearch::think(int color, passflag_t passflag) {
 #endif
 
     m_run = true;
+    m_collect_tree = cfg_collect_tree;
     int cpus = cfg_num_threads;
     myprintf("cpus=%i\n", cpus);
     ThreadGroup tg(thread_pool);
@@ -1089,6 +1433,7 @@ int UCTSearch::think(int color, passflag_t passflag) {
     auto last_output = 0;
     do {
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        collect_tree_if_full(tg);
 	//        auto currstate = std::make_unique<GameState>(m_rootstate);
 	//        auto result = play_simulation(*currstate, m_root.get());
         // if (result.valid()) {
@@ -1362,9 +1707,10 @@ Network::Netresult UCTSearch::dump_evals(int req_playouts, std::string & dump_st
     m_root->set_progid(m_nodecounter++);
     set_firstmove(FastBoard::PASS);
     set_firstmove_blackeval(0.0f);
+    auto currstate = make_search_state();
     for (auto n=0 ; n < req_playouts ; n++) {
         // todo: check rootnode visits instead of playouts
-        auto currstate = std::make_unique<GameState>(m_rootstate);
+        currstate->rewind_to(m_rootstate);
 
         auto result = play_simulation(*currstate, m_root.get());
         if (!result.valid()) {
@@ -1572,9 +1918,9 @@ void UCTSearch::select_dame_sequence(FullBoard *board) {
     m_stopping_visits = EXPLORE_MOVE_VISITS;
     m_stopping_flag = false;
 
+    auto currstate = make_search_state();
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-
+        currstate->rewind_to(m_rootstate);
         play_simulation(*currstate, m_root.get());
     } while (!m_stopping_flag);
 
@@ -1603,6 +1949,7 @@ void UCTSearch::ponder() {
                               m_nodes, m_rootstate);
 
     m_run = true;
+    m_collect_tree = cfg_collect_tree;
     ThreadGroup tg(thread_pool);
     for (auto i = size_t{0}; i < cfg_num_threads; i++) {
         tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
@@ -1612,6 +1959,7 @@ void UCTSearch::ponder() {
     auto last_output = 0;
     do {
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        collect_tree_if_full(tg);
         if (cfg_analyze_tags.interval_centis()) {
             Time elapsed;
             int elapsed_centis = Time::timediff_centis(start, elapsed);
@@ -1758,9 +2106,9 @@ void UCTSearch::fast_roll_out() {
 #ifndef NDEBUG
         myprintf("Fast roll-out. Step %d. Komi %f\n", step++, m_rootstate.get_komi());
 #endif
+        auto currstate = make_search_state();
         do {
-            auto currstate = std::make_unique<GameState>(m_rootstate);
-
+            currstate->rewind_to(m_rootstate);
             auto result = play_simulation(*currstate, m_root.get());
 
             if (result.valid()) {
@@ -1842,8 +2190,9 @@ void UCTSearch::explore_move(int move) {
 
     const auto allowed = m_allowed_root_children;
 
+    auto currstate = make_search_state();
     while (nodeptr->get_visits() < EXPLORE_MOVE_VISITS) {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
+        currstate->rewind_to(m_rootstate);
         const auto nopass_old = m_nopass;
 
         m_nopass = true;
@@ -1855,8 +2204,9 @@ void UCTSearch::explore_move(int move) {
 }
 
 void UCTSearch::explore_root_nopass() {
+    auto currstate = make_search_state();
     while (m_root->get_visits() < EXPLORE_MOVE_VISITS) {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
+        currstate->rewind_to(m_rootstate);
         const auto nopass_old = m_nopass;
 
         m_nopass = true;
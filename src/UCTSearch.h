@@ -42,6 +42,7 @@
 #include "FastBoard.h"
 #include "FastState.h"
 #include "GameState.h"
+#include "TTable.h"
 #include "UCTNode.h"
 #include "Utils.h"
 #include "Network.h"
@@ -57,6 +58,36 @@ public:
     float eval_with_bonus(float bonus, float base) const;
     bool is_forced() const { return m_forced; }
     void set_forced() { m_forced = true; }
+    // The simulation ended at a node visited for the first time, with
+    // these network outputs, or at a terminal node visited again. See
+    // UCTNode::add_subtree_node() and UCTNode::add_subtree_ending().
+    bool has_new_node() const { return m_new_node; }
+    bool has_revisit() const { return m_revisit; }
+    float get_leaf_eval() const { return m_leaf_eval; }
+    float get_leaf_alpkt() const { return m_leaf_alpkt; }
+    float get_leaf_beta() const { return m_leaf_beta; }
+    void set_new_node(float eval, float alpkt, float beta) {
+        m_new_node = true;
+        m_leaf_eval = eval;
+        m_leaf_alpkt = alpkt;
+        m_leaf_beta = beta;
+    }
+    void set_revisit(float alpkt) {
+        m_revisit = true;
+        m_leaf_alpkt = alpkt;
+    }
+    // The ancestors counted the leaf already.
+    void clear_leaf() {
+        m_new_node = false;
+        m_revisit = false;
+    }
+    void copy_leaf(const SearchResult& other) {
+        m_new_node = other.m_new_node;
+        m_revisit = other.m_revisit;
+        m_leaf_eval = other.m_leaf_eval;
+        m_leaf_alpkt = other.m_leaf_alpkt;
+        m_leaf_beta = other.m_leaf_beta;
+    }
     static SearchResult from_eval(float value, float alpkt, float beta) {
         return SearchResult(value, alpkt, beta);
     }
@@ -71,6 +102,11 @@ private:
     float m_alpkt{0.0f};
     float m_beta{1.0f};
     bool m_forced{false};
+    bool m_new_node{false};
+    bool m_revisit{false};
+    float m_leaf_eval{0.5f};
+    float m_leaf_alpkt{0.0f};
+    float m_leaf_beta{1.0f};
 };
 
 namespace TimeManagement {
@@ -80,6 +116,8 @@ namespace TimeManagement {
 };
 
 class UCTSearch {
+    friend class LeelaTest;
+
 public:
     /*
         Depending on rule set and state of the game, we might
@@ -103,6 +141,20 @@ public:
     */
     static constexpr size_t MIN_TREE_SPACE = 100'000'000;
 
+    /*
+        When the tree uses more than this fraction of the maximum tree
+        size, the search pauses to prune low-visit subtrees until it
+        uses less than TREE_COLLECT_TARGET of it, see collect_tree().
+    */
+    static constexpr auto TREE_COLLECT_START = 0.9f;
+    static constexpr auto TREE_COLLECT_TARGET = 0.7f;
+
+    /*
+        With transpositions, 1 / TTABLE_SHARE of the memory for the
+        search tree goes to the transposition table instead.
+    */
+    static constexpr size_t TTABLE_SHARE = 16;
+
     /*
         Value representing unlimited visits or playouts. Due to
         concurrent updates while multithreading, we need some
@@ -134,13 +186,30 @@ public:
     void set_visit_limit(int visits);
     void ponder();
     bool is_running() const;
+    // Whether the search threads go on. They also stop at the maximum
+    // tree size while the tree is collected, until
+    // collect_tree_if_full() makes room.
+    bool is_searching() const;
     void increment_playouts();
     float final_japscore();
     void tree_stats();
     std::string explain_last_think() const;
     SearchResult play_simulation(GameState& currstate, UCTNode* const node);
+    // Copy of the root state to run simulations from, see
+    // GameState::rewind_to() and GameState::begin_search().
+    std::unique_ptr<GameState> make_search_state() const;
+    // Descend leaves times from the root, as play_simulation() would
+    // with the virtual loss of the previous descents, and evaluate the
+    // positions reached in one batch. The simulations that follow find
+    // them in the cache.
+    void prefetch_leaves(GameState& currstate, size_t leaves);
 
 private:
+    // Select the child of node to visit, as play_simulation() and
+    // prefetch_leaves() do, and play its move on currstate. The moves
+    // allowed at the root only restrict the children of the root.
+    // Sets superko if the move repeats an earlier position.
+    UCTNode* descend(GameState& currstate, UCTNode& node, bool& superko);
     float get_min_psa_ratio() const;
     void dump_stats(FastState& state, UCTNode& parent);
     void print_move_choices_by_policy(KoState& state, UCTNode& parent,
@@ -151,6 +220,8 @@ private:
     bool should_resign(passflag_t passflag, float besteval);
     bool have_alternate_moves(int elapsed_centis, int time_for_move);
     int est_playouts_left(int elapsed_centis, int time_for_move) const;
+    bool collect_tree();
+    void collect_tree_if_full(Utils::ThreadGroup& tg);
     size_t prune_noncontenders(int color, int elapsed_centis = 0, int time_for_move = 0,
                                bool prune = true);
     bool stop_thinking(int elapsed_centis = 0, int time_for_move = 0) const;
@@ -168,6 +239,9 @@ private:
 
     GameState & m_rootstate;
     std::unique_ptr<GameState> m_last_rootstate;
+    // Statistics shared by transpositions, if enabled. Declared before
+    // the trees, which release their entries when deleted.
+    std::unique_ptr<TTable> m_ttable;
     std::unique_ptr<UCTNode> m_root;
     std::atomic<int> m_nodes{0};
     std::atomic<int> m_playouts{0};
@@ -222,6 +296,10 @@ private:
 
     std::list<Utils::ThreadGroup> m_delete_futures;
 
+    // Whether a full tree is pruned by collect_tree() instead of
+    // stopping the search.
+    bool m_collect_tree{false};
+
     Network & m_network;
 };
 
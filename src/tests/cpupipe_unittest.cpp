@@ -0,0 +1,498 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2019 Michael O and contributors
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "BatchScheduler.h"
+#include "CPUPipe.h"
+#include "CPUPipeInt8.h"
+#include "Network.h"
+
+namespace {
+
+std::vector<float> random_vector(const size_t size, std::mt19937& rng) {
+    auto dist = std::uniform_real_distribution<float>(-1.0f, 1.0f);
+    auto v = std::vector<float>(size);
+    for (auto& x : v) {
+        x = dist(rng);
+    }
+    return v;
+}
+
+void expect_near(const std::vector<float>& ref,
+                 const std::vector<float>& out) {
+    ASSERT_EQ(ref.size(), out.size());
+    for (auto i = size_t{0}; i < ref.size(); i++) {
+        ASSERT_NEAR(ref[i], out[i], 1e-5f * (1.0f + std::abs(ref[i])))
+            << "at index " << i;
+    }
+}
+
+// U = G f G^T as Network::winograd_transform_f() computes it.
+std::vector<float> winograd_transform_f(const std::vector<float>& f,
+                                        const int outputs,
+                                        const int channels) {
+    const float G[WINOGRAD_ALPHA][3] = {
+        {1.0f,        0.0f,      0.0f},
+        {-2.0f/3.0f, -SQ2/3.0f, -1.0f/3.0f},
+        {-2.0f/3.0f,  SQ2/3.0f, -1.0f/3.0f},
+        {1.0f/6.0f,   SQ2/6.0f,  1.0f/3.0f},
+        {1.0f/6.0f,  -SQ2/6.0f,  1.0f/3.0f},
+        {0.0f,        0.0f,      1.0f}};
+    auto U = std::vector<float>(WINOGRAD_TILE * outputs * channels);
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            const auto filter = &f[(o * channels + c) * 9];
+            for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                    auto acc = 0.0f;
+                    for (auto a = 0; a < 3; a++) {
+                        for (auto b = 0; b < 3; b++) {
+                            acc += G[xi][a] * filter[a * 3 + b] * G[nu][b];
+                        }
+                    }
+                    U[(xi * WINOGRAD_ALPHA + nu) * outputs * channels
+                      + c * outputs + o] = acc;
+                }
+            }
+        }
+    }
+    return U;
+}
+
+// Direct 3x3 convolution of the batch_size positions of input with the
+// filters f, in the layout of the weights file, without bias or ReLU.
+std::vector<float> convolve3_ref(const int batch_size,
+                                 const std::vector<float>& input,
+                                 const std::vector<float>& f,
+                                 const int outputs,
+                                 const int channels) {
+    const auto W = BOARD_SIZE;
+    auto out = std::vector<float>(batch_size * outputs * NUM_INTERSECTIONS);
+    for (auto b = 0; b < batch_size; b++) {
+        for (auto k = 0; k < outputs; k++) {
+            for (auto y = 0; y < W; y++) {
+                for (auto x = 0; x < W; x++) {
+                    auto acc = 0.0f;
+                    for (auto c = 0; c < channels; c++) {
+                        for (auto i = 0; i < 9; i++) {
+                            const auto sy = y + i / 3 - 1;
+                            const auto sx = x + i % 3 - 1;
+                            if (sy >= 0 && sy < W && sx >= 0 && sx < W) {
+                                acc += f[(k * channels + c) * 9 + i]
+                                       * input[(b * channels + c)
+                                               * NUM_INTERSECTIONS
+                                               + sy * W + sx];
+                            }
+                        }
+                    }
+                    out[(b * outputs + k) * NUM_INTERSECTIONS
+                        + y * W + x] = acc;
+                }
+            }
+        }
+    }
+    return out;
+}
+
+// Weights of an input convolution and residual_blocks blocks of C
+// channels, with random filters, which are also stored in filters, and
+// batch normalizations close to the identity.
+std::shared_ptr<ForwardPipe::ForwardPipeWeights> random_tower(
+    const int input_planes, const int C, const int residual_blocks,
+    std::vector<std::vector<float>>& filters, std::mt19937& rng) {
+    auto scaled = [&rng](const size_t size, const float scale) {
+        auto v = random_vector(size, rng);
+        for (auto& x : v) {
+            x *= scale;
+        }
+        return v;
+    };
+
+    auto weights = std::make_shared<ForwardPipe::ForwardPipeWeights>();
+    filters.clear();
+    for (auto layer = 0; layer < 1 + 2 * residual_blocks; layer++) {
+        const auto in = layer == 0 ? input_planes : C;
+        filters.emplace_back(scaled(C * in * 9, 1.0f / std::sqrt(in * 9.0f)));
+        weights->m_conv_weights.emplace_back(
+            winograd_transform_f(filters.back(), C, in));
+        weights->m_conv_biases.emplace_back(C, 0.0f);
+        weights->m_batchnorm_means.emplace_back(scaled(C, 0.1f));
+        auto stddevs = scaled(C, 0.2f);
+        for (auto& x : stddevs) {
+            x += 1.0f;
+        }
+        weights->m_batchnorm_stddevs.emplace_back(stddevs);
+    }
+    weights->m_conv_pol_w = random_vector(C * 2, rng);
+    weights->m_conv_val_w = random_vector(C, rng);
+    return weights;
+}
+
+std::vector<float> random_planes(const size_t size, std::mt19937& rng) {
+    auto bits = std::bernoulli_distribution(0.3);
+    auto input = std::vector<float>(size);
+    for (auto& x : input) {
+        x = bits(rng) ? 1.0f : 0.0f;
+    }
+    return input;
+}
+
+}
+
+// The channel counts are not multiples of the SIMD width, so that both
+// the vectorized groups and the remaining channels are checked.
+TEST(CPUPipeTest, WinogradTransformIn) {
+    auto rng = std::mt19937{1};
+    for (const auto C : {1, 18, 37}) {
+        for (const auto batch_size : {1, 3}) {
+            const auto in = random_vector(
+                batch_size * C * NUM_INTERSECTIONS, rng);
+            const auto size = WINOGRAD_TILE * C * WINOGRAD_P * batch_size;
+            auto ref = std::vector<float>(size);
+            auto out = std::vector<float>(size);
+            CPUPipe::winograd_transform_in_ref(in, ref, C, batch_size);
+            CPUPipe::winograd_transform_in(in, out, C, batch_size);
+            expect_near(ref, out);
+        }
+    }
+}
+
+TEST(CPUPipeTest, WinogradTransformOut) {
+    auto rng = std::mt19937{2};
+    for (const auto K : {1, 16, 41}) {
+        for (const auto batch_size : {1, 3}) {
+            const auto M = random_vector(
+                WINOGRAD_TILE * K * WINOGRAD_P * batch_size, rng);
+            const auto bias = random_vector(K, rng);
+            const auto size = batch_size * K * NUM_INTERSECTIONS;
+            const auto residual = random_vector(size, rng);
+            for (const auto res : {(const float*)nullptr, residual.data()}) {
+                auto ref = std::vector<float>(size);
+                auto out = std::vector<float>(size);
+                CPUPipe::winograd_transform_out_ref(M, ref, K, batch_size,
+                                                    bias.data(), res);
+                CPUPipe::winograd_transform_out(M, out, K, batch_size,
+                                                bias.data(), res);
+                expect_near(ref, out);
+            }
+        }
+    }
+}
+
+TEST(CPUPipeTest, FoldBatchnorm) {
+    // With zero input, the output of the tower convolutions is the
+    // batch normalization of zero: ReLU(-stddev * mean).
+    const auto C = 20;
+    auto rng = std::mt19937{3};
+    auto weights = ForwardPipe::ForwardPipeWeights{};
+    weights.m_conv_weights.emplace_back(random_vector(WINOGRAD_TILE * C * C, rng));
+    weights.m_batchnorm_means.emplace_back(random_vector(C, rng));
+    weights.m_batchnorm_stddevs.emplace_back(random_vector(C, rng));
+    const auto folded = CPUPipe::fold_batchnorm(weights);
+
+    const auto M = std::vector<float>(WINOGRAD_TILE * C * WINOGRAD_P);
+    auto out = std::vector<float>(C * NUM_INTERSECTIONS);
+    CPUPipe::winograd_transform_out(M, out, C, 1,
+                                    folded->m_conv_biases[0].data());
+    for (auto k = 0; k < C; k++) {
+        const auto expected = std::max(-weights.m_batchnorm_stddevs[0][k]
+                                       * weights.m_batchnorm_means[0][k], 0.0f);
+        EXPECT_NEAR(expected, out[k * NUM_INTERSECTIONS], 1e-6f);
+    }
+    // The weights of output channel k are scaled by its stddev.
+    EXPECT_NEAR(weights.m_conv_weights[0][C + 3] * weights.m_batchnorm_stddevs[0][3],
+                folded->m_conv_weights[0][C + 3], 1e-6f);
+}
+
+TEST(CPUPipeTest, WinogradTransformInConstant) {
+    // Away from the border, the first element of the transform of a
+    // constant plane is c * (sum of the first row of Bt)^2 = c / 4.
+    const auto C = 24;
+    const auto in = std::vector<float>(C * NUM_INTERSECTIONS, 2.0f);
+    auto V = std::vector<float>(WINOGRAD_TILE * C * WINOGRAD_P);
+    CPUPipe::winograd_transform_in(in, V, C, 1);
+    // The tile at block (1, 1) is inside the board for any size with
+    // more than one tile in each direction.
+    if (WINOGRAD_WTILES > 2) {
+        const auto n = WINOGRAD_WTILES + 1;
+        for (auto c = 0; c < C; c++) {
+            EXPECT_NEAR(0.5f, V[n * C + c], 1e-5f);
+        }
+    }
+}
+
+TEST(CPUPipeTest, ForwardBatch) {
+    // The Winograd tower against direct convolutions with the batch
+    // normalizations and the residual additions done apart.
+    const auto C = 24;
+    const auto input_planes = 18;
+    const auto residual_blocks = 2;
+    auto rng = std::mt19937{7};
+    for (const auto batch_size : {1, 3}) {
+        auto filters = std::vector<std::vector<float>>{};
+        const auto weights = random_tower(input_planes, C, residual_blocks,
+                                          filters, rng);
+        const auto input = random_planes(
+            batch_size * input_planes * NUM_INTERSECTIONS, rng);
+
+        auto convolve = [&](const size_t layer, const std::vector<float>& in,
+                            const std::vector<float>* const residual) {
+            const auto channels = layer == 0 ? input_planes : C;
+            auto out = convolve3_ref(batch_size, in, filters[layer], C, channels);
+            for (auto i = size_t{0}; i < out.size(); i++) {
+                const auto k = i / NUM_INTERSECTIONS % C;
+                out[i] = (out[i] - weights->m_batchnorm_means[layer][k])
+                         * weights->m_batchnorm_stddevs[layer][k];
+                if (residual) {
+                    out[i] += (*residual)[i];
+                }
+                out[i] = std::max(out[i], 0.0f);
+            }
+            return out;
+        };
+        auto tower = convolve(0, input, nullptr);
+        for (auto layer = size_t{1}; layer < filters.size(); layer += 2) {
+            const auto mid = convolve(layer, tower, nullptr);
+            tower = convolve(layer + 1, mid, &tower);
+        }
+        auto ref_pol = std::vector<float>(batch_size * 2 * NUM_INTERSECTIONS);
+        auto ref_val = std::vector<float>(batch_size * NUM_INTERSECTIONS);
+        for (auto b = 0; b < batch_size; b++) {
+            for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+                for (auto c = 0; c < C; c++) {
+                    const auto x = tower[(b * C + c) * NUM_INTERSECTIONS + i];
+                    for (auto o = 0; o < 2; o++) {
+                        ref_pol[(b * 2 + o) * NUM_INTERSECTIONS + i] +=
+                            weights->m_conv_pol_w[o * C + c] * x;
+                    }
+                    ref_val[b * NUM_INTERSECTIONS + i] +=
+                        weights->m_conv_val_w[c] * x;
+                }
+            }
+        }
+
+        auto pipe = CPUPipe{};
+        pipe.initialize(C);
+        pipe.push_weights(WINOGRAD_ALPHA, input_planes, C, weights);
+        auto pol = std::vector<float>(ref_pol.size());
+        auto val = std::vector<float>(ref_val.size());
+        auto vbe = std::vector<float>{};
+        pipe.forward_batch(batch_size, input, pol, val, vbe);
+        for (auto i = size_t{0}; i < pol.size(); i++) {
+            ASSERT_NEAR(ref_pol[i], pol[i], 1e-4f * (1.0f + std::abs(ref_pol[i])))
+                << "policy at index " << i;
+        }
+        for (auto i = size_t{0}; i < val.size(); i++) {
+            ASSERT_NEAR(ref_val[i], val[i], 1e-4f * (1.0f + std::abs(ref_val[i])))
+                << "value at index " << i;
+        }
+    }
+}
+
+TEST(CPUPipeInt8Test, WinogradUntransformFilters) {
+    auto rng = std::mt19937{4};
+    const auto outputs = 7;
+    const auto channels = 5;
+    const auto f = random_vector(outputs * channels * 9, rng);
+    const auto U = winograd_transform_f(f, outputs, channels);
+    expect_near(f, CPUPipeInt8::winograd_untransform_f(U, outputs, channels));
+}
+
+TEST(CPUPipeInt8Test, Convolve3) {
+    // Neither the rows of the filters nor the output channels nor the
+    // positions fill the last SIMD block.
+    const auto outputs = 13;
+    const auto channels = 37;
+    auto rng = std::mt19937{5};
+    auto positive = std::uniform_real_distribution<float>(0.0f, 1.0f);
+    for (const auto batch_size : {1, 3}) {
+        const auto f = random_vector(outputs * channels * 9, rng);
+        const auto bias = random_vector(outputs, rng);
+        const auto residual = random_vector(
+            batch_size * outputs * NUM_INTERSECTIONS, rng);
+        auto input = std::vector<float>(
+            batch_size * channels * NUM_INTERSECTIONS);
+        for (auto& x : input) {
+            x = positive(rng);
+        }
+
+        auto ref = convolve3_ref(batch_size, input, f, outputs, channels);
+        for (auto i = size_t{0}; i < ref.size(); i++) {
+            const auto k = i / NUM_INTERSECTIONS % outputs;
+            ref[i] = std::max(ref[i] + bias[k] + residual[i], 0.0f);
+        }
+
+        const auto filters = CPUPipeInt8::quantize_filters(f, outputs, channels);
+        auto out = std::vector<float>(ref.size());
+        CPUPipeInt8::convolve3_int8(batch_size, input, 1.0f, filters,
+                                    bias.data(), residual.data(), out);
+        // Each of the 333 products is off by up to half a step of the
+        // weights or of the activations, 1/254 of their range, so the
+        // sums by about 0.03.
+        auto square_error = 0.0;
+        for (auto i = size_t{0}; i < ref.size(); i++) {
+            ASSERT_NEAR(ref[i], out[i], 0.2f) << "at index " << i;
+            square_error += (ref[i] - out[i]) * (ref[i] - out[i]);
+        }
+        EXPECT_LT(std::sqrt(square_error / ref.size()), 0.05);
+    }
+}
+
+TEST(CPUPipeInt8Test, MatchesFloatPipe) {
+    const auto C = 16;
+    const auto input_planes = 18;
+    const auto batch_size = 4;
+    auto rng = std::mt19937{6};
+    auto filters = std::vector<std::vector<float>>{};
+    const auto weights = random_tower(input_planes, C, 2, filters, rng);
+    const auto input = random_planes(
+        batch_size * input_planes * NUM_INTERSECTIONS, rng);
+
+    auto pipe = CPUPipe{};
+    pipe.initialize(C);
+    pipe.push_weights(WINOGRAD_ALPHA, input_planes, C, weights);
+    CPUPipeInt8 pipe_int8{std::vector<float>(input)};
+    pipe_int8.initialize(C);
+    pipe_int8.push_weights(WINOGRAD_ALPHA, input_planes, C, weights);
+
+    auto pol = std::vector<float>(batch_size * 2 * NUM_INTERSECTIONS);
+    auto val = std::vector<float>(batch_size * NUM_INTERSECTIONS);
+    auto vbe = std::vector<float>{};
+    auto pol_int8 = pol;
+    auto val_int8 = val;
+    pipe.forward_batch(batch_size, input, pol, val, vbe);
+    pipe_int8.forward_batch(batch_size, input, pol_int8, val_int8, vbe);
+
+    auto max_ref = 0.0f;
+    auto max_error = 0.0f;
+    for (auto i = size_t{0}; i < pol.size(); i++) {
+        max_ref = std::max(max_ref, std::abs(pol[i]));
+        max_error = std::max(max_error, std::abs(pol[i] - pol_int8[i]));
+    }
+    for (auto i = size_t{0}; i < val.size(); i++) {
+        max_ref = std::max(max_ref, std::abs(val[i]));
+        max_error = std::max(max_error, std::abs(val[i] - val_int8[i]));
+    }
+    EXPECT_GT(max_ref, 0.0f);
+    EXPECT_LT(max_error, 0.05f * max_ref);
+
+    // After a failed self-check the tower is the float one.
+    EXPECT_TRUE(pipe_int8.use_float());
+    EXPECT_FALSE(pipe_int8.use_float());
+    pipe_int8.forward_batch(batch_size, input, pol_int8, val_int8, vbe);
+    expect_near(pol, pol_int8);
+    expect_near(val, val_int8);
+}
+
+namespace {
+
+// Doubles the inputs, counting the positions evaluated in batches.
+class DoublingScheduler : public BatchScheduler {
+public:
+    ~DoublingScheduler() {
+        stop_workers();
+    }
+    void initialize(const int) {
+        for (auto i = 0; i < 2; i++) {
+            m_worker_threads.emplace_back([this] {
+                run_batches(4, [this] (const size_t count,
+                                       const std::vector<float>& input,
+                                       std::vector<float>& output_pol,
+                                       std::vector<float>& output_val,
+                                       std::vector<float>& output_vbe) {
+                    EXPECT_LE(count, 4u);
+                    EXPECT_EQ(input.size(), output_pol.size());
+                    for (auto i = size_t{0}; i < input.size(); i++) {
+                        output_pol[i] = 2.0f * input[i];
+                    }
+                    std::fill(begin(output_val), end(output_val), 1.0f);
+                    EXPECT_TRUE(output_vbe.empty());
+                    if (count > 1) {
+                        m_batched += count;
+                    }
+                });
+            });
+        }
+    }
+    void push_weights(unsigned int, unsigned int, unsigned int,
+                      std::shared_ptr<const ForwardPipeWeights>) {}
+
+    std::atomic<size_t> m_batched{0};
+};
+
+}
+
+TEST(BatchSchedulerTest, Forward) {
+    DoublingScheduler scheduler;
+    scheduler.initialize(0);
+
+    // Single positions from several threads.
+    auto threads = std::vector<std::thread>{};
+    std::atomic<int> failures{0};
+    for (auto t = 0; t < 8; t++) {
+        threads.emplace_back([&scheduler, &failures, t] {
+            for (auto n = 0; n < 20; n++) {
+                const auto input = std::vector<float>(3, float(t * 100 + n));
+                auto pol = std::vector<float>(3);
+                auto val = std::vector<float>(1);
+                auto vbe = std::vector<float>{};
+                scheduler.forward(input, pol, val, vbe);
+                if (pol != std::vector<float>(3, 2.0f * input[0])
+                    || val[0] != 1.0f) {
+                    failures++;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(0, failures);
+
+    // A batch, which the workers pick up together.
+    const auto input = std::vector<float>{1.0f, 2.0f, 3.0f, 4.0f};
+    auto pol = std::vector<float>(4);
+    auto val = std::vector<float>(4);
+    auto vbe = std::vector<float>{};
+    const auto batched = scheduler.m_batched.load();
+    scheduler.forward_batch(4, input, pol, val, vbe);
+    EXPECT_EQ((std::vector<float>{2.0f, 4.0f, 6.0f, 8.0f}), pol);
+    EXPECT_EQ(std::vector<float>(4, 1.0f), val);
+    EXPECT_EQ(batched + 4, scheduler.m_batched);
+}
@@ -32,6 +32,8 @@
 
 #include <cstdint>
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <regex>
@@ -41,8 +43,13 @@
 #include "GTP.h"
 #include "GameState.h"
 #include "NNCache.h"
+#include "Network.h"
 #include "Random.h"
+#include "TTable.h"
+#include "UCTNodePointer.h"
 #include "ThreadPool.h"
+#include "UCTNode.h"
+#include "UCTSearch.h"
 #include "Utils.h"
 #include "Zobrist.h"
 
@@ -117,6 +124,83 @@ public:
     void test_analyze_cmd(std::string cmd, bool valid, int who, int interval,
             int avoidlen, int avoidcolor, int avoiduntil);
 
+    // Give search the tree of root, as update_root() does.
+    static UCTNode& set_root(UCTSearch& search,
+                             std::unique_ptr<UCTNode> root) {
+        search.m_root = std::move(root);
+        search.m_nodes = search.m_root->count_nodes_and_clear_expand_state();
+        return *search.m_root;
+    }
+    // Move the root of search from last to the current position, as
+    // the next think() does.
+    static UCTNode& advance_root(UCTSearch& search, const GameState& last) {
+        search.m_last_rootstate = std::make_unique<GameState>(last);
+        search.update_root();
+        return *search.m_root;
+    }
+    // Run collect_tree() and wait until the pruned nodes are destroyed.
+    static bool collect_tree(UCTSearch& search) {
+        const auto collected = search.collect_tree();
+        for (auto& tg : search.m_delete_futures) {
+            tg.wait_all();
+        }
+        search.m_delete_futures.clear();
+        return collected;
+    }
+    static int get_nodes(const UCTSearch& search) {
+        return search.m_nodes;
+    }
+
+    static std::uint64_t get_cache_key(const Network& network,
+                                       const GameState& state) {
+        return network.get_cache_key(&state).first;
+    }
+    // Visited nodes of the subtree of node, node and the pruned
+    // subtrees included.
+    static int get_subtree_nodes(const UCTNode& node) {
+        return node.get_subtree_summary().nodes;
+    }
+    static bool uses_int8(const Network& network) {
+        return network.m_forward_int8 != nullptr;
+    }
+    static float compare_net_outputs(Network& network,
+                                     const Network::Netresult& data,
+                                     const Network::Netresult& ref,
+                                     const GameState& state) {
+        return network.compare_net_outputs(data, ref, state.get_komi(),
+                                           state.get_to_move());
+    }
+
+    // Give the visited nodes of the tree made up values, as
+    // create_children() derives them from a SAI network, and append
+    // them with their alpkt and the passes before them to nodes.
+    struct SaiNode {
+        const UCTNode* node;
+        float alpkt;
+        int passes;
+    };
+    static void make_sai_tree(UCTNode& node, const int passes,
+                              std::vector<SaiNode>& nodes) {
+        const auto index = nodes.size();
+        const auto alpkt = float(int(index % 23) - 11) * 0.75f;
+        const auto beta = 0.2f + float(index % 7) * 0.1f;
+        const auto result_extended = Network::get_extended(alpkt, beta);
+        node.m_net_beta = beta;
+        node.m_net_alpkt = alpkt;
+        node.m_eval_bonus = result_extended.eval_bonus;
+        node.m_eval_base = result_extended.eval_base;
+        node.m_agent_eval = result_extended.agent_eval;
+        node.m_net_eval = result_extended.pi;
+        nodes.push_back({&node, alpkt, passes});
+        for (const auto& child : node.get_children()) {
+            if (child.is_inflated() && child.get_visits() > 0) {
+                const auto child_passes =
+                    child.get_move() == FastBoard::PASS ? passes + 1 : 0;
+                make_sai_tree(*child.get(), child_passes, nodes);
+            }
+        }
+    }
+
 private:
     std::unique_ptr<GameState> m_gamestate;
 };
@@ -196,6 +280,764 @@ TEST_F(LeelaTest, KoPntNotSame) {
     EXPECT_NE(hash, maingame.board.get_hash());
 }
 
+TEST_F(LeelaTest, SymmetryHash) {
+    auto maingame = get_gamestate();
+
+    testing::internal::CaptureStdout();
+    for (auto move : {"E6", "F6", "E5", "F5", "D4", "E4",
+                      "E3", "G4", "F4", "F3", "D3", "pass"}) {
+        GTP::execute(maingame, std::string{"play "}
+                               + (maingame.get_to_move() ? "w " : "b ") + move);
+        // The incremental hashes match the ones computed from scratch,
+        // up to the pass count which is only in the incremental ones.
+        const auto pass_key = maingame.board.get_hash()
+                              ^ maingame.get_symmetry_hash(0);
+        for (auto s = 0; s < FullBoard::NUM_SYMMETRIES; s++) {
+            EXPECT_EQ(maingame.board.m_sym_hash[s],
+                      maingame.get_symmetry_hash(s) ^ pass_key);
+        }
+    }
+    auto hash = maingame.board.get_hash();
+    auto canonical = maingame.board.get_canonical_hash();
+
+    GTP::execute(maingame, "clear_board");
+
+    // Same game rotated by 180 degrees.
+    for (auto move : {"P14", "O14", "P15", "O15", "Q16", "P16",
+                      "P17", "N16", "O16", "O17", "Q17", "pass"}) {
+        GTP::execute(maingame, std::string{"play "}
+                               + (maingame.get_to_move() ? "w " : "b ") + move);
+    }
+    std::string output = testing::internal::GetCapturedStdout();
+
+    EXPECT_NE(hash, maingame.board.get_hash());
+    EXPECT_EQ(canonical.first, maingame.board.get_canonical_hash().first);
+    EXPECT_EQ(canonical.second ^ 3, maingame.board.get_canonical_hash().second);
+}
+
+TEST_F(LeelaTest, SymmetryHashOtherSize) {
+    // The symmetries are only kept for boards of BOARD_SIZE.
+    auto game = GameState{};
+    game.init_game(9, 7.5f);
+    game.play_move(FastBoard::BLACK, game.board.get_vertex(2, 3));
+    game.play_move(FastBoard::WHITE, game.board.get_vertex(6, 6));
+    const auto canonical = game.board.get_canonical_hash();
+    EXPECT_EQ(game.board.get_hash(), canonical.first);
+    EXPECT_EQ(int(Network::IDENTITY_SYMMETRY), canonical.second);
+}
+
+TEST_F(LeelaTest, RewindTo) {
+    auto maingame = get_gamestate();
+
+    testing::internal::CaptureStdout();
+    for (auto move : {"D4", "Q16", "D16", "Q4"}) {
+        GTP::execute(maingame, std::string{"play "}
+                               + (maingame.get_to_move() ? "w " : "b ") + move);
+    }
+    std::string output = testing::internal::GetCapturedStdout();
+
+    auto state = maingame;
+    for (auto round = 0; round < 2; round++) {
+        for (auto move : {"C3", "R17", "pass", "K10"}) {
+            state.play_move(state.board.text_to_move(move));
+        }
+        EXPECT_NE(maingame.board.get_hash(), state.board.get_hash());
+
+        state.rewind_to(maingame);
+        EXPECT_EQ(maingame.get_movenum(), state.get_movenum());
+        EXPECT_EQ(maingame.get_to_move(), state.get_to_move());
+        EXPECT_EQ(maingame.get_passes(), state.get_passes());
+        EXPECT_EQ(maingame.board.get_hash(), state.board.get_hash());
+        EXPECT_EQ(maingame.board.get_ko_hash(), state.board.get_ko_hash());
+        EXPECT_EQ(maingame.get_game_history().size(),
+                  state.get_game_history().size());
+        EXPECT_EQ(maingame.get_past_state(1)->board.get_hash(),
+                  state.get_past_state(1)->board.get_hash());
+    }
+}
+
+TEST_F(LeelaTest, SearchHistory) {
+    auto maingame = get_gamestate();
+
+    testing::internal::CaptureStdout();
+    for (auto move : {"D4", "Q16", "D16"}) {
+        GTP::execute(maingame, std::string{"play "}
+                               + (maingame.get_to_move() ? "w " : "b ") + move);
+    }
+    std::string output = testing::internal::GetCapturedStdout();
+
+    // A search state must feed the network the same inputs as a full one.
+    auto state = maingame;
+    state.begin_search(Network::DEFAULT_INPUT_MOVES);
+    for (auto round = 0; round < 2; round++) {
+        auto full = maingame;
+        for (auto move : {"Q4", "C3", "R17", "pass", "K10", "C17", "R3",
+                          "O3", "pass", "C6", "F3", "K16", "Q10"}) {
+            state.play_move(state.board.text_to_move(move));
+            full.play_move(full.board.text_to_move(move));
+            EXPECT_EQ(Network::gather_features(&full, 0, 8, true, true, true),
+                      Network::gather_features(&state, 0, 8, true, true, true));
+        }
+        state.rewind_to(maingame);
+    }
+}
+
+TEST_F(LeelaTest, Superko) {
+    auto maingame = get_gamestate();
+
+    testing::internal::CaptureStdout();
+    for (auto move : {"b C3", "w D3", "b B4", "w E4", "b C5", "w D5",
+                      "b D4"}) {
+        GTP::execute(maingame, std::string{"play "} + move);
+    }
+    std::string output = testing::internal::GetCapturedStdout();
+
+    auto state = maingame;
+    state.begin_search(Network::DEFAULT_INPUT_MOVES);
+    for (auto round = 0; round < 2; round++) {
+        // White takes the ko, black retaking it repeats the position.
+        state.play_move(state.board.text_to_move("C4"));
+        EXPECT_FALSE(state.superko());
+        state.play_move(state.board.text_to_move("D4"));
+        EXPECT_TRUE(state.superko());
+
+        // Forgotten after going back.
+        state.rewind_to(maingame);
+        state.play_move(state.board.text_to_move("C4"));
+        state.play_move(state.board.text_to_move("Q16"));
+        EXPECT_FALSE(state.superko());
+        state.rewind_to(maingame);
+    }
+}
+
+TEST_F(LeelaTest, EvaluateQueue) {
+    auto& network = *GTP::s_network;
+    network.nncache_clear();
+
+    auto empty = get_gamestate();
+    auto other = empty;
+    other.play_move(other.board.text_to_move("Q16"));
+
+    auto queue = std::vector<Network::QueuedEval>{};
+    EXPECT_TRUE(network.queue_eval(&empty, queue));
+    EXPECT_FALSE(network.queue_eval(&empty, queue));
+    EXPECT_TRUE(network.queue_eval(&other, queue));
+    network.evaluate_queue(queue);
+    EXPECT_TRUE(queue.empty());
+
+    // Both are in the cache now.
+    EXPECT_FALSE(network.queue_eval(&empty, queue));
+    EXPECT_FALSE(network.queue_eval(&other, queue));
+
+    // The empty board looks the same in all symmetries.
+    const auto cached = network.get_output(&empty, Network::RANDOM_SYMMETRY);
+    const auto direct = network.get_output(&empty, Network::DIRECT,
+                                           Network::IDENTITY_SYMMETRY,
+                                           false, false);
+    EXPECT_NEAR(cached.value, direct.value, 1e-4);
+    EXPECT_NEAR(cached.policy_pass, direct.policy_pass, 1e-4);
+    for (auto idx = size_t{0}; idx < NUM_INTERSECTIONS; idx++) {
+        EXPECT_NEAR(cached.policy[idx], direct.policy[idx], 1e-4);
+    }
+}
+
+TEST_F(LeelaTest, CacheKeyKomi) {
+    auto& network = *GTP::s_network;
+    const auto& state = get_gamestate();
+    auto other = state;
+    other.set_komi(0.5f);
+    // The test network doesn't look at the komi.
+    EXPECT_EQ(get_cache_key(network, state), get_cache_key(network, other));
+
+    // Processes sharing a cache at other komis don't share entries of
+    // networks with komi policy layers.
+    network.m_komi_policy = true;
+    const auto key = get_cache_key(network, state);
+    const auto other_key = get_cache_key(network, other);
+    auto same = state;
+    const auto same_key = get_cache_key(network, same);
+    // The sign of a zero komi doesn't matter.
+    auto zero = state;
+    zero.set_komi(0.0f);
+    auto negative_zero = state;
+    negative_zero.set_komi(-0.0f);
+    const auto zero_key = get_cache_key(network, zero);
+    const auto negative_zero_key = get_cache_key(network, negative_zero);
+    network.m_komi_policy = false;
+    EXPECT_NE(key, other_key);
+    EXPECT_EQ(key, same_key);
+    EXPECT_EQ(zero_key, negative_zero_key);
+}
+
+// Writes the test network with a second unit in the last layer of the
+// value head, which makes it a SAI network with a type I value head.
+static void write_sai_network(const std::string& filename) {
+    auto lines = std::vector<std::string>{};
+    std::ifstream in{"../src/tests/0k.txt"};
+    for (auto line = std::string{}; std::getline(in, line);) {
+        lines.emplace_back(line);
+    }
+    ASSERT_GE(lines.size(), size_t{2});
+    auto& weights = lines[lines.size() - 2];
+    auto& biases = lines[lines.size() - 1];
+    weights += " " + weights;
+    biases += " -0.5";
+    std::ofstream out{filename};
+    for (const auto& line : lines) {
+        out << line << "\n";
+    }
+}
+
+TEST_F(LeelaTest, Int8SelfCheckSai) {
+    const auto filename = std::string{"gtests_sai.txt"};
+    write_sai_network(filename);
+    cfg_cpu_only = true;
+    cfg_cpu_int8 = true;
+    Network network;
+    network.initialize(1, filename);
+    std::remove(filename.c_str());
+    // The check at load time compared the winrates of the int8 and
+    // float pipes, and kept the int8 one.
+    ASSERT_TRUE(uses_int8(network));
+
+    auto& state = get_gamestate();
+    const auto ref = network.get_output(&state, Network::DIRECT,
+                                        Network::IDENTITY_SYMMETRY,
+                                        false, false);
+    ASSERT_TRUE(ref.is_sai);
+    ASSERT_GT(ref.beta, 0.0f);
+    EXPECT_EQ(0.0f, compare_net_outputs(network, ref, ref, state));
+
+    // The value of SAI networks is not in value: an alpha on the other
+    // side of the komi is caught.
+    const auto bonus = -state.get_komi();
+    const auto side = ref.alpha + bonus > 0.0f ? -1.0f : 1.0f;
+    auto data = ref;
+    data.alpha = -bonus + side * 3.0f / ref.beta;
+    EXPECT_THROW(compare_net_outputs(network, data, ref, state),
+                 std::runtime_error);
+
+    // As it is in the self-checks during the search.
+    const auto checked = network.get_output(&state, Network::RANDOM_SYMMETRY,
+                                            -1, false, false, true);
+    EXPECT_TRUE(checked.is_sai);
+    EXPECT_TRUE(uses_int8(network));
+}
+
+TEST_F(LeelaTest, VirtualLossLimit) {
+    UCTNode node{FastBoard::PASS, 0.0f};
+    for (auto i = 0; i < UCTNode::MAX_DESCENTS; i++) {
+        ASSERT_TRUE(node.virtual_loss());
+    }
+    // Nothing carries into the visits.
+    EXPECT_FALSE(node.virtual_loss());
+    EXPECT_EQ(node.get_visits(), 0);
+    node.virtual_loss_undo();
+    EXPECT_TRUE(node.virtual_loss());
+    for (auto i = 0; i < UCTNode::MAX_DESCENTS; i++) {
+        node.virtual_loss_undo();
+    }
+    node.update(0.5f, true);
+    EXPECT_EQ(node.get_visits(), 1);
+}
+
+// Visits and sum of evaluations of the nodes of a tree, depth first.
+static void tree_sums(const UCTNode& node,
+                      std::vector<std::pair<int, double>>& sums) {
+    sums.emplace_back(node.get_visits(), node.get_blackevals());
+    for (const auto& child : node.get_children()) {
+        if (child.is_inflated() && child.get_visits() > 0) {
+            tree_sums(*child.get(), sums);
+        }
+    }
+}
+
+// Checks the sums of evaluations of the tree against what the same
+// simulations back up, from state, for a network without SAI value
+// head, and returns the sum of node. Counts the terminal nodes.
+static double check_backed_up_evals(const UCTNode& node,
+                                    const GameState& state,
+                                    int& terminals) {
+    auto sum = 0.0;
+    auto children_visits = 0;
+    for (const auto& child : node.get_children()) {
+        if (!child.is_inflated() || child.get_visits() == 0) {
+            continue;
+        }
+        auto next = state;
+        next.play_move(child.get_move());
+        sum += check_backed_up_evals(*child.get(), next, terminals);
+        children_visits += child.get_visits();
+    }
+    auto eval = node.get_net_eval();
+    if (state.get_passes() >= 2) {
+        eval = Utils::winner(state.final_score());
+        terminals++;
+    }
+    sum += double(node.get_visits() - children_visits) * eval;
+    EXPECT_NEAR(sum, node.get_blackevals(), 1e-6 * node.get_visits());
+    return sum;
+}
+
+// Black owns the left half of the board and white the right one, each
+// with eyes which only the owner can fill, so that searches often end
+// with two passes. Black passed and wins by 11.5 with komi 7.5.
+static void play_split_board(GameState& game) {
+    for (auto y = 0; y < 19; y++) {
+        for (auto x = 0; x < 19; x++) {
+            if (y % 3 == 1 && x % 10 % 3 == 1) {
+                continue;
+            }
+            const auto color = x < 10 ? FastBoard::BLACK : FastBoard::WHITE;
+            game.play_move(color, game.board.get_vertex(x, y));
+        }
+    }
+    game.set_to_move(FastBoard::BLACK);
+    game.play_move(FastBoard::PASS);
+}
+
+static void search_tree(UCTSearch& search, const GameState& game,
+                        UCTNode& root, const int playouts) {
+    auto state = search.make_search_state();
+    for (auto i = 0; i < playouts; i++) {
+        state->rewind_to(game);
+        search.play_simulation(*state, &root);
+    }
+}
+
+// Inflates and returns the first unvisited child found in the tree,
+// depth first, or nullptr.
+static UCTNode* find_unvisited(UCTNode& node) {
+    for (const auto& child : node.get_children()) {
+        if (child.get_visits() == 0) {
+            child.inflate();
+            return child.get();
+        }
+        if (child.is_inflated()) {
+            if (const auto found = find_unvisited(*child.get())) {
+                return found;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Prune the subtrees below node with fewer than max_visits visits, the
+// way UCTSearch::collect_tree() does but without its choice of the
+// subtrees, and return their visits. Appends the parent and move of
+// each pruned subtree to pruned.
+static int prune_tree(UCTNode& node, const int max_visits,
+                      std::vector<std::pair<UCTNode*, int>>& pruned) {
+    auto visits = 0;
+    for (const auto& child : node.get_children()) {
+        if (!child.is_inflated() || child.get_visits() == 0) {
+            continue;
+        }
+        if (child.get_visits() < max_visits) {
+            visits += child.get_visits();
+            pruned.emplace_back(&node, child.get_move());
+            node.keep_pruned_subtree(*child.get());
+            delete child.deflate();
+        } else {
+            visits += prune_tree(*child.get(), max_visits, pruned);
+        }
+    }
+    return visits;
+}
+
+TEST_F(LeelaTest, ChangeKomi) {
+    auto& network = *GTP::s_network;
+    auto& maingame = get_gamestate();
+    play_split_board(maingame);
+    UCTSearch search{maingame, network};
+    UCTNode root{FastBoard::PASS, 0.0f};
+    search_tree(search, maingame, root, 400);
+
+    // No change must leave the sums as they are, to the last bit.
+    auto before = std::vector<std::pair<int, double>>{};
+    auto after = std::vector<std::pair<int, double>>{};
+    tree_sums(root, before);
+    root.change_komi(0.0f, false, 1, true);
+    tree_sums(root, after);
+    EXPECT_EQ(before, after);
+
+    // White wins the terminal nodes with the new komi.
+    root.change_komi(15.0f, false, 1, true);
+    auto other = maingame;
+    other.set_komi(22.5f);
+    auto terminals = 0;
+    check_backed_up_evals(root, other, terminals);
+    EXPECT_GT(terminals, 0);
+    after.clear();
+    tree_sums(root, after);
+    EXPECT_EQ(before.size(), after.size());
+    EXPECT_NE(before, after);
+
+    // A child linked to the table but never visited, as when its
+    // evaluation failed, must not keep its entry either.
+    TTable ttable{64};
+    const auto unvisited = find_unvisited(root);
+    ASSERT_NE(unvisited, nullptr);
+    unvisited->set_tt_entry(ttable.get_entry(1));
+    ASSERT_TRUE(unvisited->has_tt_entry());
+    root.change_komi(-15.0f, false, 1, true);
+    EXPECT_FALSE(unvisited->has_tt_entry());
+}
+
+static int count_tt_entries(const UCTNode& node) {
+    auto entries = int(node.has_tt_entry());
+    for (const auto& child : node.get_children()) {
+        if (child.is_inflated()) {
+            entries += count_tt_entries(*child.get());
+        }
+    }
+    return entries;
+}
+
+TEST_F(LeelaTest, TranspositionsAcrossMoves) {
+    cfg_transpositions = true;
+    auto& network = *GTP::s_network;
+    auto& maingame = get_gamestate();
+    UCTSearch search{maingame, network};
+    auto& root = set_root(search, std::make_unique<UCTNode>(FastBoard::PASS,
+                                                            0.0f));
+    search_tree(search, maingame, root, 200);
+    EXPECT_GT(count_tt_entries(root), 0);
+
+    auto move = FastBoard::PASS;
+    auto most_visits = 0;
+    auto linked = 0;
+    for (const auto& child : root.get_children()) {
+        if (child.get_visits() > most_visits) {
+            move = child.get_move();
+            most_visits = child.get_visits();
+            linked = count_tt_entries(*child.get());
+        }
+    }
+    ASSERT_GT(most_visits, 1);
+    ASSERT_GT(linked, 0);
+    const auto last = maingame;
+    maingame.play_move(move);
+
+    // The nodes of the new root keep their entries, and the search
+    // goes on linking new ones.
+    auto& new_root = advance_root(search, last);
+    EXPECT_EQ(move, new_root.get_move());
+    EXPECT_EQ(most_visits, new_root.get_visits());
+    EXPECT_EQ(linked, count_tt_entries(new_root));
+    search_tree(search, maingame, new_root, 100);
+    EXPECT_GT(count_tt_entries(new_root), linked);
+}
+
+// The simulations which ended in the subtree of node, by their
+// number, alpkt and beta, checking that node got the evaluations they
+// back up to it with the bonuses of the parent of node.
+struct Ending {
+    int visits;
+    float alpkt;
+    float beta;
+};
+static std::vector<Ending> check_sai_evals(const UCTNode& node) {
+    auto endings = std::vector<Ending>{};
+    auto children_visits = 0;
+    for (const auto& child : node.get_children()) {
+        if (!child.is_inflated() || child.get_visits() == 0) {
+            continue;
+        }
+        EXPECT_EQ(child->get_eval_bonus_father(), node.get_eval_bonus());
+        EXPECT_EQ(child->get_eval_base_father(), node.get_eval_base());
+        const auto child_endings = check_sai_evals(*child.get());
+        endings.insert(end(endings), begin(child_endings), end(child_endings));
+        children_visits += child.get_visits();
+    }
+    endings.push_back({node.get_visits() - children_visits,
+                       node.get_net_alpkt(), node.get_net_beta()});
+    auto sum = 0.0;
+    for (const auto& ending : endings) {
+        sum += ending.visits * double(Utils::sigmoid_interval_avg(
+            ending.alpkt, ending.beta,
+            node.get_eval_base_father(), node.get_eval_bonus_father()));
+    }
+    EXPECT_NEAR(sum, node.get_blackevals(), 1e-5 * node.get_visits());
+    return endings;
+}
+
+TEST_F(LeelaTest, ChangeKomiSai) {
+    auto& network = *GTP::s_network;
+    auto& maingame = get_gamestate();
+    UCTSearch search{maingame, network};
+    UCTNode root{FastBoard::PASS, 0.0f};
+    search_tree(search, maingame, root, 300);
+
+    // The test network has no SAI value head, only the shape of the
+    // tree is kept.
+    auto nodes = std::vector<SaiNode>{};
+    make_sai_tree(root, 0, nodes);
+    ASSERT_GT(nodes.size(), size_t{50});
+
+    const auto delta = 2.5f;
+    root.change_komi(delta, true, 0, false);
+    for (const auto& sai_node : nodes) {
+        const auto node = sai_node.node;
+        const auto alpkt = sai_node.alpkt - delta;
+        EXPECT_EQ(node->get_net_alpkt(), alpkt);
+        const auto expected =
+            Network::get_extended(alpkt, node->get_net_beta());
+        EXPECT_EQ(node->get_net_eval(), expected.pi);
+        // Terminal nodes keep their bonuses.
+        if (sai_node.passes < 2) {
+            EXPECT_EQ(node->get_eval_bonus(), expected.eval_bonus);
+            EXPECT_EQ(node->get_eval_base(), expected.eval_base);
+        }
+    }
+    check_sai_evals(root);
+}
+
+TEST_F(LeelaTest, ChangeKomiPruned) {
+    auto& network = *GTP::s_network;
+    auto& maingame = get_gamestate();
+    play_split_board(maingame);
+    UCTSearch search{maingame, network};
+
+    // The same search twice, the second one finds the evaluations in
+    // the cache.
+    UCTNode full{FastBoard::PASS, 0.0f};
+    UCTNode pruned{FastBoard::PASS, 0.0f};
+    search_tree(search, maingame, full, 400);
+    search_tree(search, maingame, pruned, 400);
+    auto full_sums = std::vector<std::pair<int, double>>{};
+    auto pruned_sums = std::vector<std::pair<int, double>>{};
+    tree_sums(full, full_sums);
+    tree_sums(pruned, pruned_sums);
+    ASSERT_EQ(full_sums, pruned_sums);
+
+    // Not the children of the root, as collect_tree().
+    auto subtrees = std::vector<std::pair<UCTNode*, int>>{};
+    auto pruned_visits = 0;
+    for (const auto& child : pruned.get_children()) {
+        if (child.is_inflated()) {
+            pruned_visits += prune_tree(*child.get(), 8, subtrees);
+        }
+    }
+    ASSERT_FALSE(subtrees.empty());
+    EXPECT_EQ(get_subtree_nodes(full), get_subtree_nodes(pruned));
+
+    // No change keeps the sums to the last bit.
+    full.change_komi(0.0f, false, 1, true);
+    pruned.change_komi(0.0f, false, 1, true);
+    EXPECT_EQ(full.get_blackevals(), pruned.get_blackevals());
+
+    // The pruned simulations keep their evaluations, which are off by
+    // at most one each.
+    full.change_komi(15.0f, false, 1, true);
+    pruned.change_komi(15.0f, false, 1, true);
+    EXPECT_EQ(full.get_visits(), pruned.get_visits());
+    EXPECT_NEAR(full.get_blackevals(), pruned.get_blackevals(),
+                pruned_visits);
+
+    // A pruned child visited again is not counted twice.
+    const auto parent = subtrees.front().first;
+    const auto nodes = get_subtree_nodes(*parent);
+    EXPECT_FALSE(parent->add_subtree_node(subtrees.front().second,
+                                          0.5f, 0.0f, 1.0f));
+    EXPECT_FALSE(parent->add_subtree_ending(subtrees.front().second, 0.0f));
+    EXPECT_EQ(nodes, get_subtree_nodes(*parent));
+}
+
+// Collects the nodes which collect_tree() must keep: the children of
+// the root and, below them, the contenders of each node kept.
+static void contenders(const UCTNode& node, const bool is_root,
+                       std::vector<const UCTNode*>& kept) {
+    auto max_visits = 0;
+    for (const auto& child : node.get_children()) {
+        max_visits = std::max(max_visits, child.get_visits());
+    }
+    for (const auto& child : node.get_children()) {
+        if (child.is_inflated()
+            && (is_root || 2 * child.get_visits() >= max_visits)) {
+            kept.emplace_back(child.get());
+            contenders(*child.get(), false, kept);
+        }
+    }
+}
+
+static void inflated_nodes(const UCTNode& node,
+                           std::vector<const UCTNode*>& nodes) {
+    for (const auto& child : node.get_children()) {
+        if (child.is_inflated()) {
+            nodes.emplace_back(child.get());
+            inflated_nodes(*child.get(), nodes);
+        }
+    }
+}
+
+TEST_F(LeelaTest, CollectTree) {
+    auto& network = *GTP::s_network;
+    auto& maingame = get_gamestate();
+    play_split_board(maingame);
+    UCTSearch search{maingame, network};
+    auto& root = set_root(search, std::make_unique<UCTNode>(FastBoard::PASS,
+                                                             0.0f));
+    search_tree(search, maingame, root, 2000);
+    ASSERT_EQ(size_t(get_nodes(search)),
+              root.count_nodes_and_clear_expand_state());
+
+    auto kept = std::vector<const UCTNode*>{};
+    contenders(root, true, kept);
+    auto before = std::vector<const UCTNode*>{};
+    inflated_nodes(root, before);
+    const auto visits = root.get_visits();
+    const auto blackevals = root.get_blackevals();
+
+    // As if the tree had just gone over TREE_COLLECT_START.
+    const auto max_tree_size = cfg_max_tree_size;
+    cfg_max_tree_size = size_t(UCTNodePointer::get_tree_size()
+                               / UCTSearch::TREE_COLLECT_START);
+    const auto collected = collect_tree(search);
+    EXPECT_TRUE(collected);
+    EXPECT_LT(UCTNodePointer::get_tree_size(),
+              UCTSearch::TREE_COLLECT_TARGET * cfg_max_tree_size);
+    cfg_max_tree_size = max_tree_size;
+
+    EXPECT_EQ(size_t(get_nodes(search)),
+              root.count_nodes_and_clear_expand_state());
+    auto after = std::vector<const UCTNode*>{};
+    inflated_nodes(root, after);
+    EXPECT_LT(after.size(), before.size());
+    std::sort(begin(after), end(after));
+    for (const auto node : kept) {
+        EXPECT_TRUE(std::binary_search(begin(after), end(after), node));
+    }
+    // The ancestors keep what the pruned nodes backed up.
+    EXPECT_EQ(visits, root.get_visits());
+    EXPECT_EQ(blackevals, root.get_blackevals());
+}
+
+// Checks the statistics of the subtree of each visited node against
+// the nodes, and returns the nodes of the subtree and the sum of their
+// network evaluations.
+static std::pair<int, double> check_subtree_stats(const UCTNode& node) {
+    auto nodes = 1;
+    auto eval_sum = double{node.get_net_eval()};
+    for (const auto& child : node.get_children()) {
+        if (child.is_inflated() && child.get_visits() > 0) {
+            const auto sums = check_subtree_stats(*child.get());
+            nodes += sums.first;
+            eval_sum += sums.second;
+        }
+    }
+    EXPECT_EQ(nodes, LeelaTest::get_subtree_nodes(node));
+    EXPECT_NEAR(eval_sum / nodes, node.get_azwinrate_avg(), 1e-5);
+    return {nodes, eval_sum};
+}
+
+TEST_F(LeelaTest, SubtreeStats) {
+    auto& network = *GTP::s_network;
+    auto& maingame = get_gamestate();
+    play_split_board(maingame);
+    UCTSearch search{maingame, network};
+    UCTNode root{FastBoard::PASS, 0.0f};
+    search_tree(search, maingame, root, 400);
+
+    // Without pruned subtrees, nothing is kept during the search, the
+    // statistics are computed when asked.
+    EXPECT_EQ(size_t{0}, root.get_subtree_stats_size());
+    check_subtree_stats(root);
+
+    // Computed again with the new evaluations.
+    root.change_komi(15.0f, false, 1, true);
+    check_subtree_stats(root);
+}
+
+// Appends the alpkt of the visited nodes of the subtree of node, from
+// state, to alpkts, and to tromp_taylor as many times as simulations
+// ended at them.
+static void subtree_alpkts(const UCTNode& node, const GameState& state,
+                           std::vector<float>& alpkts,
+                           std::vector<float>& tromp_taylor) {
+    alpkts.emplace_back(node.get_net_alpkt());
+    tromp_taylor.emplace_back(node.get_net_alpkt());
+    if (state.get_passes() >= 2) {
+        tromp_taylor.insert(end(tromp_taylor), node.get_visits() - 1,
+                            node.get_net_alpkt());
+    }
+    for (const auto& child : node.get_children()) {
+        if (child.is_inflated() && child.get_visits() > 0) {
+            auto next = state;
+            next.play_move(child.get_move());
+            subtree_alpkts(*child.get(), next, alpkts, tromp_taylor);
+        }
+    }
+}
+
+// The sketches merged up the tree are off by rank, not by value:
+// checks that estimate lies between the quantiles 1/4 and 3/4 of
+// values.
+static void expect_near_median(std::vector<float> values,
+                               const float estimate) {
+    std::sort(begin(values), end(values));
+    const auto last = values.size() - 1;
+    EXPECT_GE(estimate, values[last / 4]);
+    EXPECT_LE(estimate, values[last - last / 4]);
+}
+
+// Checks estimate_alpkt() of the root and its children, as
+// get_best_move() and fast_roll_out() ask them, against the medians of
+// the subtrees. Returns the number of subtrees with terminal nodes.
+static int check_alpkt_estimates(const UCTNode& root,
+                                 const GameState& state) {
+    auto checked = std::vector<std::pair<const UCTNode*, GameState>>{
+        {&root, state}};
+    for (const auto& child : root.get_children()) {
+        if (child.is_inflated() && child.get_visits() > 0) {
+            auto next = state;
+            next.play_move(child.get_move());
+            checked.emplace_back(child.get(), next);
+        }
+    }
+    auto terminals = 0;
+    for (const auto& node_state : checked) {
+        const auto& node = *node_state.first;
+        auto alpkts = std::vector<float>{};
+        auto tromp_taylor = std::vector<float>{};
+        subtree_alpkts(node, node_state.second, alpkts, tromp_taylor);
+        terminals += tromp_taylor.size() > alpkts.size();
+        // The sketches are exact up to 16 values.
+        const auto small = alpkts.size() <= 16;
+        const auto small_tromp_taylor = tromp_taylor.size() <= 16;
+        const auto exact = Utils::median(alpkts);
+        const auto exact_tromp_taylor = Utils::median(tromp_taylor);
+        if (small) {
+            EXPECT_EQ(exact, node.estimate_alpkt(0));
+        }
+        if (small_tromp_taylor) {
+            EXPECT_EQ(exact_tromp_taylor, node.estimate_alpkt(0, true));
+        }
+        expect_near_median(alpkts, node.estimate_alpkt(0));
+        expect_near_median(tromp_taylor, node.estimate_alpkt(0, true));
+    }
+    return terminals;
+}
+
+TEST_F(LeelaTest, EstimateAlpkt) {
+    auto& network = *GTP::s_network;
+    auto& maingame = get_gamestate();
+    play_split_board(maingame);
+    UCTSearch search{maingame, network};
+    UCTNode root{FastBoard::PASS, 0.0f};
+    search_tree(search, maingame, root, 400);
+
+    // The test network gives all the nodes the same alpkt, the
+    // terminal nodes have the scores of the board.
+    EXPECT_GT(check_alpkt_estimates(root, maingame), 0);
+
+    // Spread values, which the statistics get again from the nodes.
+    auto nodes = std::vector<SaiNode>{};
+    make_sai_tree(root, 1, nodes);
+    root.change_komi(0.0f, true, 1, true);
+    check_alpkt_estimates(root, maingame);
+}
+
 TEST_F(LeelaTest, MoveOnOccupiedPnt) {
     auto maingame = get_gamestate();
     std::string output;
@@ -0,0 +1,396 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2019 Michael O and contributors
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "NNCache.h"
+
+using Netresult = NNCache::Netresult;
+
+static Netresult make_result(std::uint64_t hash) {
+    auto result = Netresult{};
+    for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+        result.policy[i] = float((hash + i) % 97) / 97.0f;
+    }
+    result.policy_pass = 0.25f;
+    result.value = float(hash % 1000) / 1000.0f;
+    result.alpha = 1.5f;
+    result.beta = 0.5f;
+    result.is_sai = true;
+    return result;
+}
+
+// Spread test keys the way Zobrist hashes are spread.
+static std::uint64_t make_hash(std::uint64_t i) {
+    return (i + 1) * 0x9E3779B97F4A7C15ULL;
+}
+
+TEST(NNCacheTest, InsertLookup) {
+    NNCache cache(NNCache::MIN_CACHE_COUNT);
+    auto result = Netresult{};
+
+    EXPECT_FALSE(cache.lookup(make_hash(1), result));
+    cache.insert(make_hash(1), make_result(make_hash(1)));
+    ASSERT_TRUE(cache.lookup(make_hash(1), result));
+
+    const auto expected = make_result(make_hash(1));
+    EXPECT_EQ(result.policy, expected.policy);
+    EXPECT_EQ(result.policy_pass, expected.policy_pass);
+    EXPECT_EQ(result.value, expected.value);
+    EXPECT_EQ(result.alpha, expected.alpha);
+    EXPECT_EQ(result.beta, expected.beta);
+    EXPECT_EQ(result.is_sai, expected.is_sai);
+
+    EXPECT_EQ(cache.hit_rate().first, 1);
+    EXPECT_EQ(cache.hit_rate().second, 2);
+
+    cache.clear();
+    EXPECT_FALSE(cache.lookup(make_hash(1), result));
+}
+
+TEST(NNCacheTest, CompactFormats) {
+    const auto full = NNCache::get_entry_size(NNCache::Format::FULL);
+    EXPECT_LE(2 * NNCache::get_entry_size(NNCache::Format::HALF), full + 64);
+    EXPECT_LE(3 * NNCache::get_entry_size(NNCache::Format::LOG8), full);
+
+    // A softmax-like policy spanning several orders of magnitude.
+    auto input = make_result(make_hash(3));
+    auto sum = 0.0f;
+    for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+        input.policy[i] = std::exp(-0.05f * float(i));
+        sum += input.policy[i];
+    }
+    for (auto& p : input.policy) {
+        p /= sum;
+    }
+    input.policy[7] = 0.0f;
+
+    for (const auto format : {NNCache::Format::HALF, NNCache::Format::LOG8}) {
+        NNCache cache(NNCache::MIN_CACHE_COUNT, format);
+        cache.insert(make_hash(3), input);
+        auto result = Netresult{};
+        ASSERT_TRUE(cache.lookup(make_hash(3), result));
+        EXPECT_EQ(result.value, input.value);
+        EXPECT_EQ(result.alpha, input.alpha);
+        EXPECT_EQ(result.beta, input.beta);
+        EXPECT_EQ(result.policy_pass, input.policy_pass);
+        EXPECT_EQ(result.is_sai, input.is_sai);
+        EXPECT_EQ(result.policy[7], 0.0f);
+        for (auto i = 0; i < 100; i++) {
+            EXPECT_NEAR(result.policy[i], input.policy[i],
+                        0.04f * input.policy[i]);
+        }
+    }
+}
+
+TEST(NNCacheTest, BoundedSize) {
+    const auto size = NNCache::MIN_CACHE_COUNT;
+    NNCache cache(size);
+    for (auto i = 0; i < 4 * size; i++) {
+        cache.insert(make_hash(i), make_result(make_hash(i)));
+    }
+    EXPECT_LE(cache.get_estimated_size(),
+              (size + 64) * NNCache::get_entry_size(NNCache::Format::FULL));
+
+    // The most recent entries survive, the oldest ones are gone.
+    auto result = Netresult{};
+    auto recent_hits = 0;
+    for (auto i = 4 * size - 100; i < 4 * size; i++) {
+        recent_hits += cache.lookup(make_hash(i), result);
+    }
+    EXPECT_EQ(recent_hits, 100);
+    auto old_hits = 0;
+    for (auto i = 0; i < 100; i++) {
+        old_hits += cache.lookup(make_hash(i), result);
+    }
+    EXPECT_EQ(old_hits, 0);
+
+    // Shrinking keeps the newest entries.
+    cache.resize(size / 2);
+    recent_hits = 0;
+    for (auto i = 4 * size - 100; i < 4 * size; i++) {
+        recent_hits += cache.lookup(make_hash(i), result);
+    }
+    EXPECT_EQ(recent_hits, 100);
+}
+
+TEST(NNCacheTest, ClockEviction) {
+    const auto size = NNCache::MIN_CACHE_COUNT;
+    auto survivors = [size](NNCache::Eviction eviction) {
+        NNCache cache(size);
+        cache.set_eviction(eviction);
+        auto result = Netresult{};
+        // A few hot entries keep being hit while many
+        // one-shot entries stream through the cache.
+        auto key = 0;
+        for (; key < size; key++) {
+            cache.insert(make_hash(key), make_result(make_hash(key)));
+        }
+        for (auto round = 0; round < 500; round++) {
+            for (auto hot = 0; hot < 100; hot++) {
+                cache.lookup(make_hash(size - 1 - hot), result);
+            }
+            for (auto i = 0; i < 20; i++, key++) {
+                cache.insert(make_hash(key), make_result(make_hash(key)));
+            }
+        }
+        auto count = 0;
+        for (auto hot = 0; hot < 100; hot++) {
+            count += cache.lookup(make_hash(size - 1 - hot), result);
+        }
+        return count;
+    };
+    EXPECT_LT(survivors(NNCache::Eviction::FIFO), 10);
+    EXPECT_GT(survivors(NNCache::Eviction::CLOCK), 90);
+}
+
+TEST(NNCacheTest, ConcurrentAccess) {
+    NNCache cache(NNCache::MIN_CACHE_COUNT);
+    const auto count = 4 * NNCache::MIN_CACHE_COUNT;
+
+    auto bad = std::vector<int>(4, 0);
+    auto threads = std::vector<std::thread>{};
+    for (auto t = 0; t < 4; t++) {
+        threads.emplace_back([&cache, &bad, t, count]() {
+            auto result = Netresult{};
+            for (auto i = 0; i < count; i++) {
+                const auto hash = make_hash((i * 7 + t) % count);
+                if (cache.lookup(hash, result)) {
+                    // A hit must never see a torn entry.
+                    const auto expected = make_result(hash);
+                    bad[t] += result.policy != expected.policy
+                              || result.value != expected.value;
+                } else {
+                    cache.insert(hash, make_result(hash));
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto t = 0; t < 4; t++) {
+        EXPECT_EQ(bad[t], 0);
+    }
+}
+
+#ifndef _WIN32
+TEST(NNCacheTest, CacheFile) {
+    const auto filename = std::string{"nncache_unittest.cache"};
+    const auto size = size_t{4} * 1024 * 1024;
+    std::remove(filename.c_str());
+
+    auto result = Netresult{};
+    {
+        NNCache cache(0);
+        ASSERT_TRUE(cache.attach_file(filename, "net1", size));
+        cache.insert(make_hash(5), make_result(make_hash(5)));
+        EXPECT_TRUE(cache.lookup(make_hash(5), result));
+
+        // A second user of the file can read but not write.
+        NNCache reader(0);
+        ASSERT_TRUE(reader.attach_file(filename, "net1", size));
+        EXPECT_TRUE(reader.lookup(make_hash(5), result));
+        reader.insert(make_hash(6), make_result(make_hash(6)));
+        EXPECT_FALSE(cache.lookup(make_hash(6), result));
+
+        // But only if it uses the same network.
+        NNCache other(0);
+        EXPECT_FALSE(other.attach_file(filename, "net2", size));
+    }
+    {
+        // Entries survive.
+        NNCache cache(0);
+        ASSERT_TRUE(cache.attach_file(filename, "net1", size));
+        ASSERT_TRUE(cache.lookup(make_hash(5), result));
+        EXPECT_EQ(result.policy, make_result(make_hash(5)).policy);
+    }
+    {
+        // So does a table with another layout version, which follows
+        // the magic in the header.
+        std::fstream file(filename, std::ios::in | std::ios::out
+                                    | std::ios::binary);
+        const auto version = std::uint32_t{0xffff};
+        file.seekp(sizeof(std::uint64_t));
+        file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    }
+    {
+        NNCache cache(0);
+        ASSERT_TRUE(cache.attach_file(filename, "net1", size));
+        EXPECT_FALSE(cache.lookup(make_hash(5), result));
+    }
+    {
+        NNCache cache(0);
+        ASSERT_TRUE(cache.attach_file(filename, "net1", size));
+        cache.insert(make_hash(5), make_result(make_hash(5)));
+    }
+    {
+        NNCache reader(0);
+        {
+            NNCache cache(0);
+            ASSERT_TRUE(cache.attach_file(filename, "net1", size));
+            ASSERT_TRUE(reader.attach_file(filename, "net1", size));
+        }
+        // A different network starts over, in a new file, so those
+        // still reading the old one can go on.
+        NNCache cache(0);
+        ASSERT_TRUE(cache.attach_file(filename, "net2", size));
+        EXPECT_FALSE(cache.lookup(make_hash(5), result));
+        cache.insert(make_hash(6), make_result(make_hash(6)));
+        EXPECT_TRUE(reader.lookup(make_hash(5), result));
+        EXPECT_FALSE(reader.lookup(make_hash(6), result));
+    }
+    {
+        // So does another size.
+        NNCache cache(0);
+        ASSERT_TRUE(cache.attach_file(filename, "net2", 2 * size));
+        EXPECT_FALSE(cache.lookup(make_hash(6), result));
+    }
+    std::remove(filename.c_str());
+}
+
+TEST(NNCacheTest, SharedCache) {
+    const auto name = std::string{"/sai-nncache-unittest"};
+    const auto size = size_t{4} * 1024 * 1024;
+    shm_unlink(name.c_str());
+
+    auto result = Netresult{};
+    {
+        NNCache first(0);
+        ASSERT_TRUE(first.attach_shared(name, "net1", size));
+        NNCache second(0);
+        ASSERT_TRUE(second.attach_shared(name, "net1", 2 * size));
+        EXPECT_EQ(first.get_estimated_size(), second.get_estimated_size());
+
+        // Both processes read and write the same table.
+        first.insert(make_hash(5), make_result(make_hash(5)));
+        ASSERT_TRUE(second.lookup(make_hash(5), result));
+        EXPECT_EQ(result.policy, make_result(make_hash(5)).policy);
+        second.insert(make_hash(6), make_result(make_hash(6)));
+        EXPECT_TRUE(first.lookup(make_hash(6), result));
+
+        NNCache other(0);
+        EXPECT_FALSE(other.attach_shared(name, "net2", size));
+    }
+    // The last process removed it.
+    EXPECT_LT(shm_open(name.c_str(), O_RDWR, 0600), 0);
+
+    {
+        // A segment whose creator died before setting it up is
+        // started over.
+        const auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(ftruncate(fd, size), 0);
+        close(fd);
+
+        NNCache cache(0);
+        ASSERT_TRUE(cache.attach_shared(name, "net1", size));
+        cache.insert(make_hash(5), make_result(make_hash(5)));
+        EXPECT_TRUE(cache.lookup(make_hash(5), result));
+    }
+    shm_unlink(name.c_str());
+}
+
+TEST(NNCacheTest, SharedConcurrentAccess) {
+    const auto name = std::string{"/sai-nncache-unittest"};
+    const auto size = size_t{1024} * 1024;
+    shm_unlink(name.c_str());
+
+    // Slots are claimed with a compare-and-swap on seq instead of the
+    // shard locks, by each of the processes.
+    NNCache first(0);
+    ASSERT_TRUE(first.attach_shared(name, "net1", size));
+    NNCache second(0);
+    ASSERT_TRUE(second.attach_shared(name, "net1", size));
+    const auto count = 4000;
+
+    auto bad = std::vector<int>(4, 0);
+    auto threads = std::vector<std::thread>{};
+    for (auto t = 0; t < 4; t++) {
+        auto& cache = t % 2 ? second : first;
+        threads.emplace_back([&cache, &bad, t, count]() {
+            auto result = Netresult{};
+            for (auto i = 0; i < count; i++) {
+                const auto hash = make_hash((i * 7 + t) % count);
+                if (cache.lookup(hash, result)) {
+                    const auto expected = make_result(hash);
+                    bad[t] += result.policy != expected.policy
+                              || result.value != expected.value;
+                } else {
+                    cache.insert(hash, make_result(hash));
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto t = 0; t < 4; t++) {
+        EXPECT_EQ(bad[t], 0);
+    }
+}
+
+TEST(NNCacheTest, RemoveUnusedShared) {
+    const auto prefix = std::string{"/sai-nncache-unittest"};
+    const auto used = prefix + "-used";
+    const auto unused = prefix + "-unused";
+    const auto size = size_t{1024} * 1024;
+
+    const auto fd = shm_open(unused.c_str(), O_RDWR | O_CREAT, 0600);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    NNCache cache(0);
+    ASSERT_TRUE(cache.attach_shared(used, "net1", size));
+
+    NNCache::remove_unused_shared(prefix);
+#ifdef __linux__
+    EXPECT_LT(shm_open(unused.c_str(), O_RDWR, 0600), 0);
+#endif
+    const auto still_there = shm_open(used.c_str(), O_RDWR, 0600);
+    EXPECT_GE(still_there, 0);
+    close(still_there);
+    shm_unlink(unused.c_str());
+}
+#endif
@@ -0,0 +1,92 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2019 Michael O and contributors
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "NodePool.h"
+
+TEST(NodePoolTest, DistinctBlocks) {
+    auto blocks = std::vector<char*>{};
+    for (auto i = 0; i < 10000; i++) {
+        const auto size = size_t(8 + (i % 300) * 8);
+        auto p = static_cast<char*>(NodePool::allocate(size));
+        EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(p) % 16);
+        std::memset(p, i & 0xff, size);
+        blocks.emplace_back(p);
+    }
+    EXPECT_EQ(blocks.size(),
+              std::set<char*>(begin(blocks), end(blocks)).size());
+    for (auto i = 0; i < 10000; i++) {
+        const auto size = size_t(8 + (i % 300) * 8);
+        EXPECT_EQ(char(i & 0xff), blocks[i][size - 1]);
+        NodePool::deallocate(blocks[i], size);
+    }
+
+    // Large requests bypass the pool.
+    auto p = NodePool::allocate(NodePool::MAX_BYTES + 1);
+    NodePool::deallocate(p, NodePool::MAX_BYTES + 1);
+}
+
+TEST(NodePoolTest, ReleasedByOtherThread) {
+    // A thread which only releases gives the blocks back to the others.
+    // Uses a size no other test does, so that all the blocks of its
+    // class are ones allocated here.
+    constexpr auto COUNT = 10000;
+    constexpr auto SIZE = size_t{3200};
+    auto blocks = std::vector<void*>{};
+    for (auto i = 0; i < COUNT; i++) {
+        blocks.emplace_back(NodePool::allocate(SIZE));
+    }
+    std::thread([&blocks]() {
+        for (auto p : blocks) {
+            NodePool::deallocate(p, SIZE);
+        }
+    }).join();
+
+    auto reused = 0;
+    std::sort(begin(blocks), end(blocks));
+    auto again = std::vector<void*>{};
+    for (auto i = 0; i < COUNT; i++) {
+        again.emplace_back(NodePool::allocate(SIZE));
+        reused += std::binary_search(begin(blocks), end(blocks), again.back());
+    }
+    EXPECT_EQ(COUNT, reused);
+    for (auto p : again) {
+        NodePool::deallocate(p, SIZE);
+    }
+}
@@ -0,0 +1,115 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2019 Michael O and contributors
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "QuantileSketch.h"
+#include "Utils.h"
+
+TEST(QuantileSketchTest, ExactWhenSmall) {
+    auto sketch = QuantileSketch{};
+    EXPECT_TRUE(sketch.empty());
+    EXPECT_EQ(0.0f, sketch.median());
+
+    auto values = std::vector<float>{};
+    for (auto v : {3.0f, -1.5f, 8.0f, 0.25f, 3.0f, 12.0f, -7.0f}) {
+        sketch.add(v);
+        values.emplace_back(v);
+        auto copy = values;
+        EXPECT_FLOAT_EQ(Utils::median(copy), sketch.median());
+    }
+    EXPECT_EQ(values.size(), sketch.count());
+    EXPECT_FLOAT_EQ(-7.0f, sketch.quantile(0.0f));
+    EXPECT_FLOAT_EQ(12.0f, sketch.quantile(1.0f));
+
+    sketch.clear();
+    EXPECT_TRUE(sketch.empty());
+}
+
+TEST(QuantileSketchTest, ApproximateMedian) {
+    auto rng = std::mt19937{1234};
+    auto normal = std::normal_distribution<float>{5.0f, 20.0f};
+    auto sketch = QuantileSketch{};
+    auto values = std::vector<float>{};
+    for (auto i = 0; i < 20000; i++) {
+        const auto v = normal(rng);
+        sketch.add(v);
+        values.emplace_back(v);
+    }
+    std::sort(begin(values), end(values));
+    const auto rank = [&values](const float v) {
+        return float(std::lower_bound(begin(values), end(values), v)
+                     - begin(values)) / values.size();
+    };
+    EXPECT_NEAR(0.5f, rank(sketch.median()), 0.01f);
+    EXPECT_NEAR(0.25f, rank(sketch.quantile(0.25f)), 0.05f);
+    EXPECT_NEAR(0.75f, rank(sketch.quantile(0.75f)), 0.05f);
+}
+
+TEST(QuantileSketchTest, Merge) {
+    auto rng = std::mt19937{4321};
+    auto uniform = std::uniform_real_distribution<float>{-50.0f, 50.0f};
+    auto left = QuantileSketch{};
+    auto right = QuantileSketch{};
+    auto values = std::vector<float>{};
+    for (auto i = 0; i < 5000; i++) {
+        const auto v = uniform(rng);
+        left.add(v);
+        values.emplace_back(v);
+    }
+    for (auto i = 0; i < 3000; i++) {
+        const auto v = uniform(rng) + 30.0f;
+        right.add(v);
+        values.emplace_back(v);
+    }
+    left.merge(right);
+    EXPECT_EQ(values.size(), left.count());
+
+    std::sort(begin(values), end(values));
+    const auto pos = std::lower_bound(begin(values), end(values),
+                                      left.median()) - begin(values);
+    EXPECT_NEAR(0.5f, float(pos) / values.size(), 0.01f);
+
+    // Merging few values is exact.
+    auto small = QuantileSketch{};
+    auto other = QuantileSketch{};
+    small.add(1.0f);
+    small.add(5.0f);
+    other.add(2.0f);
+    other.add(9.0f);
+    other.add(4.0f);
+    small.merge(other);
+    EXPECT_FLOAT_EQ(4.0f, small.median());
+}
@@ -0,0 +1,128 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2019 Michael O and contributors
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "ThreadPool.h"
+
+using namespace Utils;
+
+TEST(ThreadPoolTest, RunsEveryTask) {
+    ThreadPool pool;
+    pool.initialize(4);
+
+    auto done = std::vector<std::atomic<int>>(10000);
+    ThreadGroup tg(pool);
+    tg.add_range(done.size(), [&done](size_t i) { done[i]++; });
+    tg.wait_all();
+    for (const auto& d : done) {
+        EXPECT_EQ(1, d.load());
+    }
+
+    // The group can be used again, and parallel_for() on its own.
+    std::atomic<size_t> sum{0};
+    for (auto i = 0; i < 100; i++) {
+        tg.add_task([&sum, i]() { sum += i; });
+    }
+    tg.wait_all();
+    parallel_for(pool, 1000, [&sum](size_t i) { sum += i; });
+    EXPECT_EQ(size_t{4950 + 499500}, sum.load());
+}
+
+TEST(ThreadPoolTest, NestedGroups) {
+    ThreadPool pool;
+    pool.initialize(2);
+
+    // Every thread of the pool waits for a group of its own, whose
+    // tasks are run by the waiting threads.
+    std::atomic<int> count{0};
+    ThreadGroup outer(pool);
+    for (auto i = 0; i < 8; i++) {
+        outer.add_task([&pool, &count]() {
+            parallel_for(pool, 100, [&count](size_t) { count++; });
+        });
+    }
+    outer.wait_all();
+    EXPECT_EQ(800, count.load());
+}
+
+TEST(ThreadPoolTest, Exceptions) {
+    ThreadPool pool;
+    pool.initialize(2);
+
+    std::atomic<int> count{0};
+    ThreadGroup tg(pool);
+    for (auto i = 0; i < 10; i++) {
+        tg.add_task([&count, i]() {
+            count++;
+            if (i == 5) {
+                throw std::runtime_error("task");
+            }
+        });
+    }
+    EXPECT_THROW(tg.wait_all(), std::runtime_error);
+    EXPECT_EQ(10, count.load());
+    tg.wait_all();
+}
+
+TEST(ThreadPoolTest, Tasks) {
+    // Small callables are stored in place, large ones on the heap.
+    auto shared = std::make_shared<int>(0);
+    auto big = std::array<int, 64>{};
+    big[63] = 2;
+    {
+        auto small_task = Task([shared]() { ++*shared; });
+        auto big_task = Task([shared, big]() { *shared += big[63]; });
+        auto moved = std::move(small_task);
+        moved();
+        big_task();
+        auto moved_big = Task{};
+        moved_big = std::move(big_task);
+        moved_big();
+        EXPECT_EQ(5, *shared);
+        EXPECT_EQ(3, shared.use_count());
+    }
+    EXPECT_EQ(1, shared.use_count());
+
+    // Without threads, tasks run when they are added.
+    ThreadPool pool;
+    ThreadGroup tg(pool);
+    tg.add_task([shared]() { ++*shared; });
+    EXPECT_EQ(6, *shared);
+    tg.wait_all();
+}
@@ -0,0 +1,99 @@
+/*
+    This file is part of SAI, which is a fork of Leela Zero.
+    Copyright (C) 2017-2019 Michael O and contributors
+
+    SAI is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SAI is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SAI.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include <gtest/gtest.h>
+
+#include "config.h"
+
+#include <cstdint>
+#include <set>
+
+#include "TTable.h"
+
+TEST(TTableTest, Entries) {
+    TTable table{1000};
+
+    auto entries = std::set<TTable::Entry*>{};
+    for (auto key = std::uint64_t{1}; key <= 100; key++) {
+        const auto entry = table.get_entry(key * 0x9E3779B97F4A7C15ULL);
+        ASSERT_NE(nullptr, entry);
+        EXPECT_EQ(0, entry->visits);
+        EXPECT_EQ(1, entry->refs);
+        entry->visits++;
+        entries.emplace(entry);
+    }
+    EXPECT_EQ(100u, entries.size());
+
+    // Found again with its statistics.
+    const auto entry = table.get_entry(7 * 0x9E3779B97F4A7C15ULL);
+    EXPECT_EQ(1u, entries.count(entry));
+    EXPECT_EQ(1, entry->visits);
+    EXPECT_EQ(2, entry->refs);
+
+    // Kept once released, until another key takes it over.
+    TTable::release(entry);
+    TTable::release(entry);
+    EXPECT_EQ(entry, table.get_entry(7 * 0x9E3779B97F4A7C15ULL));
+    EXPECT_EQ(1, entry->visits);
+}
+
+TEST(TTableTest, Full) {
+    // Only a few slots are probed for a key.
+    TTable table{16};
+    auto entries = std::set<TTable::Entry*>{};
+    for (auto key = std::uint64_t{1}; key <= 16; key++) {
+        if (const auto entry = table.get_entry(key << 4)) {
+            entries.emplace(entry);
+        }
+    }
+    EXPECT_GT(16u, entries.size());
+    EXPECT_EQ(nullptr, table.get_entry(17 << 4));
+
+    // The released entries are taken over by new keys.
+    for (const auto entry : entries) {
+        entry->visits++;
+        TTable::release(entry);
+    }
+    const auto entry = table.get_entry(17 << 4);
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ(1u, entries.count(entry));
+    EXPECT_EQ(0, entry->visits);
+    EXPECT_EQ(1, entry->refs);
+}
+
+TEST(TTableTest, Key) {
+    EXPECT_EQ(12345u, TTable::get_key(12345, 0.0f, 0.0f, 0.0f));
+    EXPECT_NE(TTable::get_key(12345, 0.0f, 0.5f, 0.0f),
+              TTable::get_key(12345, 0.0f, 0.0f, 0.5f));
+    EXPECT_NE(TTable::get_key(12345, 7.5f, 0.0f, 0.0f),
+              TTable::get_key(12345, 0.5f, 0.0f, 0.0f));
+    EXPECT_EQ(TTable::get_key(12345, -0.0f, 0.0f, 0.0f),
+              TTable::get_key(12345, 0.0f, 0.0f, 0.0f));
+    EXPECT_NE(0u, TTable::get_key(0, 0.0f, 0.0f, 0.0f));
+}